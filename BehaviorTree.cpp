@@ -6,9 +6,23 @@
  * Credits:         Alex J. Champandard
  *****************************************************************************/
 
+#include <stdint.h>
+#include <string.h>
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sstream>
+#include <typeinfo>
 #include "Shared.h"
+#include "Blackboard.h"
 #include "Test.h"
+#include "Benchmark.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "Metrics.h"
 
 namespace bt1
 {
@@ -27,6 +41,79 @@ enum Status
     BH_ABORTED,
 };
 
+class Snapshot
+/**
+ * Flat copy of the dynamic state of a tree: statuses, current children as
+ * indices, counters.  The layout only depends on the shape of the tree, so
+ * it can be restored into the same tree or any copy of it, for rollback or
+ * to move an agent elsewhere.  Clearing keeps the memory, so taking a
+ * snapshot every frame doesn't allocate once the buffer has grown.
+ */
+{
+public:
+    Snapshot()
+    :	m_iRead(0)
+    {
+    }
+
+    void clear()
+    {
+        m_Data.clear();
+        m_iRead = 0;
+    }
+
+    // Start reading from the beginning again.
+    void rewind()
+    {
+        m_iRead = 0;
+    }
+
+    template <class T>
+    void write(const T& value)
+    {
+        size_t at = m_Data.size();
+        m_Data.resize(at + sizeof(T));
+        memcpy(&m_Data[at], &value, sizeof(T));
+    }
+
+    template <class T>
+    T read()
+    {
+        ASSERT(m_iRead + sizeof(T) <= m_Data.size());
+        T value;
+        memcpy(&value, &m_Data[m_iRead], sizeof(T));
+        m_iRead += sizeof(T);
+        return value;
+    }
+
+    bool isAtEnd() const
+    {
+        return m_iRead == m_Data.size();
+    }
+
+    // The raw bytes, to send or store elsewhere and assign() back later.
+    const uint8_t* getData() const
+    {
+        return m_Data.empty() ? NULL : &m_Data[0];
+    }
+
+    size_t getSize() const
+    {
+        return m_Data.size();
+    }
+
+    void assign(const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        m_Data.assign(bytes, bytes + size);
+        m_iRead = 0;
+    }
+
+private:
+    std::vector<uint8_t> m_Data;
+    size_t m_iRead;
+};
+
 class Behavior
 /**
  * Base class for actions, conditions and composites.
@@ -38,6 +125,20 @@ public:
     virtual void onInitialize()			{}
     virtual void onTerminate(Status)	{}
 
+    // Append this node's dynamic state, then its children's, to a snapshot.
+    // Behaviors with state of their own extend both functions, calling the
+    // base version first.  Restoring calls neither onInitialize() nor
+    // onTerminate().
+    virtual void save(Snapshot& snapshot) const
+    {
+        snapshot.write<uint8_t>(static_cast<uint8_t>(m_eStatus));
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        m_eStatus = static_cast<Status>(snapshot.read<uint8_t>());
+    }
+
     Behavior()
     :   m_eStatus(BH_INVALID)
     {
@@ -48,16 +149,37 @@ public:
     }
 
     Status tick()
+    {
+        beginTick();
+        return endTick();
+    }
+
+    // The two halves of tick(), for callers that update behaviors on other
+    // threads but want their onTerminate() calls on their own, in order.
+    Status beginTick()
     {
         if (m_eStatus != BH_RUNNING)
         {
+            PROFILE_INITIALIZE(this);
+            TRACE_INITIALIZE(this);
             onInitialize();
         }
 
+        PROFILE_UPDATE_BEGIN(this);
+        TRACE_UPDATE_BEGIN(this);
+        METRICS_ADD(COUNTER_NODE_UPDATES, 1);
         m_eStatus = update();
+        PROFILE_UPDATE_END(this);
+        TRACE_UPDATE_END(this, m_eStatus);
+        return m_eStatus;
+    }
 
+    Status endTick()
+    {
         if (m_eStatus != BH_RUNNING)
         {
+            PROFILE_TERMINATE(this);
+            TRACE_TERMINATE(this, m_eStatus);
             onTerminate(m_eStatus);
         }
         return m_eStatus;
@@ -70,6 +192,7 @@ public:
 
     void abort()
     {
+        METRICS_ADD(COUNTER_ABORTS, 1);
         onTerminate(BH_ABORTED);
         m_eStatus = BH_ABORTED;
     }
@@ -89,7 +212,21 @@ public:
         return m_eStatus;
     }
 
+protected:
+    // Where a running sequence or selector carries on from once its current
+    // child terminates, which lets the ActivePath skip over it.  Behaviors
+    // that do anything else while running keep this default, and are ticked
+    // as a whole.
+    struct ResumePoint;
+
+    virtual bool getResumePoint(ResumePoint&)
+    {
+        return false;
+    }
+
 private:
+    friend class ActivePath;
+
     Status m_eStatus;
 };
 
@@ -163,471 +300,2394 @@ TEST(StarterKit1, TaskTerminate)
     CHECK_EQUAL(1, t.m_iTerminateCalled);
 };
 
-// ============================================================================
+TEST(Profiler, RecordsPerNode)
+{
+    profile::ThreadProfile p;
+    int a, b;
+
+    p.recordInitialize(&a);
+    p.recordUpdate(&a, 10);
+    p.recordUpdate(&a, 30);
+    p.recordTerminate(&a);
+    p.recordUpdate(&b, 5);
+
+    CHECK_EQUAL(2u, p.getNodeCount());
+    const profile::NodeProfile* pa = p.getProfile(&a);
+    CHECK(pa != NULL);
+    CHECK_EQUAL(2u, pa->m_iUpdateCount);
+    CHECK_EQUAL(1u, pa->m_iInitializeCount);
+    CHECK_EQUAL(1u, pa->m_iTerminateCount);
+    CHECK_EQUAL(40u, pa->m_iTotalTime);
+    CHECK_EQUAL(30u, pa->m_iMaxTime);
+    CHECK_EQUAL(5u, p.getProfile(&b)->m_iTotalTime);
+    CHECK(p.getProfile(&p) == NULL);
+
+    p.clear();
+    CHECK_EQUAL(0u, p.getNodeCount());
+    CHECK(p.getProfile(&a) == NULL);
+};
 
-class Decorator : public Behavior
+#if defined(BTSK_PROFILE)
+TEST(Profiler, HooksBehaviorTick)
 {
-protected:
-    Behavior* m_pChild;
+    profile::ThreadProfile::getInstance().clear();
+    MockBehavior t;
+    t.tick();
+    t.m_eReturnStatus = BH_SUCCESS;
+    t.tick();
 
-public:
-    Decorator(Behavior* child) : m_pChild(child) {}
+    const profile::NodeProfile* p = profile::ThreadProfile::getInstance().getProfile(&t);
+    CHECK(p != NULL);
+    CHECK_EQUAL(2u, p->m_iUpdateCount);
+    CHECK_EQUAL(1u, p->m_iInitializeCount);
+    CHECK_EQUAL(1u, p->m_iTerminateCount);
 };
+#endif
 
-class Repeat : public Decorator
+TEST(Trace, LogRoundTrip)
 {
-public:
-	Repeat(Behavior* child)
-	:	Decorator(child)
-	{
-	}
-
-    void setCount(int count)
+    int a, b;
+    trace::Record first[] =
     {
-        m_iLimit = count;
-    }
-
-    void onInitialize() 
+        { 1000, &a, 0, trace::EVENT_INITIALIZE, 0 },
+        { 1010, &a, 0, trace::EVENT_UPDATE_BEGIN, 0 },
+        { 1500, &a, 7, trace::EVENT_UPDATE_END, BH_SUCCESS },
+    };
+    trace::Record second[] =
     {
-        m_iCounter = 0;
-    }
+        { 900, &b, 3, trace::EVENT_UPDATE_BEGIN, 0 },
+        { 2000, &a, 3, trace::EVENT_TERMINATE, BH_FAILURE },
+    };
 
-    Status update() 
+    std::ostringstream out;
+    trace::Writer writer(out);
+    writer.write(0, first, 3);
+    writer.write(1, second, 2);
+    std::string log = out.str();
+    CHECK(log.size() < sizeof(trace::Header) + sizeof(first) + sizeof(second));
+
+    std::vector<trace::Entry> entries;
+    std::vector<uint64_t> nodes;
+    std::string error;
+    CHECK(trace::read((const uint8_t*)log.data(), log.size(), entries, nodes, error));
+    CHECK_EQUAL(5u, entries.size());
+    CHECK_EQUAL(2u, nodes.size());
+    CHECK_EQUAL((uint64_t)(uintptr_t)&a, nodes[0]);
+
+    CHECK_EQUAL(1500u, entries[2].m_iTime);
+    CHECK_EQUAL(7u, entries[2].m_iAgent);
+    CHECK_EQUAL((uint8_t)BH_SUCCESS, entries[2].m_iStatus);
+    CHECK_EQUAL(1u, entries[3].m_iThread);
+    CHECK_EQUAL(1u, entries[3].m_iNode);
+    CHECK_EQUAL(2000u, entries[4].m_iTime);
+    CHECK_EQUAL(0u, entries[4].m_iNode);
+    CHECK_EQUAL((uint8_t)trace::EVENT_TERMINATE, entries[4].m_iEvent);
+
+    CHECK(!trace::read((const uint8_t*)log.data(), log.size() - 1, entries, nodes, error));
+}
+
+TEST(Trace, BufferDropsWhenFull)
+{
+    trace::ThreadBuffer buffer(0);
+    trace::Record r = { 0, NULL, 0, trace::EVENT_INITIALIZE, 0 };
+    for (size_t i=0; i<trace::k_TraceBufferSize + 2; ++i)
     {
-        for (;;)
-        {
-            m_pChild->tick();
-            if (m_pChild->getStatus() == BH_RUNNING) break;
-            if (m_pChild->getStatus() == BH_FAILURE) return BH_FAILURE;
-            if (++m_iCounter == m_iLimit) return BH_SUCCESS;
-            m_pChild->reset();
-        }
-        return BH_INVALID;
+        r.m_iTime = i;
+        buffer.push(r);
     }
+    CHECK_EQUAL(2u, buffer.getDroppedCount());
 
-protected:
-    int m_iLimit;
-    int m_iCounter;
-};
+    trace::Record out[4];
+    CHECK_EQUAL(4u, buffer.pop(out, 4));
+    CHECK_EQUAL(3u, out[3].m_iTime);
+    buffer.push(r);
+    CHECK_EQUAL(2u, buffer.getDroppedCount());
+}
+
+#if defined(BTSK_TRACE)
+TEST(Trace, HooksBehaviorTick)
+{
+    std::ostringstream out;
+    trace::Writer writer(out);
+    trace::Recorder& recorder = trace::Recorder::getInstance();
+    recorder.drain(writer);
+
+    MockBehavior t;
+    t.m_eReturnStatus = BH_SUCCESS;
+    trace::setAgent(42);
+    recorder.setEnabled(true);
+    t.tick();
+    recorder.setEnabled(false);
+    trace::setAgent(0);
+    recorder.drain(writer);
+
+    std::string log = out.str();
+    std::vector<trace::Entry> entries;
+    std::vector<uint64_t> nodes;
+    std::string error;
+    CHECK(trace::read((const uint8_t*)log.data(), log.size(), entries, nodes, error));
+    CHECK_EQUAL(4u, entries.size());
+    CHECK_EQUAL((uint8_t)trace::EVENT_INITIALIZE, entries[0].m_iEvent);
+    CHECK_EQUAL((uint8_t)trace::EVENT_TERMINATE, entries[3].m_iEvent);
+    CHECK_EQUAL((uint8_t)BH_SUCCESS, entries[3].m_iStatus);
+    CHECK_EQUAL(42u, entries[3].m_iAgent);
+    CHECK(entries[0].m_iTime <= entries[3].m_iTime);
+}
+#endif
+
+TEST(Metrics, CollectMergesThreads)
+{
+    metrics::Snapshot before, after;
+    metrics::collect(before);
+    metrics::add(metrics::COUNTER_TREE_TICKS, 2);
+    std::thread other(metrics::add, metrics::COUNTER_TREE_TICKS, 3);
+    other.join();
+    metrics::collect(after);
+    CHECK_EQUAL(5, after.get(metrics::COUNTER_TREE_TICKS) - before.get(metrics::COUNTER_TREE_TICKS));
+}
+
+TEST(Metrics, WritesPrometheusText)
+{
+    metrics::Snapshot snapshot = { { 0 } };
+    snapshot.m_Values[metrics::GAUGE_ARENA_BYTES] = 128;
+    std::ostringstream out;
+    metrics::write(out, snapshot);
+    std::string text = out.str();
+    CHECK(text.find("# TYPE btsk_tree_ticks_total counter\nbtsk_tree_ticks_total 0\n") != std::string::npos);
+    CHECK(text.find("# TYPE btsk_arena_bytes gauge\nbtsk_arena_bytes 128\n") != std::string::npos);
+}
 
 // ============================================================================
 
-class Composite : public Behavior
+const size_t k_MaxConditionInputs = 4;
+
+class Condition : public Behavior
+/**
+ * Leaf that succeeds or fails depending on check().  Inputs are declared
+ * as version counters that get bumped whenever the data behind them
+ * changes, e.g. a blackboard entry or the world as a whole.  The result of
+ * check() is kept until one of them changes, so reactive parents like the
+ * ActiveSelector or the Monitor can re-run conditions every tick cheaply.
+ * A condition without inputs calls check() every time.
+ */
 {
 public:
-    void addChild(Behavior* child) { m_Children.push_back(child); }
-    void removeChild(Behavior*);
-    void clearChildren();
-protected:
-    typedef std::vector<Behavior*> Behaviors;
-    Behaviors m_Children;
-};
+    Condition()
+    :	m_iInputCount(0)
+    ,	m_bCached(false)
+    ,	m_bResult(false)
+    {
+    }
 
-class Sequence : public Composite
-{
-protected:
-    virtual ~Sequence()
+    void addInput(const uint32_t* version)
     {
+        ASSERT(m_iInputCount < k_MaxConditionInputs);
+        m_Inputs[m_iInputCount++] = version;
+        m_bCached = false;
     }
 
-    virtual void onInitialize()
+    // For changes the declared inputs don't track.
+    void invalidate()
     {
-        m_CurrentChild = m_Children.begin();
+        m_bCached = false;
+    }
+
+    // The cached result may not match a restored state, so check() again.
+    virtual void restore(Snapshot& snapshot)
+    {
+        Behavior::restore(snapshot);
+        m_bCached = false;
     }
 
+protected:
+    virtual bool check() = 0;
+
     virtual Status update()
     {
-        // Keep going until a child behavior says it's running.
-        for (;;)
+        if (!isCacheValid())
         {
-            Status s = (*m_CurrentChild)->tick();
-
-            // If the child fails, or keeps running, do the same.
-            if (s != BH_SUCCESS)
+            m_bResult = check();
+            for (size_t i=0; i<m_iInputCount; ++i)
             {
-                return s;
+                m_Versions[i] = *m_Inputs[i];
             }
+            m_bCached = m_iInputCount > 0;
+        }
+        return m_bResult ? BH_SUCCESS : BH_FAILURE;
+    }
 
-            // Hit the end of the array, job done!
-            if (++m_CurrentChild == m_Children.end())
+    bool isCacheValid() const
+    {
+        if (!m_bCached)
+        {
+            return false;
+        }
+        for (size_t i=0; i<m_iInputCount; ++i)
+        {
+            if (*m_Inputs[i] != m_Versions[i])
             {
-                return BH_SUCCESS;
+                return false;
             }
         }
+        return true;
     }
 
-    Behaviors::iterator m_CurrentChild;
+    const uint32_t* m_Inputs[k_MaxConditionInputs];
+    uint32_t m_Versions[k_MaxConditionInputs];
+    size_t m_iInputCount;
+    bool m_bCached;
+    bool m_bResult;
 };
 
-// ----------------------------------------------------------------------------
-
-template <class COMPOSITE>
-class MockComposite : public COMPOSITE
+struct MockCondition : public Condition
 {
-public:
-    MockComposite(size_t size)
-    {
-        for (size_t i=0; i<size; ++i)
-        {
-            COMPOSITE::m_Children.push_back(new MockBehavior);
-        }
-    }
+    int m_iCheckCalled;
+    bool m_bReturnValue;
 
-    ~MockComposite()
+    MockCondition()
+    :	m_iCheckCalled(0)
+    ,	m_bReturnValue(true)
     {
-        for (size_t i=0; i<COMPOSITE::m_Children.size(); ++i)
-        {
-            delete COMPOSITE::m_Children[i];
-        }
     }
 
-    MockBehavior& operator[](size_t index)
+    virtual bool check()
     {
-        ASSERT(index < COMPOSITE::m_Children.size());
-        return *static_cast<MockBehavior*>(COMPOSITE::m_Children[index]);
+        ++m_iCheckCalled;
+        return m_bReturnValue;
     }
 };
 
-typedef MockComposite<Sequence> MockSequence;
-
-TEST(StarterKit1, SequenceTwoChildrenFails)
+TEST(StarterKit1, ConditionCachedUntilInputChanges)
 {
-    MockSequence seq(2);
-
-    CHECK_EQUAL(seq.tick(), BH_RUNNING);
-    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
-
-    seq[0].m_eReturnStatus = BH_FAILURE;
-    CHECK_EQUAL(seq.tick(), BH_FAILURE);
-    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
-    CHECK_EQUAL(0, seq[1].m_iInitializeCalled);
+    uint32_t health = 0, world = 0;
+    MockCondition c;
+    c.addInput(&health);
+    c.addInput(&world);
+
+    CHECK_EQUAL(BH_SUCCESS, c.tick());
+    c.m_bReturnValue = false;
+    CHECK_EQUAL(BH_SUCCESS, c.tick());
+    CHECK_EQUAL(1, c.m_iCheckCalled);
+
+    ++world;
+    CHECK_EQUAL(BH_FAILURE, c.tick());
+    CHECK_EQUAL(BH_FAILURE, c.tick());
+    CHECK_EQUAL(2, c.m_iCheckCalled);
+
+    c.invalidate();
+    c.tick();
+    CHECK_EQUAL(3, c.m_iCheckCalled);
 }
 
-TEST(StarterKit1, SequenceTwoChildrenContinues)
+TEST(StarterKit1, ConditionWithoutInputs)
 {
-    MockSequence seq(2);
-
-    CHECK_EQUAL(seq.tick(), BH_RUNNING);
-    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
-    CHECK_EQUAL(0, seq[1].m_iInitializeCalled);
+    MockCondition c;
+    c.tick();
+    c.tick();
+    CHECK_EQUAL(2, c.m_iCheckCalled);
+}
 
-    seq[0].m_eReturnStatus = BH_SUCCESS;
-    CHECK_EQUAL(seq.tick(), BH_RUNNING);
-    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
-    CHECK_EQUAL(1, seq[1].m_iInitializeCalled);
+TEST(Blackboard, TypedEntries)
+{
+    blackboard::Layout layout;
+    blackboard::Key<bool> alert = layout.add<bool>("alert");
+    blackboard::Key<double> distance = layout.add<double>("distance");
+    blackboard::Key<int> ammo = layout.add<int>("ammo");
+    CHECK_EQUAL(3u, layout.getEntryCount());
+    CHECK_EQUAL(distance.m_iOffset, layout.add<double>("distance").m_iOffset);
+
+    blackboard::Key<int> found;
+    CHECK(layout.find("ammo", found));
+    CHECK_EQUAL(ammo.m_iOffset, found.m_iOffset);
+    CHECK(!layout.find("alert", found));
+
+    blackboard::Blackboard bb(layout);
+    CHECK(!bb.get(alert));
+    CHECK_EQUAL(0u, (uintptr_t)&bb.get(distance) % ALIGNOF(double));
+
+    uint32_t version = *bb.getVersion(ammo);
+    bb.set(ammo, 30);
+    CHECK_EQUAL(30, bb.get(ammo));
+    CHECK(*bb.getVersion(ammo) != version);
+
+    version = *bb.getVersion(ammo);
+    bb.set(ammo, 30);
+    CHECK_EQUAL(version, *bb.getVersion(ammo));
+
+    bb.clear();
+    CHECK_EQUAL(0, bb.get(ammo));
+    CHECK(*bb.getVersion(ammo) != version);
 }
 
-TEST(StarterKit1, SequenceOneChildPassThrough)
+struct HasAmmo : public Condition
 {
-    Status status[2] = { BH_SUCCESS, BH_FAILURE };
-    for (int i=0; i<2; ++i)
+    const blackboard::Blackboard& m_Blackboard;
+    blackboard::Key<int> m_Ammo;
+    int m_iCheckCalled;
+
+    HasAmmo(const blackboard::Blackboard& bb, blackboard::Key<int> ammo)
+    :	m_Blackboard(bb)
+    ,	m_Ammo(ammo)
+    ,	m_iCheckCalled(0)
     {
-        MockSequence seq(1);
-
-        CHECK_EQUAL(seq.tick(), BH_RUNNING);
-        CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+        addInput(bb.getVersion(ammo));
+    }
 
-        seq[0].m_eReturnStatus = status[i];
-        CHECK_EQUAL(seq.tick(), status[i]);
-        CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    virtual bool check()
+    {
+        ++m_iCheckCalled;
+        return m_Blackboard.get(m_Ammo) > 0;
     }
-}
+};
 
+TEST(StarterKit1, ConditionOnBlackboard)
+{
+    blackboard::Layout layout;
+    blackboard::Key<int> ammo = layout.add<int>("ammo");
+    blackboard::Blackboard bb(layout);
+    HasAmmo c(bb, ammo);
+
+    CHECK_EQUAL(BH_FAILURE, c.tick());
+    bb.set(ammo, 0);
+    CHECK_EQUAL(BH_FAILURE, c.tick());
+    CHECK_EQUAL(1, c.m_iCheckCalled);
+
+    bb.set(ammo, 5);
+    CHECK_EQUAL(BH_SUCCESS, c.tick());
+    CHECK_EQUAL(2, c.m_iCheckCalled);
+}
 
 // ============================================================================
 
-class Selector : public Composite
+class Decorator : public Behavior
 {
 protected:
-    virtual ~Selector()
+    Behavior* m_pChild;
+
+public:
+    Decorator(Behavior* child) : m_pChild(child) {}
+
+    virtual void save(Snapshot& snapshot) const
     {
+        Behavior::save(snapshot);
+        m_pChild->save(snapshot);
     }
 
-    virtual void onInitialize()
+    virtual void restore(Snapshot& snapshot)
     {
-        m_Current = m_Children.begin();
+        Behavior::restore(snapshot);
+        m_pChild->restore(snapshot);
     }
+};
 
-    virtual Status update()
+class Loop : public Decorator
+/**
+ * Base for decorators that tick their child over and over.  A budget caps
+ * how much of the loop runs in one tick: once it's spent the loop returns
+ * BH_RUNNING and carries on from there next tick, so a big loop over a
+ * child that finishes instantly doesn't take the whole frame.
+ */
+{
+public:
+    Loop(Behavior* child)
+    :	Decorator(child)
+    ,	m_iIterationBudget(0)
+    ,	m_iTimeBudget(0)
     {
-        // Keep going until a child behavior says its running.
-		for (;;)
-        {
-            Status s = (*m_Current)->tick();
+    }
 
-            // If the child succeeds, or keeps running, do the same.
-            if (s != BH_FAILURE)
-            {
-                return s;
-            }
+    // Child runs completed per tick, or zero for no limit.
+    void setIterationBudget(int iterations)
+    {
+        m_iIterationBudget = iterations;
+    }
 
-            // Hit the end of the array, it didn't end well...
-            if (++m_Current == m_Children.end())
-            {
-                return BH_FAILURE;
-            }
-        }
+    // Nanoseconds per tick, or zero for no limit.  It's checked after each
+    // run of the child, so at least one always completes.
+    void setTimeBudget(uint64_t nanoseconds)
+    {
+        m_iTimeBudget = nanoseconds;
     }
 
-    Behaviors::iterator m_Current;
-};
+protected:
+    uint64_t beginBudget() const
+    {
+        return m_iTimeBudget > 0 ? profile::now() : 0;
+    }
 
-// ----------------------------------------------------------------------------
+    bool isBudgetSpent(int iterations, uint64_t start) const
+    {
+        if (m_iIterationBudget > 0  &&  iterations >= m_iIterationBudget)
+        {
+            return true;
+        }
+        return m_iTimeBudget > 0  &&  profile::now() - start >= m_iTimeBudget;
+    }
 
-typedef MockComposite<Selector> MockSelector;
+    int m_iIterationBudget;
+    uint64_t m_iTimeBudget;
+};
 
-TEST(StarterKit1, SelectorTwoChildrenContinues)
+class Repeat : public Loop
 {
-    MockSelector seq(2);
+public:
+	Repeat(Behavior* child)
+	:	Loop(child)
+	,	m_iLimit(0)
+	,	m_iCounter(0)
+	{
+	}
+
+    virtual void save(Snapshot& snapshot) const
+    {
+        Loop::save(snapshot);
+        snapshot.write<int32_t>(m_iCounter);
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Loop::restore(snapshot);
+        m_iCounter = snapshot.read<int32_t>();
+    }
+
+    void setCount(int count)
+    {
+        m_iLimit = count;
+    }
+
+    void onInitialize() 
+    {
+        m_iCounter = 0;
+    }
+
+    Status update() 
+    {
+        uint64_t start = beginBudget();
+        for (int iterations=1; ; ++iterations)
+        {
+            m_pChild->tick();
+            if (m_pChild->getStatus() == BH_RUNNING) return BH_RUNNING;
+            if (m_pChild->getStatus() == BH_FAILURE) return BH_FAILURE;
+            if (++m_iCounter == m_iLimit) return BH_SUCCESS;
+            m_pChild->reset();
+            if (isBudgetSpent(iterations, start)) return BH_RUNNING;
+        }
+    }
+
+protected:
+    int m_iLimit;
+    int m_iCounter;
+};
+
+class RepeatUntilFail : public Loop
+/**
+ * Runs the child again each time it succeeds, and succeeds itself once the
+ * child fails.  Set a budget unless the child can be relied on to fail or
+ * keep running within a few iterations.
+ */
+{
+public:
+    RepeatUntilFail(Behavior* child)
+    :	Loop(child)
+    {
+    }
+
+    Status update()
+    {
+        uint64_t start = beginBudget();
+        for (int iterations=1; ; ++iterations)
+        {
+            m_pChild->tick();
+            if (m_pChild->getStatus() == BH_RUNNING) return BH_RUNNING;
+            if (m_pChild->getStatus() == BH_FAILURE) return BH_SUCCESS;
+            m_pChild->reset();
+            if (isBudgetSpent(iterations, start)) return BH_RUNNING;
+        }
+    }
+};
+
+TEST(StarterKit1, RepeatKeepsCountWhileChildRuns)
+{
+    MockBehavior t;
+    t.m_eReturnStatus = BH_SUCCESS;
+    Repeat repeat(&t);
+    repeat.setCount(2);
+    repeat.setIterationBudget(1);
+    CHECK_EQUAL(BH_RUNNING, repeat.tick());
+
+    t.m_eReturnStatus = BH_RUNNING;
+    CHECK_EQUAL(BH_RUNNING, repeat.tick());
+    t.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, repeat.tick());
+    CHECK_EQUAL(3, t.m_iUpdateCalled);
+}
+
+TEST(StarterKit1, RepeatIterationBudget)
+{
+    MockBehavior t;
+    t.m_eReturnStatus = BH_SUCCESS;
+    Repeat repeat(&t);
+    repeat.setCount(10);
+    repeat.setIterationBudget(4);
+
+    CHECK_EQUAL(BH_RUNNING, repeat.tick());
+    CHECK_EQUAL(4, t.m_iUpdateCalled);
+    CHECK_EQUAL(BH_RUNNING, repeat.tick());
+    CHECK_EQUAL(BH_SUCCESS, repeat.tick());
+    CHECK_EQUAL(10, t.m_iUpdateCalled);
+    CHECK_EQUAL(10, t.m_iTerminateCalled);
+}
+
+TEST(StarterKit1, RepeatTimeBudget)
+{
+    MockBehavior t;
+    t.m_eReturnStatus = BH_SUCCESS;
+    Repeat repeat(&t);
+    repeat.setCount(1000);
+    repeat.setTimeBudget(1);
+
+    CHECK_EQUAL(BH_RUNNING, repeat.tick());
+    CHECK(t.m_iUpdateCalled >= 1  &&  t.m_iUpdateCalled < 1000);
+}
+
+TEST(StarterKit1, RepeatUntilFail)
+{
+    MockBehavior t;
+    t.m_eReturnStatus = BH_SUCCESS;
+    RepeatUntilFail loop(&t);
+    loop.setIterationBudget(3);
+
+    CHECK_EQUAL(BH_RUNNING, loop.tick());
+    CHECK_EQUAL(3, t.m_iUpdateCalled);
+
+    t.m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_SUCCESS, loop.tick());
+    CHECK_EQUAL(4, t.m_iUpdateCalled);
+    CHECK_EQUAL(BH_FAILURE, t.m_eTerminateStatus);
+}
+
+// ============================================================================
+
+typedef std::vector<Behavior*> Behaviors;
+
+struct Behavior::ResumePoint
+{
+    Behaviors::iterator* m_pCurrent;
+    Behaviors* m_pChildren;
+    Status m_eProceed;          // Result that moves on to the next child.
+};
+
+class Composite : public Behavior
+{
+    friend class Program;
+public:
+    void addChild(Behavior* child) { m_Children.push_back(child); }
+    void removeChild(Behavior*);
+    void clearChildren();
+
+    virtual void save(Snapshot& snapshot) const
+    {
+        Behavior::save(snapshot);
+        for (size_t i=0; i<m_Children.size(); ++i)
+        {
+            m_Children[i]->save(snapshot);
+        }
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Behavior::restore(snapshot);
+        for (size_t i=0; i<m_Children.size(); ++i)
+        {
+            m_Children[i]->restore(snapshot);
+        }
+    }
+
+protected:
+    // Current children are saved as indices, only meaningful while running.
+    void saveChild(Snapshot& snapshot, Behaviors::const_iterator current) const
+    {
+        size_t index = isRunning() ? current - m_Children.begin() : 0;
+        ASSERT(index <= 0xffff);
+        snapshot.write<uint16_t>(static_cast<uint16_t>(index));
+    }
+
+    Behaviors::iterator restoreChild(Snapshot& snapshot)
+    {
+        size_t index = snapshot.read<uint16_t>();
+        ASSERT(index <= m_Children.size());
+        return m_Children.begin() + index;
+    }
+
+    Behaviors m_Children;
+};
+
+class Sequence : public Composite
+{
+public:
+    virtual ~Sequence()
+    {
+    }
+
+    virtual void save(Snapshot& snapshot) const
+    {
+        Composite::save(snapshot);
+        saveChild(snapshot, m_CurrentChild);
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Composite::restore(snapshot);
+        m_CurrentChild = restoreChild(snapshot);
+    }
+
+protected:
+    virtual void onInitialize()
+    {
+        m_CurrentChild = m_Children.begin();
+    }
+
+    virtual Status update()
+    {
+        // Keep going until a child behavior says it's running.
+        for (;;)
+        {
+            Status s = (*m_CurrentChild)->tick();
+
+            // If the child fails, or keeps running, do the same.
+            if (s != BH_SUCCESS)
+            {
+                return s;
+            }
+
+            // Hit the end of the array, job done!
+            if (++m_CurrentChild == m_Children.end())
+            {
+                return BH_SUCCESS;
+            }
+        }
+    }
+
+    virtual bool getResumePoint(ResumePoint& point)
+    {
+        point.m_pCurrent = &m_CurrentChild;
+        point.m_pChildren = &m_Children;
+        point.m_eProceed = BH_SUCCESS;
+        return true;
+    }
+
+    Behaviors::iterator m_CurrentChild;
+};
+
+// ----------------------------------------------------------------------------
+
+template <class COMPOSITE>
+class MockComposite : public COMPOSITE
+{
+public:
+    MockComposite(size_t size)
+    {
+        for (size_t i=0; i<size; ++i)
+        {
+            COMPOSITE::m_Children.push_back(new MockBehavior);
+        }
+    }
+
+    ~MockComposite()
+    {
+        for (size_t i=0; i<COMPOSITE::m_Children.size(); ++i)
+        {
+            delete COMPOSITE::m_Children[i];
+        }
+    }
+
+    MockBehavior& operator[](size_t index)
+    {
+        ASSERT(index < COMPOSITE::m_Children.size());
+        return *static_cast<MockBehavior*>(COMPOSITE::m_Children[index]);
+    }
+};
+
+typedef MockComposite<Sequence> MockSequence;
+
+TEST(StarterKit1, SequenceTwoChildrenFails)
+{
+    MockSequence seq(2);
+
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+    seq[0].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(seq.tick(), BH_FAILURE);
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(0, seq[1].m_iInitializeCalled);
+}
+
+TEST(StarterKit1, SequenceTwoChildrenContinues)
+{
+    MockSequence seq(2);
+
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(0, seq[1].m_iInitializeCalled);
+
+    seq[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, seq[1].m_iInitializeCalled);
+}
+
+TEST(StarterKit1, SequenceOneChildPassThrough)
+{
+    Status status[2] = { BH_SUCCESS, BH_FAILURE };
+    for (int i=0; i<2; ++i)
+    {
+        MockSequence seq(1);
+
+        CHECK_EQUAL(seq.tick(), BH_RUNNING);
+        CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+        seq[0].m_eReturnStatus = status[i];
+        CHECK_EQUAL(seq.tick(), status[i]);
+        CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    }
+}
+
+
+// ============================================================================
+
+class Selector : public Composite
+{
+public:
+    virtual ~Selector()
+    {
+    }
+
+    virtual void save(Snapshot& snapshot) const
+    {
+        Composite::save(snapshot);
+        saveChild(snapshot, m_Current);
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Composite::restore(snapshot);
+        m_Current = restoreChild(snapshot);
+    }
+
+protected:
+    virtual void onInitialize()
+    {
+        m_Current = m_Children.begin();
+    }
+
+    virtual Status update()
+    {
+        // Keep going until a child behavior says its running.
+		for (;;)
+        {
+            Status s = (*m_Current)->tick();
+
+            // If the child succeeds, or keeps running, do the same.
+            if (s != BH_FAILURE)
+            {
+                return s;
+            }
+
+            // Hit the end of the array, it didn't end well...
+            if (++m_Current == m_Children.end())
+            {
+                return BH_FAILURE;
+            }
+        }
+    }
+
+    virtual bool getResumePoint(ResumePoint& point)
+    {
+        point.m_pCurrent = &m_Current;
+        point.m_pChildren = &m_Children;
+        point.m_eProceed = BH_FAILURE;
+        return true;
+    }
+
+    Behaviors::iterator m_Current;
+};
+
+// ----------------------------------------------------------------------------
+
+typedef MockComposite<Selector> MockSelector;
+
+TEST(StarterKit1, SelectorTwoChildrenContinues)
+{
+    MockSelector seq(2);
+
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+    seq[0].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+}
+
+TEST(StarterKit1, SelectorTwoChildrenSucceeds)
+{
+    MockSelector seq(2);
+
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+    seq[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(seq.tick(), BH_SUCCESS);
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+}
+
+TEST(StarterKit1, SelectorOneChildPassThrough)
+{
+    Status status[2] = { BH_SUCCESS, BH_FAILURE };
+    for (int i=0; i<2; ++i)
+    {
+        MockSelector seq(1);
+
+        CHECK_EQUAL(seq.tick(), BH_RUNNING);
+        CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+        seq[0].m_eReturnStatus = status[i];
+        CHECK_EQUAL(seq.tick(), status[i]);
+        CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    }
+}
+
+class JobSystem
+/**
+ * Where a Parallel sends its children's ticks when it's given one.
+ */
+{
+public:
+    typedef void (*Function)(void* data, size_t index);
+
+    virtual ~JobSystem()
+    {
+    }
+
+    // Call function(data, i) for each i in [0, count), on any threads and
+    // in any order, and return once all of the calls have completed.
+    virtual void run(Function function, void* data, size_t count) = 0;
+};
+
+class WorkerPool : public JobSystem
+/**
+ * Worker threads that share each batch of jobs with the calling thread,
+ * taking indices from the batch's atomic counter.  Only as many workers as
+ * there are jobs beyond the caller's are woken, and the batch counts those
+ * that join it, so run() waits for them alone and a late worker that finds
+ * the batch gone simply goes back to sleep.  A batch started while another
+ * is running, e.g. by a Parallel nested in a job, runs on the calling
+ * thread alone instead of waiting for the workers.
+ */
+{
+public:
+    explicit WorkerPool(size_t workers)
+    :	m_pBatch(NULL)
+    ,	m_iGeneration(0)
+    ,	m_bQuit(false)
+    ,	m_bBusy(false)
+    {
+        for (size_t i=0; i<workers; ++i)
+        {
+            m_Threads.push_back(std::thread(&WorkerPool::work, this));
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bQuit = true;
+        }
+        m_WorkReady.notify_all();
+        for (size_t i=0; i<m_Threads.size(); ++i)
+        {
+            m_Threads[i].join();
+        }
+    }
+
+    virtual void run(Function function, void* data, size_t count)
+    {
+        bool idle = false;
+        if (m_Threads.empty()  ||  count < 2  ||  !m_bBusy.compare_exchange_strong(idle, true))
+        {
+            for (size_t i=0; i<count; ++i)
+            {
+                function(data, i);
+            }
+            return;
+        }
+
+        Batch batch(function, data, count);
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_pBatch = &batch;
+            ++m_iGeneration;
+        }
+        for (size_t i=std::min(count - 1, m_Threads.size()); i>0; --i)
+        {
+            m_WorkReady.notify_one();
+        }
+        batch.execute();
+
+        // Every job has been taken; close the batch to workers that haven't
+        // joined yet and wait for those that did to finish their jobs.
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_pBatch = NULL;
+            while (batch.m_iWorking > 0)
+            {
+                m_Done.wait(lock);
+            }
+        }
+        m_bBusy = false;
+    }
+
+    size_t getWorkerCount() const
+    {
+        return m_Threads.size();
+    }
+
+private:
+    struct Batch
+    {
+        Batch(Function function, void* data, size_t count)
+        :	m_pFunction(function)
+        ,	m_pData(data)
+        ,	m_iCount(count)
+        ,	m_iNext(0)
+        ,	m_iWorking(0)
+        {
+        }
+
+        void execute()
+        {
+            for (size_t i=m_iNext++; i<m_iCount; i=m_iNext++)
+            {
+                m_pFunction(m_pData, i);
+            }
+        }
+
+        Function m_pFunction;
+        void* m_pData;
+        size_t m_iCount;
+        std::atomic<size_t> m_iNext;
+
+        // Workers that joined and haven't finished, guarded by m_Mutex.
+        size_t m_iWorking;
+    };
+
+    void work()
+    {
+        unsigned generation = 0;
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        for (;;)
+        {
+            while (!m_bQuit  &&  generation == m_iGeneration)
+            {
+                m_WorkReady.wait(lock);
+            }
+            if (m_bQuit)
+            {
+                return;
+            }
+            generation = m_iGeneration;
+            Batch* batch = m_pBatch;
+            if (batch == NULL)
+            {
+                continue;
+            }
+            ++batch->m_iWorking;
+            lock.unlock();
+
+            batch->execute();
+
+            lock.lock();
+            if (--batch->m_iWorking == 0)
+            {
+                m_Done.notify_one();
+            }
+        }
+    }
+
+    Batch* m_pBatch;
+    unsigned m_iGeneration;
+    bool m_bQuit;
+    std::atomic<bool> m_bBusy;
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkReady;
+    std::condition_variable m_Done;
+    std::vector<std::thread> m_Threads;
+};
+
+// ----------------------------------------------------------------------------
+
+class Parallel : public Composite
+{
+public:
+    enum Policy
+    {
+        RequireOne,
+        RequireAll,
+    };
+
+    Parallel(Policy forSuccess, Policy forFailure)
+    :	m_eSuccessPolicy(forSuccess)
+    ,	m_eFailurePolicy(forFailure)
+    ,	m_iSuccessCount(0)
+    ,	m_iFailureCount(0)
+    ,	m_pJobs(NULL)
+    {
+    }
+
+    virtual ~Parallel() {}
+
+    // Tick the running children as jobs, or on the calling thread if NULL.
+    // The children then run concurrently, so they mustn't touch anything
+    // the others use without synchronizing.  Their onTerminate() calls are
+    // still made on the calling thread, in the order of the children.
+    void setJobSystem(JobSystem* jobs)
+    {
+        m_pJobs = jobs;
+    }
+
+    // Children that haven't terminated yet in the current run.
+    size_t getActiveCount() const
+    {
+        return m_Active.size();
+    }
+
+    // The active children keep the order of m_Children, so they're saved
+    // as indices in one pass.
+    virtual void save(Snapshot& snapshot) const
+    {
+        Composite::save(snapshot);
+        bool running = isRunning();
+        snapshot.write<uint16_t>(static_cast<uint16_t>(running ? m_iSuccessCount : 0));
+        snapshot.write<uint16_t>(static_cast<uint16_t>(running ? m_iFailureCount : 0));
+        snapshot.write<uint16_t>(static_cast<uint16_t>(running ? m_Active.size() : 0));
+        for (size_t i=0, a=0; running  &&  a<m_Active.size(); ++i)
+        {
+            ASSERT(i < m_Children.size());
+            if (m_Children[i] == m_Active[a])
+            {
+                snapshot.write<uint16_t>(static_cast<uint16_t>(i));
+                ++a;
+            }
+        }
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Composite::restore(snapshot);
+        m_iSuccessCount = snapshot.read<uint16_t>();
+        m_iFailureCount = snapshot.read<uint16_t>();
+        m_Active.resize(snapshot.read<uint16_t>());
+        for (size_t a=0; a<m_Active.size(); ++a)
+        {
+            size_t index = snapshot.read<uint16_t>();
+            ASSERT(index < m_Children.size());
+            m_Active[a] = m_Children[index];
+        }
+    }
+
+protected:
+    Policy m_eSuccessPolicy;
+    Policy m_eFailurePolicy;
+
+    // Only the children still running are ticked, and the counters of
+    // terminated ones are kept from tick to tick, so a wide parallel costs
+    // as much as its running children.
+    Behaviors m_Active;
+    size_t m_iSuccessCount;
+    size_t m_iFailureCount;
+    JobSystem* m_pJobs;
+
+    virtual void onInitialize()
+    {
+        m_Active.assign(m_Children.begin(), m_Children.end());
+        m_iSuccessCount = 0;
+        m_iFailureCount = 0;
+    }
+
+    virtual Status update()
+    {	
+        if (m_pJobs != NULL  &&  m_Active.size() > 1)
+        {
+            return updateJobs();
+        }
+
+        size_t kept = 0;
+        for (size_t i=0; i<m_Active.size(); ++i)
+        {
+            Behavior& b = *m_Active[i];
+            Status s = b.tick();
+
+            if (s == BH_SUCCESS)
+            {
+                ++m_iSuccessCount;
+                if (m_eSuccessPolicy == RequireOne)
+                {
+                    return BH_SUCCESS;
+                }
+            }
+            else if (s == BH_FAILURE)
+            {
+                ++m_iFailureCount;
+                if (m_eFailurePolicy == RequireOne)
+                {
+                    return BH_FAILURE;
+                }
+            }
+            else
+            {
+                m_Active[kept++] = &b;
+            }
+        }
+        m_Active.resize(kept);
+
+        if (m_eFailurePolicy == RequireAll  &&  m_iFailureCount == m_Children.size())
+        {
+            return BH_FAILURE;
+        }
+
+        if (m_eSuccessPolicy == RequireAll  &&  m_iSuccessCount == m_Children.size())
+        {
+            return BH_SUCCESS;
+        }
+
+        return BH_RUNNING;
+    }
+
+    // All running children are updated before any policy is applied, so
+    // every child that terminates this tick is counted and terminated, in
+    // order, even after one has already decided the result.
+    Status updateJobs()
+    {
+        m_pJobs->run(&beginChild, this, m_Active.size());
+
+        Status result = BH_RUNNING;
+        size_t kept = 0;
+        for (size_t i=0; i<m_Active.size(); ++i)
+        {
+            Behavior& b = *m_Active[i];
+            Status s = b.endTick();
+
+            if (s == BH_SUCCESS)
+            {
+                ++m_iSuccessCount;
+                if (m_eSuccessPolicy == RequireOne  &&  result == BH_RUNNING)
+                {
+                    result = BH_SUCCESS;
+                }
+            }
+            else if (s == BH_FAILURE)
+            {
+                ++m_iFailureCount;
+                if (m_eFailurePolicy == RequireOne  &&  result == BH_RUNNING)
+                {
+                    result = BH_FAILURE;
+                }
+            }
+            else
+            {
+                m_Active[kept++] = &b;
+            }
+        }
+        m_Active.resize(kept);
+
+        if (result != BH_RUNNING)
+        {
+            return result;
+        }
+        if (m_eFailurePolicy == RequireAll  &&  m_iFailureCount == m_Children.size())
+        {
+            return BH_FAILURE;
+        }
+        if (m_eSuccessPolicy == RequireAll  &&  m_iSuccessCount == m_Children.size())
+        {
+            return BH_SUCCESS;
+        }
+        return BH_RUNNING;
+    }
+
+    static void beginChild(void* data, size_t index)
+    {
+        static_cast<Parallel*>(data)->m_Active[index]->beginTick();
+    }
+
+    virtual void onTerminate(Status)
+    {
+        for (Behaviors::iterator it = m_Children.begin(); it != m_Children.end(); ++it)
+        {
+            Behavior& b = **it;
+            if (b.isRunning())
+            {
+                b.abort();
+            }
+        }
+    }
+};
+
+
+TEST(StarterKit1, ParallelSucceedRequireAll)
+{
+    Parallel parallel(Parallel::RequireAll, Parallel::RequireOne);
+    MockBehavior children[2];
+    parallel.addChild(&children[0]);
+    parallel.addChild(&children[1]);
+
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    children[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    children[1].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+}
+
+TEST(StarterKit1, ParallelSucceedRequireOne)
+{
+    Parallel parallel(Parallel::RequireOne, Parallel::RequireAll);
+    MockBehavior children[2];
+    parallel.addChild(&children[0]);
+    parallel.addChild(&children[1]);
+
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    children[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+}
+
+TEST(StarterKit1, ParallelFailureRequireAll)
+{
+    Parallel parallel(Parallel::RequireOne, Parallel::RequireAll);
+    MockBehavior children[2];
+    parallel.addChild(&children[0]);
+    parallel.addChild(&children[1]);
+
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    children[0].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    children[1].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_FAILURE, parallel.tick());
+}
+
+TEST(StarterKit1, ParallelFailureRequireOne)
+{
+    Parallel parallel(Parallel::RequireAll, Parallel::RequireOne);
+    MockBehavior children[2];
+    parallel.addChild(&children[0]);
+    parallel.addChild(&children[1]);
+
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    children[0].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_FAILURE, parallel.tick());
+}
+
+TEST(StarterKit1, ParallelTicksRunningChildren)
+{
+    Parallel parallel(Parallel::RequireAll, Parallel::RequireOne);
+    MockBehavior children[3];
+    for (int i=0; i<3; ++i)
+    {
+        parallel.addChild(&children[i]);
+    }
+
+    children[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    CHECK_EQUAL(2u, parallel.getActiveCount());
+
+    children[2].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    CHECK_EQUAL(1u, parallel.getActiveCount());
+    CHECK_EQUAL(1, children[0].m_iUpdateCalled);
+
+    children[1].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+    CHECK_EQUAL(3, children[1].m_iUpdateCalled);
+    CHECK_EQUAL(2, children[2].m_iUpdateCalled);
+
+    // Running the parallel again starts all of its children over.
+    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+    CHECK_EQUAL(2, children[0].m_iInitializeCalled);
+    CHECK_EQUAL(2, children[0].m_iUpdateCalled);
+}
+
+struct OrderedBehavior : public MockBehavior
+{
+    std::vector<int>* m_pOrder;
+    int m_iId;
+
+    virtual void onTerminate(Status s)
+    {
+        MockBehavior::onTerminate(s);
+        m_pOrder->push_back(m_iId);
+    }
+};
+
+TEST(StarterKit1, ParallelOnJobsMatchesSequential)
+{
+    WorkerPool pool(2);
+    Parallel parallel(Parallel::RequireAll, Parallel::RequireOne);
+    parallel.setJobSystem(&pool);
+    MockBehavior children[4];
+    for (int i=0; i<4; ++i)
+    {
+        parallel.addChild(&children[i]);
+    }
+
+    children[1].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, parallel.tick());
+    CHECK_EQUAL(3u, parallel.getActiveCount());
+
+    for (int i=0; i<4; ++i)
+    {
+        children[i].m_eReturnStatus = BH_SUCCESS;
+    }
+    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+    CHECK_EQUAL(1, children[1].m_iUpdateCalled);
+    CHECK_EQUAL(2, children[3].m_iUpdateCalled);
+    CHECK_EQUAL(1, children[3].m_iTerminateCalled);
+}
+
+TEST(StarterKit1, ParallelOnJobsTerminatesInOrder)
+{
+    WorkerPool pool(3);
+    Parallel parallel(Parallel::RequireOne, Parallel::RequireOne);
+    parallel.setJobSystem(&pool);
+    std::vector<int> order;
+    OrderedBehavior children[6];
+    for (int i=0; i<6; ++i)
+    {
+        children[i].m_pOrder = &order;
+        children[i].m_iId = i;
+        parallel.addChild(&children[i]);
+    }
+
+    // The first child to finish decides, but the others finishing in the
+    // same tick are still terminated, in the order they were added.
+    children[4].m_eReturnStatus = BH_FAILURE;
+    children[2].m_eReturnStatus = BH_SUCCESS;
+    children[5].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+    CHECK_EQUAL(6u, order.size());
+    int expected[] = { 2, 4, 5, 0, 1, 3 };
+    for (size_t i=0; i<order.size(); ++i)
+    {
+        CHECK_EQUAL(expected[i], order[i]);
+    }
+    CHECK_EQUAL(BH_ABORTED, children[0].m_eTerminateStatus);
+}
+
+TEST(StarterKit1, WorkerPoolRunsEveryJob)
+{
+    struct Jobs
+    {
+        static void add(void* data, size_t index)
+        {
+            static_cast<std::atomic<size_t>*>(data)[index] += index + 1;
+        }
+    };
+
+    WorkerPool pool(2);
+    std::atomic<size_t> done[64];
+    for (size_t i=0; i<64; ++i)
+    {
+        done[i] = 0;
+    }
+    for (int batch=0; batch<10; ++batch)
+    {
+        pool.run(&Jobs::add, done, 64);
+    }
+    for (size_t i=0; i<64; ++i)
+    {
+        CHECK_EQUAL(10 * (i + 1), done[i].load());
+    }
+}
+
+// Small batches back to back, where a worker still waking up for one batch
+// would overlap the next if it didn't check which batch is open.
+TEST(StarterKit1, WorkerPoolBatchesDontOverlap)
+{
+    struct Jobs
+    {
+        static void count(void* data, size_t index)
+        {
+            ++static_cast<std::atomic<int>*>(data)[index];
+        }
+    };
+
+    WorkerPool pool(3);
+    std::atomic<int> runs[2][4];
+    bool once = true;
+    for (int batch=0; batch<2000; ++batch)
+    {
+        std::atomic<int>* current = runs[batch & 1];
+        for (size_t i=0; i<4; ++i)
+        {
+            current[i] = 0;
+        }
+        pool.run(&Jobs::count, current, 4);
+        for (size_t i=0; i<4; ++i)
+        {
+            once = once  &&  current[i] == 1;
+        }
+    }
+    CHECK(once);
+}
+
+class Monitor : public Parallel
+{
+public:
+	Monitor()
+	:	Parallel(Parallel::RequireOne, Parallel::RequireOne)
+	{
+	}
+
+	void addCondition(Behavior* condition)
+    {
+        m_Children.insert(m_Children.begin(), condition);
+    }
+
+    void addAction(Behavior* action)
+    {
+        m_Children.push_back(action);
+    }
+};
+
+
+TEST(StarterKit1, MonitorCachedCondition)
+{
+    uint32_t version = 0;
+    MockCondition condition;
+    condition.addInput(&version);
+    condition.m_bReturnValue = false;
+    MockBehavior action;
+
+    Monitor monitor;
+    monitor.addCondition(&condition);
+    monitor.addAction(&action);
+
+    // Each run checks the condition again, from its cache while unchanged.
+    CHECK_EQUAL(BH_FAILURE, monitor.tick());
+    CHECK_EQUAL(BH_FAILURE, monitor.tick());
+    CHECK_EQUAL(1, condition.m_iCheckCalled);
+    CHECK_EQUAL(0, action.m_iUpdateCalled);
+
+    condition.m_bReturnValue = true;
+    ++version;
+    CHECK_EQUAL(BH_SUCCESS, monitor.tick());
+    CHECK_EQUAL(2, condition.m_iCheckCalled);
+}
+
+// ============================================================================
+
+class ActiveSelector : public Selector
+{
+protected:
+
+    virtual void onInitialize()
+    {
+        m_Current = m_Children.end();
+    }
+
+    virtual Status update()
+    {
+        Behaviors::iterator previous = m_Current;
+
+        Selector::onInitialize();
+        Status result = Selector::update();
+
+        if (previous != m_Children.end()  &&  m_Current != previous)
+        {
+            METRICS_ADD(COUNTER_ABORTS, 1);
+            (*previous)->onTerminate(BH_ABORTED);
+        }
+        return result;
+    }
+
+    // Re-checks the children before the current one on every tick.
+    virtual bool getResumePoint(ResumePoint&)
+    {
+        return false;
+    }
+};
+
+typedef MockComposite<ActiveSelector> MockActiveSelector;
+
+
+TEST(StarterKit1, ActiveBinarySelector)
+{
+    MockActiveSelector sel(2);
+
+    sel[0].m_eReturnStatus = BH_FAILURE;
+    sel[1].m_eReturnStatus = BH_RUNNING;
+
+    CHECK_EQUAL(sel.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, sel[0].m_iInitializeCalled);
+    CHECK_EQUAL(1, sel[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
+    CHECK_EQUAL(0, sel[1].m_iTerminateCalled);
+
+    CHECK_EQUAL(sel.tick(), BH_RUNNING);
+    CHECK_EQUAL(2, sel[0].m_iInitializeCalled);
+    CHECK_EQUAL(2, sel[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
+    CHECK_EQUAL(0, sel[1].m_iTerminateCalled);
+
+    sel[0].m_eReturnStatus = BH_RUNNING;
+    CHECK_EQUAL(sel.tick(), BH_RUNNING);
+    CHECK_EQUAL(3, sel[0].m_iInitializeCalled);
+    CHECK_EQUAL(2, sel[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
+    CHECK_EQUAL(1, sel[1].m_iTerminateCalled);
+
+    sel[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(sel.tick(), BH_SUCCESS);
+    CHECK_EQUAL(3, sel[0].m_iInitializeCalled);
+    CHECK_EQUAL(3, sel[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
+    CHECK_EQUAL(1, sel[1].m_iTerminateCalled);
+}
+
+#if !defined(BTSK_NO_METRICS)
+TEST(Metrics, ActiveSelectorCountsAborts)
+{
+    MockActiveSelector sel(2);
+    sel[0].m_eReturnStatus = BH_FAILURE;
+    sel[1].m_eReturnStatus = BH_RUNNING;
+    sel.tick();
+
+    metrics::Snapshot before, after;
+    metrics::collect(before);
+    sel[0].m_eReturnStatus = BH_RUNNING;
+    sel.tick();
+    metrics::collect(after);
+    CHECK_EQUAL(1, after.get(metrics::COUNTER_ABORTS) - before.get(metrics::COUNTER_ABORTS));
+    CHECK_EQUAL(2, after.get(metrics::COUNTER_NODE_UPDATES) - before.get(metrics::COUNTER_NODE_UPDATES));
+}
+#endif
+
+
+// ============================================================================
+
+const size_t k_MaxProgramDepth = 32;
+
+class Program : public Behavior
+/**
+ * Flattened form of the static part of a tree.  Plain sequences and
+ * selectors become instructions that jump to the end of their child range,
+ * executed by one loop with a small explicit stack.  Everything else,
+ * including their subclasses such as ActiveSelector, stays a leaf and is
+ * run with its own tick(), so onInitialize() and onTerminate() are called
+ * as before.
+ */
+{
+public:
+    enum Opcode
+    {
+        OP_SEQUENCE,
+        OP_SELECTOR,
+        OP_LEAF,
+        OP_END,
+    };
+
+    struct Instruction
+    {
+        Opcode m_eOpcode;
+        uint32_t m_iJump;       // Composites: index of the matching OP_END.
+        Behavior* m_pLeaf;
+    };
+
+    Program(Behavior& root)
+    :	m_iPC(0)
+    ,	m_iDepth(0)
+    {
+        compile(root, 0);
+    }
+
+    virtual ~Program()
+    {
+    }
+
+    size_t getInstructionCount() const
+    {
+        return m_Code.size();
+    }
+
+    const Instruction& getInstruction(size_t index) const
+    {
+        ASSERT(index < m_Code.size());
+        return m_Code[index];
+    }
+
+    // Composites compiled into the program have no state left of their own,
+    // only the leaves do.
+    virtual void save(Snapshot& snapshot) const
+    {
+        Behavior::save(snapshot);
+        snapshot.write<uint32_t>(static_cast<uint32_t>(m_iPC));
+        snapshot.write<uint32_t>(static_cast<uint32_t>(m_iDepth));
+        for (size_t i=0; i<m_iDepth; ++i)
+        {
+            snapshot.write<uint32_t>(m_Stack[i]);
+        }
+        for (size_t i=0; i<m_Code.size(); ++i)
+        {
+            if (m_Code[i].m_eOpcode == OP_LEAF)
+            {
+                m_Code[i].m_pLeaf->save(snapshot);
+            }
+        }
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Behavior::restore(snapshot);
+        m_iPC = snapshot.read<uint32_t>();
+        m_iDepth = snapshot.read<uint32_t>();
+        ASSERT(m_iPC <= m_Code.size()  &&  m_iDepth <= k_MaxProgramDepth);
+        for (size_t i=0; i<m_iDepth; ++i)
+        {
+            m_Stack[i] = snapshot.read<uint32_t>();
+        }
+        for (size_t i=0; i<m_Code.size(); ++i)
+        {
+            if (m_Code[i].m_eOpcode == OP_LEAF)
+            {
+                m_Code[i].m_pLeaf->restore(snapshot);
+            }
+        }
+    }
+
+protected:
+    virtual void onInitialize()
+    {
+        m_iPC = 0;
+        m_iDepth = 0;
+    }
+
+    virtual Status update()
+    {
+        for (;;)
+        {
+            const Instruction& op = m_Code[m_iPC];
+            Status s;
+            switch (op.m_eOpcode)
+            {
+            case OP_SEQUENCE:
+            case OP_SELECTOR:
+                m_Stack[m_iDepth++] = static_cast<uint32_t>(m_iPC++);
+                continue;
+
+            case OP_LEAF:
+                s = op.m_pLeaf->tick();
+                if (s == BH_RUNNING)
+                {
+                    return BH_RUNNING;
+                }
+                ++m_iPC;
+                break;
+
+            default:
+                // Ran out of children: sequences succeed, selectors fail.
+                ASSERT(op.m_eOpcode == OP_END  &&  m_iDepth > 0);
+                s = m_Code[m_Stack[--m_iDepth]].m_eOpcode == OP_SEQUENCE ? BH_SUCCESS : BH_FAILURE;
+                ++m_iPC;
+                break;
+            }
+
+            // A child finished, unwind all the composites its result decides.
+            for (;;)
+            {
+                if (m_iDepth == 0)
+                {
+                    return s;
+                }
+                const Instruction& parent = m_Code[m_Stack[m_iDepth - 1]];
+                Status proceed = parent.m_eOpcode == OP_SEQUENCE ? BH_SUCCESS : BH_FAILURE;
+                if (s == proceed)
+                {
+                    break;
+                }
+                m_iPC = parent.m_iJump + 1;
+                --m_iDepth;
+            }
+        }
+    }
+
+    virtual void onTerminate(Status s)
+    {
+        if (s != BH_ABORTED  ||  m_iPC >= m_Code.size())
+        {
+            return;
+        }
+        Behavior* leaf = m_Code[m_iPC].m_pLeaf;
+        if (leaf != NULL  &&  leaf->isRunning())
+        {
+            leaf->abort();
+        }
+    }
+
+    // The type must match exactly, since a subclass may override what
+    // the composite does.
+    void compile(Behavior& bh, size_t depth)
+    {
+        Opcode opcode = OP_LEAF;
+        if (typeid(bh) == typeid(Sequence))
+        {
+            opcode = OP_SEQUENCE;
+        }
+        else if (typeid(bh) == typeid(Selector))
+        {
+            opcode = OP_SELECTOR;
+        }
+
+        Instruction instruction = { opcode, 0, NULL };
+        if (opcode == OP_LEAF)
+        {
+            instruction.m_pLeaf = &bh;
+            m_Code.push_back(instruction);
+            return;
+        }
+
+        ASSERT(depth < k_MaxProgramDepth);
+        size_t begin = m_Code.size();
+        m_Code.push_back(instruction);
+
+        Composite& composite = static_cast<Composite&>(bh);
+        ASSERT(!composite.m_Children.empty());
+        for (Behaviors::iterator it = composite.m_Children.begin(); it != composite.m_Children.end(); ++it)
+        {
+            compile(**it, depth + 1);
+        }
+
+        m_Code[begin].m_iJump = static_cast<uint32_t>(m_Code.size());
+        Instruction end = { OP_END, 0, NULL };
+        m_Code.push_back(end);
+    }
+
+    std::vector<Instruction> m_Code;
+    size_t m_iPC;
+    size_t m_iDepth;
+    uint32_t m_Stack[k_MaxProgramDepth];
+};
+
+TEST(StarterKit1, ActiveSelectorCachedCondition)
+{
+    uint32_t version = 0;
+    MockCondition condition;
+    condition.addInput(&version);
+    condition.m_bReturnValue = false;
+    MockBehavior action;
+
+    // The condition is re-run on every tick ahead of the running action.
+    ActiveSelector sel;
+    sel.addChild(&condition);
+    sel.addChild(&action);
+
+    for (int i=0; i<3; ++i)
+    {
+        CHECK_EQUAL(BH_RUNNING, sel.tick());
+    }
+    CHECK_EQUAL(1, condition.m_iCheckCalled);
+    CHECK_EQUAL(3, action.m_iUpdateCalled);
+
+    condition.m_bReturnValue = true;
+    ++version;
+    CHECK_EQUAL(BH_SUCCESS, sel.tick());
+    CHECK_EQUAL(2, condition.m_iCheckCalled);
+    CHECK_EQUAL(BH_ABORTED, action.m_eTerminateStatus);
+}
+
+TEST(StarterKit1, ProgramSequence)
+{
+    MockBehavior a, b;
+    Sequence seq;
+    seq.addChild(&a);
+    seq.addChild(&b);
+    Program program(seq);
+    CHECK_EQUAL(4u, program.getInstructionCount());
+
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, a.m_iInitializeCalled);
+    CHECK_EQUAL(0, b.m_iInitializeCalled);
+
+    a.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, a.m_iTerminateCalled);
+    CHECK_EQUAL(1, b.m_iInitializeCalled);
+    CHECK_EQUAL(1, b.m_iUpdateCalled);
+
+    b.m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(program.tick(), BH_FAILURE);
+    CHECK_EQUAL(2, a.m_iUpdateCalled);
+    CHECK_EQUAL(1, b.m_iTerminateCalled);
+}
+
+TEST(StarterKit1, ProgramNestedComposites)
+{
+    MockBehavior a, b, c;
+    Sequence seq;
+    seq.addChild(&a);
+    seq.addChild(&b);
+    Selector sel;
+    sel.addChild(&seq);
+    sel.addChild(&c);
+
+    Program program(sel);
+    CHECK_EQUAL(7u, program.getInstructionCount());
+    CHECK_EQUAL(Program::OP_SELECTOR, program.getInstruction(0).m_eOpcode);
+    CHECK_EQUAL(6u, program.getInstruction(0).m_iJump);
+    CHECK_EQUAL(4u, program.getInstruction(1).m_iJump);
+
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, a.m_iInitializeCalled);
+
+    a.m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(0, b.m_iInitializeCalled);
+    CHECK_EQUAL(1, c.m_iInitializeCalled);
+
+    c.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(program.tick(), BH_SUCCESS);
+    CHECK_EQUAL(1, c.m_iTerminateCalled);
+
+    CHECK_EQUAL(program.tick(), BH_SUCCESS);
+    CHECK_EQUAL(2, a.m_iInitializeCalled);
+    CHECK_EQUAL(2, c.m_iTerminateCalled);
+}
+
+TEST(StarterKit1, ProgramAbortsRunningLeaf)
+{
+    MockBehavior a, b;
+    Selector sel;
+    sel.addChild(&a);
+    sel.addChild(&b);
+    Program program(sel);
+
+    a.m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(0, b.m_iTerminateCalled);
+
+    program.abort();
+    CHECK_EQUAL(1, b.m_iTerminateCalled);
+    CHECK_EQUAL(BH_ABORTED, b.m_eTerminateStatus);
+}
+
+TEST(StarterKit1, ProgramKeepsReactiveLeaf)
+{
+    MockActiveSelector sel(2);
+    Program program(sel);
+    CHECK_EQUAL(1u, program.getInstructionCount());
+    CHECK_EQUAL(Program::OP_LEAF, program.getInstruction(0).m_eOpcode);
 
-    CHECK_EQUAL(seq.tick(), BH_RUNNING);
-    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+    sel[0].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(2, sel[0].m_iInitializeCalled);
+}
 
-    seq[0].m_eReturnStatus = BH_FAILURE;
-    CHECK_EQUAL(seq.tick(), BH_RUNNING);
-    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+struct CountingSequence : public Sequence
+{
+    int m_iUpdateCalled;
+
+    CountingSequence()
+    :	m_iUpdateCalled(0)
+    {
+    }
+
+    virtual Status update()
+    {
+        ++m_iUpdateCalled;
+        return Sequence::update();
+    }
+};
+
+TEST(StarterKit1, ProgramKeepsSubclassLeaf)
+{
+    MockBehavior a, b;
+    CountingSequence seq;
+    seq.addChild(&a);
+    Selector sel;
+    sel.addChild(&seq);
+    sel.addChild(&b);
+
+    Program program(sel);
+    CHECK_EQUAL(4u, program.getInstructionCount());
+    CHECK_EQUAL(Program::OP_LEAF, program.getInstruction(1).m_eOpcode);
+
+    CHECK_EQUAL(program.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, seq.m_iUpdateCalled);
+    CHECK_EQUAL(1, a.m_iUpdateCalled);
 }
 
-TEST(StarterKit1, SelectorTwoChildrenSucceeds)
+// ----------------------------------------------------------------------------
+
+struct CountdownBehavior : public Behavior
 {
-    MockSelector seq(2);
+    int m_iDuration;
+    int m_iRemaining;
 
-    CHECK_EQUAL(seq.tick(), BH_RUNNING);
-    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+    CountdownBehavior(int duration)
+    :	m_iDuration(duration)
+    ,	m_iRemaining(0)
+    {
+    }
+
+    virtual void onInitialize()
+    {
+        m_iRemaining = m_iDuration;
+    }
+
+    virtual Status update()
+    {
+        return --m_iRemaining > 0 ? BH_RUNNING : BH_SUCCESS;
+    }
+
+    virtual void save(Snapshot& snapshot) const
+    {
+        Behavior::save(snapshot);
+        snapshot.write<int32_t>(m_iRemaining);
+    }
+
+    virtual void restore(Snapshot& snapshot)
+    {
+        Behavior::restore(snapshot);
+        m_iRemaining = snapshot.read<int32_t>();
+    }
+};
 
+TEST(StarterKit1, SnapshotRollsBackSequence)
+{
+    MockSequence seq(3);
     seq[0].m_eReturnStatus = BH_SUCCESS;
-    CHECK_EQUAL(seq.tick(), BH_SUCCESS);
-    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    seq[1].m_eReturnStatus = BH_RUNNING;
+    CHECK_EQUAL(BH_RUNNING, seq.tick());
+
+    Snapshot snapshot;
+    seq.save(snapshot);
+    CHECK_EQUAL(4 + sizeof(uint16_t), snapshot.getSize());
+
+    seq[1].m_eReturnStatus = BH_SUCCESS;
+    seq[2].m_eReturnStatus = BH_RUNNING;
+    CHECK_EQUAL(BH_RUNNING, seq.tick());
+    CHECK_EQUAL(1, seq[2].m_iUpdateCalled);
+
+    // Back to the second child running, without initializing anything.
+    seq.restore(snapshot);
+    CHECK(snapshot.isAtEnd());
+    CHECK_EQUAL(BH_RUNNING, seq[1].getStatus());
+    CHECK_EQUAL(BH_INVALID, seq[2].getStatus());
+
+    seq[1].m_eReturnStatus = BH_RUNNING;
+    CHECK_EQUAL(BH_RUNNING, seq.tick());
+    CHECK_EQUAL(1, seq[0].m_iUpdateCalled);
+    CHECK_EQUAL(3, seq[1].m_iUpdateCalled);
+    CHECK_EQUAL(1, seq[1].m_iInitializeCalled);
+    CHECK_EQUAL(1, seq[2].m_iUpdateCalled);
 }
 
-TEST(StarterKit1, SelectorOneChildPassThrough)
+TEST(StarterKit1, SnapshotMovesToCopy)
 {
-    Status status[2] = { BH_SUCCESS, BH_FAILURE };
+    CountdownBehavior a[2] = { CountdownBehavior(1), CountdownBehavior(1) };
+    CountdownBehavior b[2] = { CountdownBehavior(3), CountdownBehavior(3) };
+    CountdownBehavior c[2] = { CountdownBehavior(5), CountdownBehavior(5) };
+    Parallel parallel[2] = { Parallel(Parallel::RequireAll, Parallel::RequireOne), Parallel(Parallel::RequireAll, Parallel::RequireOne) };
     for (int i=0; i<2; ++i)
     {
-        MockSelector seq(1);
+        parallel[i].addChild(&a[i]);
+        parallel[i].addChild(&b[i]);
+        parallel[i].addChild(&c[i]);
+    }
 
-        CHECK_EQUAL(seq.tick(), BH_RUNNING);
-        CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(BH_RUNNING, parallel[0].tick());
+    CHECK_EQUAL(BH_RUNNING, parallel[0].tick());
+    CHECK_EQUAL(2u, parallel[0].getActiveCount());
+
+    // Restore into a copy that never ran, like an agent moved elsewhere.
+    Snapshot snapshot;
+    parallel[0].save(snapshot);
+    Snapshot received;
+    received.assign(snapshot.getData(), snapshot.getSize());
+    parallel[1].restore(received);
+
+    CHECK_EQUAL(2u, parallel[1].getActiveCount());
+    CHECK_EQUAL(BH_SUCCESS, a[1].getStatus());
+    CHECK_EQUAL(1, b[1].m_iRemaining);
+    CHECK_EQUAL(BH_RUNNING, parallel[1].tick());
+    CHECK_EQUAL(BH_SUCCESS, b[1].getStatus());
+    CHECK_EQUAL(1u, parallel[1].getActiveCount());
+    CHECK_EQUAL(BH_RUNNING, parallel[1].tick());
+    CHECK_EQUAL(BH_SUCCESS, parallel[1].tick());
+}
 
-        seq[0].m_eReturnStatus = status[i];
-        CHECK_EQUAL(seq.tick(), status[i]);
-        CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+TEST(StarterKit1, SnapshotProgram)
+{
+    CountdownBehavior first(3), second(4);
+    Sequence seq;
+    seq.addChild(&first);
+    seq.addChild(&second);
+    Program program(seq);
+
+    CHECK_EQUAL(BH_RUNNING, program.tick());
+    CHECK_EQUAL(BH_RUNNING, program.tick());
+    Snapshot snapshot;
+    program.save(snapshot);
+
+    int ticks = 0;
+    while (program.tick() == BH_RUNNING)
+    {
+        ++ticks;
+    }
+
+    program.restore(snapshot);
+    int again = 0;
+    while (program.tick() == BH_RUNNING)
+    {
+        ++again;
     }
+    CHECK_EQUAL(3, ticks);
+    CHECK_EQUAL(ticks, again);
+    CHECK_EQUAL(BH_SUCCESS, program.getStatus());
 }
 
-class Parallel : public Composite
+// ============================================================================
+
+class ActivePath : public Behavior
+/**
+ * Ticks a tree starting from the node it was running last time, rather
+ * than descending from the root through every running sequence and
+ * selector.  Only when that node terminates does it climb back up, letting
+ * each parent carry on with its next child.  The descent stops at any node
+ * without a resume point, so reactive composites like the ActiveSelector or
+ * the Monitor, and decorators, are still ticked as a whole and re-check
+ * their conditions every time.
+ */
 {
 public:
-    enum Policy
+    ActivePath(Behavior& root)
+    :	m_pRoot(&root)
+    ,	m_pResume(NULL)
     {
-        RequireOne,
-        RequireAll,
-    };
+    }
 
-    Parallel(Policy forSuccess, Policy forFailure)
-    :	m_eSuccessPolicy(forSuccess)
-    ,	m_eFailurePolicy(forFailure)
+    virtual ~ActivePath()
     {
     }
 
-    virtual ~Parallel() {}
+    // Sequences and selectors skipped by the next tick, the root included.
+    size_t getDepth() const
+    {
+        return m_Path.size();
+    }
+
+    Behavior* getResumeNode() const
+    {
+        return m_pResume;
+    }
 
 protected:
-    Policy m_eSuccessPolicy;
-    Policy m_eFailurePolicy;
+    struct Entry
+    {
+        Behavior* m_pNode;
+        ResumePoint m_Point;
+    };
 
-    virtual Status update()
-    {	
-        size_t iSuccessCount = 0, iFailureCount = 0;
+    virtual void onInitialize()
+    {
+        m_Path.clear();
+        m_pResume = NULL;
+    }
 
-        for (Behaviors::iterator it = m_Children.begin(); it != m_Children.end(); ++it)
+    virtual Status update()
+    {
+        if (m_pResume == NULL)
         {
-            Behavior& b = **it;
-            if (!b.isTerminated())
+            Status s = m_pRoot->tick();
+            if (s == BH_RUNNING)
             {
-                b.tick();
+                record(*m_pRoot);
             }
+            return s;
+        }
 
-            if (b.getStatus() == BH_SUCCESS)
+        Status s = m_pResume->tick();
+        while (s != BH_RUNNING)
+        {
+            if (m_Path.empty())
             {
-                ++iSuccessCount;
-                if (m_eSuccessPolicy == RequireOne)
-                {
-                    return BH_SUCCESS;
-                }
+                m_pResume = NULL;
+                return s;
             }
-
-            if (b.getStatus() == BH_FAILURE)
+            Entry entry = m_Path.back();
+            m_Path.pop_back();
+            s = resume(entry, s);
+            if (s == BH_RUNNING)
             {
-                ++iFailureCount;
-                if (m_eFailurePolicy == RequireOne)
-                {
-                    return BH_FAILURE;
-                }
+                record(*entry.m_pNode);
             }
         }
+        return BH_RUNNING;
+    }
 
-        if (m_eFailurePolicy == RequireAll  &&  iFailureCount == m_Children.size())
+    virtual void onTerminate(Status s)
+    {
+        if (s != BH_ABORTED  ||  m_pResume == NULL)
         {
-            return BH_FAILURE;
+            return;
+        }
+        if (m_pResume->isRunning())
+        {
+            m_pResume->abort();
+        }
+        while (!m_Path.empty())
+        {
+            m_Path.back().m_pNode->abort();
+            m_Path.pop_back();
         }
+        m_pResume = NULL;
+    }
 
-        if (m_eSuccessPolicy == RequireAll  &&  iSuccessCount == m_Children.size())
+    // The current child of a composite on the path finished with 's'.
+    // Either the composite moves on to its next child, ticked as usual, or
+    // it finishes with the same result; both are done as in update().
+    Status resume(const Entry& entry, Status s)
+    {
+        const ResumePoint& point = entry.m_Point;
+        if (s == point.m_eProceed  &&  ++*point.m_pCurrent != point.m_pChildren->end())
         {
-            return BH_SUCCESS;
+            return entry.m_pNode->tick();
         }
 
-        return BH_RUNNING;
+        Behavior& node = *entry.m_pNode;
+        node.m_eStatus = s;
+        PROFILE_TERMINATE(&node);
+        TRACE_TERMINATE(&node, s);
+        node.onTerminate(s);
+        return s;
     }
 
-    virtual void onTerminate(Status)
+    // Follow the current children down from a running node.
+    void record(Behavior& bh)
     {
-        for (Behaviors::iterator it = m_Children.begin(); it != m_Children.end(); ++it)
+        Behavior* node = &bh;
+        Entry entry;
+        while (node->isRunning()  &&  node->getResumePoint(entry.m_Point))
         {
-            Behavior& b = **it;
-            if (b.isRunning())
-            {
-                b.abort();
-            }
+            entry.m_pNode = node;
+            m_Path.push_back(entry);
+            node = **entry.m_Point.m_pCurrent;
         }
+        m_pResume = node;
     }
-};
 
+    Behavior* m_pRoot;
+    Behavior* m_pResume;
+    std::vector<Entry> m_Path;
+};
 
-TEST(StarterKit1, ParallelSucceedRequireAll)
+TEST(StarterKit1, ActivePathResumesAtLeaf)
 {
-    Parallel parallel(Parallel::RequireAll, Parallel::RequireOne);
-    MockBehavior children[2];
-    parallel.addChild(&children[0]);
-    parallel.addChild(&children[1]);
-
-    CHECK_EQUAL(BH_RUNNING, parallel.tick());
-    children[0].m_eReturnStatus = BH_SUCCESS;
-    CHECK_EQUAL(BH_RUNNING, parallel.tick());
-    children[1].m_eReturnStatus = BH_SUCCESS;
-    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+    MockSequence inner(2);
+    MockBehavior fallback;
+    Selector outer;
+    outer.addChild(&inner);
+    outer.addChild(&fallback);
+    ActivePath path(outer);
+
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2u, path.getDepth());
+    CHECK(path.getResumeNode() == &inner[0]);
+
+    // Composites on the path aren't ticked while the leaf keeps running.
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2, inner[0].m_iUpdateCalled);
+
+    // Finished leaves hand over to the next child of their parent.
+    inner[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK(path.getResumeNode() == &inner[1]);
+    CHECK_EQUAL(1, inner[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, inner[1].m_iUpdateCalled);
+
+    // A failing sequence hands over to the selector's fallback.
+    inner[1].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK(path.getResumeNode() == &fallback);
+    CHECK_EQUAL(BH_FAILURE, inner.getStatus());
+    CHECK_EQUAL(1u, path.getDepth());
+
+    fallback.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, path.tick());
+    CHECK_EQUAL(BH_SUCCESS, outer.getStatus());
+    CHECK(path.getResumeNode() == NULL);
+
+    // The next run starts over from the root.
+    fallback.m_eReturnStatus = BH_RUNNING;
+    inner[0].m_eReturnStatus = BH_RUNNING;
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2, inner[0].m_iInitializeCalled);
 }
 
-TEST(StarterKit1, ParallelSucceedRequireOne)
+TEST(StarterKit1, ActivePathStopsAtReactiveNodes)
 {
-    Parallel parallel(Parallel::RequireOne, Parallel::RequireAll);
-    MockBehavior children[2];
-    parallel.addChild(&children[0]);
-    parallel.addChild(&children[1]);
-
-    CHECK_EQUAL(BH_RUNNING, parallel.tick());
-    children[0].m_eReturnStatus = BH_SUCCESS;
-    CHECK_EQUAL(BH_SUCCESS, parallel.tick());
+    MockCondition guard;
+    guard.m_bReturnValue = false;
+    MockBehavior action, idle;
+    ActiveSelector reactive;
+    reactive.addChild(&guard);
+    reactive.addChild(&idle);
+    Sequence root;
+    root.addChild(&action);
+    root.addChild(&reactive);
+    action.m_eReturnStatus = BH_SUCCESS;
+
+    ActivePath path(root);
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK(path.getResumeNode() == &reactive);
+
+    // The guard is checked on every tick, and can still take over.
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2, guard.m_iCheckCalled);
+    guard.m_bReturnValue = true;
+    CHECK_EQUAL(BH_SUCCESS, path.tick());
+    CHECK_EQUAL(1, idle.m_iTerminateCalled);
+    CHECK_EQUAL(1, action.m_iUpdateCalled);
 }
 
-TEST(StarterKit1, ParallelFailureRequireAll)
-{
-    Parallel parallel(Parallel::RequireOne, Parallel::RequireAll);
-    MockBehavior children[2];
-    parallel.addChild(&children[0]);
-    parallel.addChild(&children[1]);
-
-    CHECK_EQUAL(BH_RUNNING, parallel.tick());
-    children[0].m_eReturnStatus = BH_FAILURE;
-    CHECK_EQUAL(BH_RUNNING, parallel.tick());
-    children[1].m_eReturnStatus = BH_FAILURE;
-    CHECK_EQUAL(BH_FAILURE, parallel.tick());
-}
+// ============================================================================
 
-TEST(StarterKit1, ParallelFailureRequireOne)
+struct BenchmarkBehavior : public Behavior
 {
-    Parallel parallel(Parallel::RequireAll, Parallel::RequireOne);
-    MockBehavior children[2];
-    parallel.addChild(&children[0]);
-    parallel.addChild(&children[1]);
-
-    CHECK_EQUAL(BH_RUNNING, parallel.tick());
-    children[0].m_eReturnStatus = BH_FAILURE;
-    CHECK_EQUAL(BH_FAILURE, parallel.tick());
-}
+    size_t m_iDuration;
+    size_t m_iRemaining;
 
-class Monitor : public Parallel
-{
-public:
-	Monitor()
-	:	Parallel(Parallel::RequireOne, Parallel::RequireOne)
-	{
-	}
+    BenchmarkBehavior(size_t duration)
+    :	m_iDuration(duration)
+    ,	m_iRemaining(0)
+    {
+    }
 
-	void addCondition(Behavior* condition)
+    virtual void onInitialize()
     {
-        m_Children.insert(m_Children.begin(), condition);
+        m_iRemaining = m_iDuration;
     }
 
-    void addAction(Behavior* action)
+    virtual Status update()
     {
-        m_Children.push_back(action);
+        return --m_iRemaining > 0 ? BH_RUNNING : BH_SUCCESS;
     }
 };
 
-
-// ============================================================================
-
-class ActiveSelector : public Selector
+Behavior* createBenchmarkTree(const bench::Config& config, size_t depth, size_t& leaves, Behaviors& nodes)
 {
-protected:
-
-    virtual void onInitialize()
+    Behavior* node;
+    if (depth == 0)
     {
-        m_Current = m_Children.end();
+        node = new BenchmarkBehavior(config.isRunningLeaf(leaves++) ? config.m_iRunningTicks : 1);
     }
-
-    virtual Status update()
+    else
     {
-        Behaviors::iterator previous = m_Current;
-
-        Selector::onInitialize();
-        Status result = Selector::update();
-
-        if (previous != m_Children.end()  &&  m_Current != previous)
+        Sequence* seq = new Sequence;
+        for (size_t i=0; i<config.m_iBranching; ++i)
         {
-            (*previous)->onTerminate(BH_ABORTED);
+            seq->addChild(createBenchmarkTree(config, depth - 1, leaves, nodes));
         }
-        return result;
+        node = seq;
     }
-};
+    nodes.push_back(node);
+    return node;
+}
 
-typedef MockComposite<ActiveSelector> MockActiveSelector;
+BENCHMARK(StarterKit1, SyntheticTree)
+{
+    const bench::Config& config = benchmark.getConfig();
+    Behaviors nodes;
+    nodes.reserve(config.getNodeCount());
+    size_t leaves = 0;
 
+    benchmark.beginSetup();
+    Behavior* root = createBenchmarkTree(config, config.m_iDepth, leaves, nodes);
+    benchmark.endSetup();
 
-TEST(StarterKit1, ActiveBinarySelector)
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        root->tick();
+    }
+    benchmark.endTicks();
+
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        delete nodes[i];
+    }
+}
+
+// Same tree, resumed at its running leaves.  The gain grows with the depth
+// and with how long leaves run, e.g. --depth 8 --duration 20.
+BENCHMARK(StarterKit1, ActivePath)
 {
-    MockActiveSelector sel(2);
+    const bench::Config& config = benchmark.getConfig();
+    Behaviors nodes;
+    nodes.reserve(config.getNodeCount());
+    size_t leaves = 0;
+
+    benchmark.beginSetup();
+    Behavior* root = createBenchmarkTree(config, config.m_iDepth, leaves, nodes);
+    ActivePath path(*root);
+    benchmark.endSetup(sizeof(path));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        path.tick();
+    }
+    benchmark.endTicks();
 
-    sel[0].m_eReturnStatus = BH_FAILURE;
-    sel[1].m_eReturnStatus = BH_RUNNING;
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        delete nodes[i];
+    }
+}
 
-    CHECK_EQUAL(sel.tick(), BH_RUNNING);
-    CHECK_EQUAL(1, sel[0].m_iInitializeCalled);
-    CHECK_EQUAL(1, sel[0].m_iTerminateCalled);
-    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
-    CHECK_EQUAL(0, sel[1].m_iTerminateCalled);
+const size_t k_PoolWorkerCount = 7;
 
-    CHECK_EQUAL(sel.tick(), BH_RUNNING);
-    CHECK_EQUAL(2, sel[0].m_iInitializeCalled);
-    CHECK_EQUAL(2, sel[0].m_iTerminateCalled);
-    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
-    CHECK_EQUAL(0, sel[1].m_iTerminateCalled);
+// The root's subtrees ticked as jobs, with more workers than subtrees so
+// the cost of handing out each batch shows.  Uses a hundredth of the usual
+// tick count.
+BENCHMARK(StarterKit1, ParallelOnWorkerPool)
+{
+    benchmark.setTickCount(std::max<size_t>(benchmark.getTickCount() / 100, 1));
+    const bench::Config& config = benchmark.getConfig();
+    Behaviors nodes;
+    nodes.reserve(config.getNodeCount());
+    size_t leaves = 0;
+
+    benchmark.beginSetup();
+    WorkerPool pool(k_PoolWorkerCount);
+    Parallel root(Parallel::RequireAll, Parallel::RequireOne);
+    root.setJobSystem(&pool);
+    for (size_t i=0; i<config.m_iBranching; ++i)
+    {
+        root.addChild(createBenchmarkTree(config, config.m_iDepth > 0 ? config.m_iDepth - 1 : 0, leaves, nodes));
+    }
+    benchmark.endSetup(sizeof(root) + sizeof(pool));
 
-    sel[0].m_eReturnStatus = BH_RUNNING;
-    CHECK_EQUAL(sel.tick(), BH_RUNNING);
-    CHECK_EQUAL(3, sel[0].m_iInitializeCalled);
-    CHECK_EQUAL(2, sel[0].m_iTerminateCalled);
-    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
-    CHECK_EQUAL(1, sel[1].m_iTerminateCalled);
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        root.tick();
+    }
+    benchmark.endTicks();
 
-    sel[0].m_eReturnStatus = BH_SUCCESS;
-    CHECK_EQUAL(sel.tick(), BH_SUCCESS);
-    CHECK_EQUAL(3, sel[0].m_iInitializeCalled);
-    CHECK_EQUAL(3, sel[0].m_iTerminateCalled);
-    CHECK_EQUAL(1, sel[1].m_iInitializeCalled);
-    CHECK_EQUAL(1, sel[1].m_iTerminateCalled);
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        delete nodes[i];
+    }
 }
 
 } // namespace bt1
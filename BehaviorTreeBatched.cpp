@@ -0,0 +1,1269 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include "Shared.h"
+#include "Test.h"
+#include "Metrics.h"
+
+// Batch conditions use SSE where available, unless BTSK_NO_SIMD is defined.
+#if !defined(BTSK_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define BTSK_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace bt5
+{
+
+// ============================================================================
+
+enum Status
+{
+    BH_INVALID,
+    BH_SUCCESS,
+    BH_FAILURE,
+    BH_RUNNING,
+    BH_ABORTED,
+};
+
+class Leaf
+/**
+ * Logic for actions and conditions, shared by every agent running the tree.
+ * Whatever state a leaf needs per agent is indexed by the agent argument.
+ */
+{
+public:
+    virtual ~Leaf()
+    {
+    }
+
+    virtual Status update(size_t agent) = 0;
+
+    virtual void onInitialize(size_t) {}
+    virtual void onTerminate(size_t, Status) {}
+};
+
+class BatchCondition : public Leaf
+/**
+ * Condition evaluated for a whole range of agents at once, typically from
+ * per-agent data kept in arrays.  BatchedTree::tick() evaluates it for all
+ * agents up front; run as a plain leaf it is evaluated one agent at a time.
+ */
+{
+public:
+    // Write BH_SUCCESS or BH_FAILURE for agents [first, first + count).
+    virtual void evaluate(size_t first, size_t count, uint8_t* results) = 0;
+
+    virtual Status update(size_t agent)
+    {
+        uint8_t result;
+        evaluate(agent, 1, &result);
+        return static_cast<Status>(result);
+    }
+};
+
+enum NodeType
+{
+    NODE_LEAF,
+    NODE_SEQUENCE,
+    NODE_SELECTOR,
+    NODE_REPEAT,
+    NODE_BATCH_CONDITION,
+};
+
+struct Node
+{
+    NodeType m_eType;
+    uint16_t m_iFirstChild;
+    uint16_t m_iChildCount;
+    uint16_t m_iState;
+    int m_iLimit;
+    Leaf* m_pLeaf;
+    uint32_t m_iKey;
+};
+
+const uint16_t k_NoNode = 0xffff;
+
+class TreeDefinition
+/**
+ * Immutable node graph, built bottom-up so the children of each composite
+ * are stored contiguously.  The last node added is the root.  To change a
+ * tree that agents are running, build a new definition and reload it.
+ */
+{
+public:
+    TreeDefinition()
+    :	m_iCompositeCount(0)
+    ,	m_iRepeatCount(0)
+    {
+    }
+
+    size_t addBatchCondition(BatchCondition& condition)
+    {
+        Node& n = addNode(NODE_BATCH_CONDITION);
+        n.m_pLeaf = &condition;
+        n.m_iState = static_cast<uint16_t>(m_BatchConditions.size());
+        m_BatchConditions.push_back(&condition);
+        return m_Nodes.size() - 1;
+    }
+
+    size_t addLeaf(Leaf& leaf)
+    {
+        Node& n = addNode(NODE_LEAF);
+        n.m_pLeaf = &leaf;
+        return m_Nodes.size() - 1;
+    }
+
+    size_t addSequence(const size_t* children, size_t count)
+    {
+        addComposite(NODE_SEQUENCE, children, count);
+        return m_Nodes.size() - 1;
+    }
+
+    size_t addSelector(const size_t* children, size_t count)
+    {
+        addComposite(NODE_SELECTOR, children, count);
+        return m_Nodes.size() - 1;
+    }
+
+    size_t addRepeat(size_t child, int count)
+    {
+        Node& n = addNode(NODE_REPEAT);
+        n.m_iFirstChild = static_cast<uint16_t>(m_Children.size());
+        n.m_iChildCount = 1;
+        n.m_iState = static_cast<uint16_t>(m_iRepeatCount++);
+        n.m_iLimit = count;
+        m_Children.push_back(static_cast<uint16_t>(child));
+        return m_Nodes.size() - 1;
+    }
+
+    // Nodes with the same non-zero key are taken to be the same when an
+    // agent moves to a new version of the definition, see reload().
+    void setKey(size_t index, uint32_t key)
+    {
+        ASSERT(index < m_Nodes.size()  &&  key != 0);
+        m_Nodes[index].m_iKey = key;
+    }
+
+    const Node& getNode(size_t index) const
+    {
+        ASSERT(index < m_Nodes.size());
+        return m_Nodes[index];
+    }
+
+    size_t getChild(const Node& node, size_t index) const
+    {
+        ASSERT(index < node.m_iChildCount);
+        return m_Children[node.m_iFirstChild + index];
+    }
+
+    size_t getRoot() const
+    {
+        ASSERT(!m_Nodes.empty());
+        return m_Nodes.size() - 1;
+    }
+
+    size_t getNodeCount() const
+    {
+        return m_Nodes.size();
+    }
+
+    size_t getCompositeCount() const
+    {
+        return m_iCompositeCount;
+    }
+
+    size_t getRepeatCount() const
+    {
+        return m_iRepeatCount;
+    }
+
+    size_t getBatchConditionCount() const
+    {
+        return m_BatchConditions.size();
+    }
+
+    BatchCondition& getBatchCondition(size_t index) const
+    {
+        ASSERT(index < m_BatchConditions.size());
+        return *m_BatchConditions[index];
+    }
+
+protected:
+    Node& addNode(NodeType type)
+    {
+        ASSERT(m_Nodes.size() < std::numeric_limits<uint16_t>::max());
+        Node n = { type, 0, 0, 0, 0, NULL, 0 };
+        m_Nodes.push_back(n);
+        return m_Nodes.back();
+    }
+
+    void addComposite(NodeType type, const size_t* children, size_t count)
+    {
+        ASSERT(count > 0);
+        Node& n = addNode(type);
+        n.m_iFirstChild = static_cast<uint16_t>(m_Children.size());
+        n.m_iChildCount = static_cast<uint16_t>(count);
+        n.m_iState = static_cast<uint16_t>(m_iCompositeCount++);
+        for (size_t i=0; i<count; ++i)
+        {
+            ASSERT(children[i] < m_Nodes.size() - 1);
+            m_Children.push_back(static_cast<uint16_t>(children[i]));
+        }
+    }
+
+    std::vector<Node> m_Nodes;
+    std::vector<uint16_t> m_Children;
+    std::vector<BatchCondition*> m_BatchConditions;
+    size_t m_iCompositeCount;
+    size_t m_iRepeatCount;
+};
+
+// ----------------------------------------------------------------------------
+
+class BatchedTree
+/**
+ * Runs one TreeDefinition for many agents.  Per-agent state is kept in
+ * structure-of-arrays form: one status per node, one current-child index
+ * per composite and one counter per repeat, each array agent-major.  The
+ * results of batch conditions are stored condition-major instead, so each
+ * condition writes one contiguous run of agents.
+ */
+{
+public:
+    BatchedTree(const TreeDefinition& definition, size_t agents = 0)
+    :	m_pDefinition(&definition)
+    ,	m_pPrevious(NULL)
+    ,	m_iAgentCount(0)
+    ,	m_iStaleCount(0)
+    ,	m_bEvaluated(false)
+    {
+        addAgents(agents);
+    }
+
+    // Switch to another version of the definition.  Each agent moves over
+    // on its next tick, so a reload costs one pass over the agents' state
+    // spread over the next tick, and the arrays from before the previous
+    // reload are reused.  The path an agent is running is carried over
+    // as far as its nodes have matching keys, leaves also being the same
+    // Leaf object; the agent's other nodes start out invalid.  A running
+    // composite whose current child has no match starts over.  A leaf the
+    // agent was running that isn't carried over gets onTerminate() with
+    // BH_ABORTED as the agent moves.  Both definitions must stay alive
+    // until getStaleCount() drops to zero.
+    void reload(const TreeDefinition& definition)
+    {
+        finishReload();
+        m_pPrevious = m_pDefinition;
+        m_pDefinition = &definition;
+
+        m_Status.swap(m_PreviousStatus);
+        m_Current.swap(m_PreviousCurrent);
+        m_Counter.swap(m_PreviousCounter);
+        m_Status.resize(m_iAgentCount * definition.getNodeCount());
+        m_Current.resize(m_iAgentCount * definition.getCompositeCount());
+        m_Counter.resize(m_iAgentCount * definition.getRepeatCount());
+        m_Conditions.resize(m_iAgentCount * definition.getBatchConditionCount());
+
+        // New node index to old, by key.  The old keys are sorted once, so
+        // each new node only looks at the old nodes with the same key.
+        std::vector<std::pair<uint32_t, uint16_t> > keys;
+        for (size_t o=0; o<m_pPrevious->getNodeCount(); ++o)
+        {
+            uint32_t key = m_pPrevious->getNode(o).m_iKey;
+            if (key != 0)
+            {
+                keys.push_back(std::make_pair(key, static_cast<uint16_t>(o)));
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+
+        m_Match.assign(definition.getNodeCount(), k_NoNode);
+        for (size_t n=0; n<definition.getNodeCount(); ++n)
+        {
+            const Node& node = definition.getNode(n);
+            if (node.m_iKey == 0)
+            {
+                continue;
+            }
+            std::vector<std::pair<uint32_t, uint16_t> >::const_iterator it;
+            it = std::lower_bound(keys.begin(), keys.end(), std::make_pair(node.m_iKey, (uint16_t)0));
+            for (; it != keys.end()  &&  it->first == node.m_iKey; ++it)
+            {
+                const Node& old = m_pPrevious->getNode(it->second);
+                if (old.m_eType == node.m_eType  &&  old.m_pLeaf == node.m_pLeaf)
+                {
+                    m_Match[n] = it->second;
+                    break;
+                }
+            }
+        }
+
+        m_Stale.assign(m_iAgentCount, 1);
+        m_iStaleCount = m_iAgentCount;
+        if (m_iStaleCount == 0)
+        {
+            m_pPrevious = NULL;
+        }
+    }
+
+    // Move every agent still on the previous definition over now.
+    void finishReload()
+    {
+        for (size_t agent=0; m_iStaleCount > 0  &&  agent<m_iAgentCount; ++agent)
+        {
+            migrate(agent);
+        }
+    }
+
+    // Agents that haven't been ticked since the last reload.
+    size_t getStaleCount() const
+    {
+        return m_iStaleCount;
+    }
+
+    size_t addAgents(size_t count)
+    {
+        finishReload();
+        size_t first = m_iAgentCount;
+        m_iAgentCount += count;
+        m_Status.resize(m_iAgentCount * m_pDefinition->getNodeCount(), BH_INVALID);
+        m_Current.resize(m_iAgentCount * m_pDefinition->getCompositeCount(), 0);
+        m_Counter.resize(m_iAgentCount * m_pDefinition->getRepeatCount(), 0);
+        m_Conditions.resize(m_iAgentCount * m_pDefinition->getBatchConditionCount(), BH_INVALID);
+        return first;
+    }
+
+    // Agents [first, first + count) start over from the root on their next
+    // tick.  Leaves are not told, so reset any state they keep per agent.
+    void resetAgents(size_t first, size_t count)
+    {
+        ASSERT(first + count <= m_iAgentCount);
+        finishReload();
+        fill(m_Status, first, count, (uint8_t)BH_INVALID);
+        fill(m_Current, first, count, (uint16_t)0);
+        fill(m_Counter, first, count, 0);
+    }
+
+    // The agents after the range move down to fill the gap, so leaves that
+    // keep state per agent must move theirs the same way.
+    void removeAgents(size_t first, size_t count)
+    {
+        ASSERT(first + count <= m_iAgentCount);
+        finishReload();
+        erase(m_Status, first, count);
+        erase(m_Current, first, count);
+        erase(m_Counter, first, count);
+        m_iAgentCount -= count;
+        m_Conditions.resize(m_iAgentCount * m_pDefinition->getBatchConditionCount());
+    }
+
+    size_t getAgentCount() const
+    {
+        return m_iAgentCount;
+    }
+
+    size_t getBytesPerAgent() const
+    {
+        return m_pDefinition->getNodeCount() * sizeof(uint8_t)
+             + m_pDefinition->getCompositeCount() * sizeof(uint16_t)
+             + m_pDefinition->getRepeatCount() * sizeof(int)
+             + m_pDefinition->getBatchConditionCount() * sizeof(uint8_t);
+    }
+
+    // Dynamic state of agents [first, first + count): their statuses, then
+    // current children, then counters.  Each array is agent-major, so a
+    // range is copied with one memcpy per array.  Batch condition results
+    // are recomputed every tick and left out, as is any state leaves keep.
+    size_t getSnapshotSize(size_t count) const
+    {
+        return count * (m_pDefinition->getNodeCount() * sizeof(uint8_t)
+                      + m_pDefinition->getCompositeCount() * sizeof(uint16_t)
+                      + m_pDefinition->getRepeatCount() * sizeof(int));
+    }
+
+    // Finish any reload first, since agents still on the previous version
+    // have state of another shape.
+    void save(size_t first, size_t count, void* snapshot) const
+    {
+        ASSERT(first + count <= m_iAgentCount  &&  m_iStaleCount == 0);
+        uint8_t* out = static_cast<uint8_t*>(snapshot);
+        out = copyOut(m_Status, first, count, out);
+        out = copyOut(m_Current, first, count, out);
+        copyOut(m_Counter, first, count, out);
+    }
+
+    // The agents restored may differ from those saved, e.g. after moving
+    // to another tree with the same definition.
+    void restore(size_t first, size_t count, const void* snapshot)
+    {
+        ASSERT(first + count <= m_iAgentCount);
+        finishReload();
+        const uint8_t* in = static_cast<const uint8_t*>(snapshot);
+        in = copyIn(m_Status, first, count, in);
+        in = copyIn(m_Current, first, count, in);
+        copyIn(m_Counter, first, count, in);
+    }
+
+    // Batch conditions are evaluated for every agent first, whether or not
+    // it reaches them this tick; the composites then branch on the results.
+    void tick()
+    {
+        for (size_t c=0; c<m_pDefinition->getBatchConditionCount(); ++c)
+        {
+            m_pDefinition->getBatchCondition(c).evaluate(0, m_iAgentCount, &m_Conditions[c * m_iAgentCount]);
+        }
+
+        m_bEvaluated = true;
+        size_t root = m_pDefinition->getRoot();
+        for (size_t agent=0; agent<m_iAgentCount; ++agent)
+        {
+            if (m_iStaleCount > 0)
+            {
+                migrate(agent);
+            }
+            tickNode(agent, root);
+        }
+        m_bEvaluated = false;
+        METRICS_ADD(COUNTER_TREE_TICKS, m_iAgentCount);
+    }
+
+    Status tick(size_t agent)
+    {
+        ASSERT(agent < m_iAgentCount);
+        if (m_iStaleCount > 0)
+        {
+            migrate(agent);
+        }
+        METRICS_ADD(COUNTER_TREE_TICKS, 1);
+        return tickNode(agent, m_pDefinition->getRoot());
+    }
+
+    Status getStatus(size_t agent) const
+    {
+        return getStatus(agent, m_pDefinition->getRoot());
+    }
+
+    // Node of the current definition.  Agents not moved over yet report
+    // the status of the matching node from before, if there is one.
+    Status getStatus(size_t agent, size_t node) const
+    {
+        ASSERT(agent < m_iAgentCount);
+        if (m_iStaleCount > 0  &&  m_Stale[agent])
+        {
+            size_t old = m_Match[node];
+            return old == k_NoNode ? BH_INVALID : static_cast<Status>(m_PreviousStatus[agent * m_pPrevious->getNodeCount() + old]);
+        }
+        return static_cast<Status>(m_Status[agent * m_pDefinition->getNodeCount() + node]);
+    }
+
+protected:
+    Status tickNode(size_t agent, size_t index)
+    {
+        const Node& node = m_pDefinition->getNode(index);
+        uint8_t& status = m_Status[agent * m_pDefinition->getNodeCount() + index];
+
+        if (status != BH_RUNNING)
+        {
+            onInitialize(agent, node);
+        }
+
+        METRICS_ADD(COUNTER_NODE_UPDATES, 1);
+        Status s = update(agent, node);
+        status = static_cast<uint8_t>(s);
+
+        if (s != BH_RUNNING  &&  node.m_eType == NODE_LEAF)
+        {
+            node.m_pLeaf->onTerminate(agent, s);
+        }
+        return s;
+    }
+
+    void onInitialize(size_t agent, const Node& node)
+    {
+        switch (node.m_eType)
+        {
+        case NODE_LEAF:
+            node.m_pLeaf->onInitialize(agent);
+            break;
+        case NODE_SEQUENCE:
+        case NODE_SELECTOR:
+            current(agent, node) = 0;
+            break;
+        case NODE_REPEAT:
+            counter(agent, node) = 0;
+            break;
+        case NODE_BATCH_CONDITION:
+            break;
+        }
+    }
+
+    Status update(size_t agent, const Node& node)
+    {
+        switch (node.m_eType)
+        {
+        case NODE_LEAF:
+            return node.m_pLeaf->update(agent);
+        case NODE_SEQUENCE:
+            return updateComposite(agent, node, BH_SUCCESS);
+        case NODE_SELECTOR:
+            return updateComposite(agent, node, BH_FAILURE);
+        case NODE_REPEAT:
+            return updateRepeat(agent, node);
+        case NODE_BATCH_CONDITION:
+            if (m_bEvaluated)
+            {
+                return static_cast<Status>(m_Conditions[node.m_iState * m_iAgentCount + agent]);
+            }
+            return node.m_pLeaf->update(agent);
+        }
+        return BH_INVALID;
+    }
+
+    // Sequences keep going while children succeed, selectors while they fail.
+    Status updateComposite(size_t agent, const Node& node, Status proceed)
+    {
+        uint16_t& i = current(agent, node);
+        for (;;)
+        {
+            Status s = tickNode(agent, m_pDefinition->getChild(node, i));
+            if (s != proceed)
+            {
+                return s;
+            }
+            if (++i == node.m_iChildCount)
+            {
+                return proceed;
+            }
+        }
+    }
+
+    Status updateRepeat(size_t agent, const Node& node)
+    {
+        int& count = counter(agent, node);
+        for (;;)
+        {
+            Status s = tickNode(agent, m_pDefinition->getChild(node, 0));
+            if (s == BH_RUNNING) return BH_RUNNING;
+            if (s == BH_FAILURE) return BH_FAILURE;
+            if (++count == node.m_iLimit) return BH_SUCCESS;
+        }
+    }
+
+    void migrate(size_t agent)
+    {
+        if (!m_Stale[agent])
+        {
+            return;
+        }
+        if (!migrateNode(agent, m_pDefinition->getRoot(), true))
+        {
+            abortPrevious(agent, m_pPrevious->getRoot());
+        }
+        m_Stale[agent] = 0;
+        if (--m_iStaleCount == 0)
+        {
+            m_pPrevious = NULL;
+        }
+    }
+
+    // Top-down, so that only nodes on the path the agent was running keep
+    // their state; 'live' is false once off that path.  Returns whether
+    // the leaf it was running is still running.
+    bool migrateNode(size_t agent, size_t index, bool live)
+    {
+        const Node& node = m_pDefinition->getNode(index);
+        uint8_t& status = m_Status[agent * m_pDefinition->getNodeCount() + index];
+        size_t old = live ? m_Match[index] : k_NoNode;
+        status = old == k_NoNode ? (uint8_t)BH_INVALID : m_PreviousStatus[agent * m_pPrevious->getNodeCount() + old];
+
+        size_t next = node.m_iChildCount;
+        if (node.m_eType == NODE_SEQUENCE  ||  node.m_eType == NODE_SELECTOR)
+        {
+            uint16_t& i = current(agent, node);
+            i = 0;
+            if (old != k_NoNode)
+            {
+                const Node& before = m_pPrevious->getNode(old);
+                uint16_t was = m_PreviousCurrent[agent * m_pPrevious->getCompositeCount() + before.m_iState];
+                size_t child = was < before.m_iChildCount ? m_pPrevious->getChild(before, was) : k_NoNode;
+                for (size_t c=0; c<node.m_iChildCount; ++c)
+                {
+                    if (m_Match[m_pDefinition->getChild(node, c)] == child)
+                    {
+                        i = static_cast<uint16_t>(c);
+                        next = c;
+                    }
+                }
+                if (next == node.m_iChildCount  &&  status == BH_RUNNING)
+                {
+                    status = BH_INVALID;
+                }
+            }
+        }
+        else if (node.m_eType == NODE_REPEAT)
+        {
+            int& count = counter(agent, node);
+            count = 0;
+            if (old != k_NoNode)
+            {
+                count = m_PreviousCounter[agent * m_pPrevious->getRepeatCount() + m_pPrevious->getNode(old).m_iState];
+                next = 0;
+            }
+        }
+
+        bool carried = node.m_eType == NODE_LEAF  &&  status == BH_RUNNING;
+        for (size_t c=0; c<node.m_iChildCount; ++c)
+        {
+            carried |= migrateNode(agent, m_pDefinition->getChild(node, c), status == BH_RUNNING  &&  c == next);
+        }
+        return carried;
+    }
+
+    // Follow the path the agent was running under the previous definition
+    // down to its leaf, which won't be ticked again.
+    void abortPrevious(size_t agent, size_t index)
+    {
+        const Node& node = m_pPrevious->getNode(index);
+        if (m_PreviousStatus[agent * m_pPrevious->getNodeCount() + index] != BH_RUNNING)
+        {
+            return;
+        }
+        switch (node.m_eType)
+        {
+        case NODE_LEAF:
+            METRICS_ADD(COUNTER_ABORTS, 1);
+            node.m_pLeaf->onTerminate(agent, BH_ABORTED);
+            break;
+        case NODE_SEQUENCE:
+        case NODE_SELECTOR:
+            abortPrevious(agent, m_pPrevious->getChild(node, m_PreviousCurrent[agent * m_pPrevious->getCompositeCount() + node.m_iState]));
+            break;
+        case NODE_REPEAT:
+            abortPrevious(agent, m_pPrevious->getChild(node, 0));
+            break;
+        case NODE_BATCH_CONDITION:
+            break;
+        }
+    }
+
+    template <class T>
+    uint8_t* copyOut(const std::vector<T>& data, size_t first, size_t count, uint8_t* out) const
+    {
+        size_t stride = data.size() / (m_iAgentCount > 0 ? m_iAgentCount : 1);
+        size_t bytes = count * stride * sizeof(T);
+        if (bytes > 0)
+        {
+            memcpy(out, &data[first * stride], bytes);
+        }
+        return out + bytes;
+    }
+
+    template <class T>
+    const uint8_t* copyIn(std::vector<T>& data, size_t first, size_t count, const uint8_t* in)
+    {
+        size_t stride = data.size() / (m_iAgentCount > 0 ? m_iAgentCount : 1);
+        size_t bytes = count * stride * sizeof(T);
+        if (bytes > 0)
+        {
+            memcpy(&data[first * stride], in, bytes);
+        }
+        return in + bytes;
+    }
+
+    template <class T>
+    void fill(std::vector<T>& data, size_t first, size_t count, T value)
+    {
+        size_t stride = data.size() / (m_iAgentCount > 0 ? m_iAgentCount : 1);
+        std::fill(data.begin() + first * stride, data.begin() + (first + count) * stride, value);
+    }
+
+    template <class T>
+    void erase(std::vector<T>& data, size_t first, size_t count)
+    {
+        size_t stride = data.size() / (m_iAgentCount > 0 ? m_iAgentCount : 1);
+        data.erase(data.begin() + first * stride, data.begin() + (first + count) * stride);
+    }
+
+    uint16_t& current(size_t agent, const Node& node)
+    {
+        return m_Current[agent * m_pDefinition->getCompositeCount() + node.m_iState];
+    }
+
+    int& counter(size_t agent, const Node& node)
+    {
+        return m_Counter[agent * m_pDefinition->getRepeatCount() + node.m_iState];
+    }
+
+    const TreeDefinition* m_pDefinition;
+    const TreeDefinition* m_pPrevious;
+    size_t m_iAgentCount;
+    std::vector<uint8_t> m_Status;
+    std::vector<uint16_t> m_Current;
+    std::vector<int> m_Counter;
+    std::vector<uint8_t> m_Conditions;
+
+    // State under the previous definition, while agents are moved over.
+    std::vector<uint8_t> m_PreviousStatus;
+    std::vector<uint16_t> m_PreviousCurrent;
+    std::vector<int> m_PreviousCounter;
+    std::vector<uint16_t> m_Match;
+    std::vector<uint8_t> m_Stale;
+    size_t m_iStaleCount;
+    bool m_bEvaluated;
+};
+
+// ----------------------------------------------------------------------------
+
+// Statuses for four agents from the low bits of an SSE comparison mask.
+inline void storeMask(int mask, uint8_t* results)
+{
+    for (int k=0; k<4; ++k)
+    {
+        results[k] = static_cast<uint8_t>(BH_FAILURE - ((mask >> k) & 1));
+    }
+}
+
+class ThresholdCondition : public BatchCondition
+/**
+ * Succeeds for the agents whose value is below (or above) a threshold.
+ * 'values' holds one float per agent and must be kept valid by the owner.
+ */
+{
+public:
+    enum Compare
+    {
+        LESS,
+        GREATER,
+    };
+
+    ThresholdCondition(const float* values, float threshold, Compare compare = LESS)
+    :	m_pValues(values)
+    ,	m_fThreshold(threshold)
+    ,	m_eCompare(compare)
+    {
+    }
+
+    void setValues(const float* values)
+    {
+        m_pValues = values;
+    }
+
+    virtual void evaluate(size_t first, size_t count, uint8_t* results)
+    {
+        const float* v = m_pValues + first;
+        size_t i = 0;
+#if defined(BTSK_SSE)
+        __m128 threshold = _mm_set1_ps(m_fThreshold);
+        for (; i+4<=count; i+=4)
+        {
+            __m128 x = _mm_loadu_ps(v + i);
+            __m128 pass = m_eCompare == LESS ? _mm_cmplt_ps(x, threshold) : _mm_cmpgt_ps(x, threshold);
+            storeMask(_mm_movemask_ps(pass), results + i);
+        }
+#endif
+        for (; i<count; ++i)
+        {
+            bool pass = m_eCompare == LESS ? v[i] < m_fThreshold : v[i] > m_fThreshold;
+            results[i] = static_cast<uint8_t>(pass ? BH_SUCCESS : BH_FAILURE);
+        }
+    }
+
+protected:
+    const float* m_pValues;
+    float m_fThreshold;
+    Compare m_eCompare;
+};
+
+class DistanceCondition : public BatchCondition
+/**
+ * Succeeds for the agents within 'radius' of a target point, given their
+ * positions as separate arrays of x and y coordinates.
+ */
+{
+public:
+    DistanceCondition(const float* x, const float* y, float radius)
+    :	m_pX(x)
+    ,	m_pY(y)
+    ,	m_fTargetX(0.0f)
+    ,	m_fTargetY(0.0f)
+    ,	m_fRadiusSquared(radius * radius)
+    {
+    }
+
+    void setTarget(float x, float y)
+    {
+        m_fTargetX = x;
+        m_fTargetY = y;
+    }
+
+    virtual void evaluate(size_t first, size_t count, uint8_t* results)
+    {
+        const float* px = m_pX + first;
+        const float* py = m_pY + first;
+        size_t i = 0;
+#if defined(BTSK_SSE)
+        __m128 tx = _mm_set1_ps(m_fTargetX), ty = _mm_set1_ps(m_fTargetY);
+        __m128 r2 = _mm_set1_ps(m_fRadiusSquared);
+        for (; i+4<=count; i+=4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(px + i), tx);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(py + i), ty);
+            __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            storeMask(_mm_movemask_ps(_mm_cmple_ps(d2, r2)), results + i);
+        }
+#endif
+        for (; i<count; ++i)
+        {
+            float dx = px[i] - m_fTargetX, dy = py[i] - m_fTargetY;
+            results[i] = static_cast<uint8_t>(dx*dx + dy*dy <= m_fRadiusSquared ? BH_SUCCESS : BH_FAILURE);
+        }
+    }
+
+protected:
+    const float* m_pX;
+    const float* m_pY;
+    float m_fTargetX;
+    float m_fTargetY;
+    float m_fRadiusSquared;
+};
+
+// ----------------------------------------------------------------------------
+
+struct MockLeaf : public Leaf
+{
+    std::vector<int> m_iInitializeCalled;
+    std::vector<int> m_iTerminateCalled;
+    std::vector<int> m_iUpdateCalled;
+    std::vector<Status> m_eReturnStatus;
+    std::vector<Status> m_eTerminateStatus;
+
+    MockLeaf(size_t agents)
+    :	m_iInitializeCalled(agents, 0)
+    ,	m_iTerminateCalled(agents, 0)
+    ,	m_iUpdateCalled(agents, 0)
+    ,	m_eReturnStatus(agents, BH_RUNNING)
+    ,	m_eTerminateStatus(agents, BH_INVALID)
+    {
+    }
+
+    virtual ~MockLeaf()
+    {
+    }
+
+    virtual void onInitialize(size_t agent)
+    {
+        ++m_iInitializeCalled[agent];
+    }
+
+    virtual void onTerminate(size_t agent, Status s)
+    {
+        ++m_iTerminateCalled[agent];
+        m_eTerminateStatus[agent] = s;
+    }
+
+    virtual Status update(size_t agent)
+    {
+        ++m_iUpdateCalled[agent];
+        return m_eReturnStatus[agent];
+    }
+};
+
+TEST(StarterKit5, LeafPerAgent)
+{
+    MockLeaf leaf(2);
+    TreeDefinition def;
+    def.addLeaf(leaf);
+
+    BatchedTree bt(def, 2);
+    bt.tick();
+    CHECK_EQUAL(1, leaf.m_iInitializeCalled[0]);
+    CHECK_EQUAL(1, leaf.m_iInitializeCalled[1]);
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+
+    leaf.m_eReturnStatus[1] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(1));
+    CHECK_EQUAL(0, leaf.m_iTerminateCalled[0]);
+    CHECK_EQUAL(1, leaf.m_iTerminateCalled[1]);
+    CHECK_EQUAL(2, leaf.m_iUpdateCalled[0]);
+}
+
+TEST(StarterKit5, SequenceAgentsDiverge)
+{
+    MockLeaf a(2), b(2);
+    TreeDefinition def;
+    size_t children[] = { def.addLeaf(a), def.addLeaf(b) };
+    def.addSequence(children, 2);
+
+    BatchedTree bt(def, 2);
+    a.m_eReturnStatus[0] = BH_SUCCESS;
+    a.m_eReturnStatus[1] = BH_FAILURE;
+    bt.tick();
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+    CHECK_EQUAL(BH_FAILURE, bt.getStatus(1));
+    CHECK_EQUAL(1, b.m_iInitializeCalled[0]);
+    CHECK_EQUAL(0, b.m_iInitializeCalled[1]);
+
+    b.m_eReturnStatus[0] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(0));
+    CHECK_EQUAL(1, b.m_iTerminateCalled[0]);
+}
+
+TEST(StarterKit5, SelectorAgentsDiverge)
+{
+    MockLeaf a(2), b(2);
+    TreeDefinition def;
+    size_t children[] = { def.addLeaf(a), def.addLeaf(b) };
+    def.addSelector(children, 2);
+
+    BatchedTree bt(def, 2);
+    a.m_eReturnStatus[0] = BH_SUCCESS;
+    a.m_eReturnStatus[1] = BH_FAILURE;
+    bt.tick();
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(0));
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(1));
+
+    b.m_eReturnStatus[1] = BH_FAILURE;
+    bt.tick();
+    CHECK_EQUAL(BH_FAILURE, bt.getStatus(1));
+    CHECK_EQUAL(1, b.m_iInitializeCalled[1]);
+}
+
+TEST(StarterKit5, RepeatCountsPerAgent)
+{
+    MockLeaf leaf(2);
+    TreeDefinition def;
+    def.addRepeat(def.addLeaf(leaf), 3);
+
+    BatchedTree bt(def, 2);
+    leaf.m_eReturnStatus[0] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(0));
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(1));
+    CHECK_EQUAL(3, leaf.m_iTerminateCalled[0]);
+
+    leaf.m_eReturnStatus[1] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(1));
+    CHECK_EQUAL(3, leaf.m_iTerminateCalled[1]);
+    CHECK_EQUAL(4, leaf.m_iUpdateCalled[1]);
+}
+
+TEST(StarterKit5, ResetAgentsStartOver)
+{
+    MockLeaf a(3), b(3);
+    TreeDefinition def;
+    size_t children[] = { def.addLeaf(a), def.addLeaf(b) };
+    def.addSequence(children, 2);
+
+    BatchedTree bt(def, 3);
+    a.m_eReturnStatus[0] = a.m_eReturnStatus[1] = a.m_eReturnStatus[2] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(1, a.m_iInitializeCalled[1]);
+
+    bt.resetAgents(1, 2);
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(1));
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(2, children[1]));
+
+    // The reset agents run the first child again, the other carries on.
+    bt.tick();
+    CHECK_EQUAL(1, a.m_iInitializeCalled[0]);
+    CHECK_EQUAL(2, a.m_iInitializeCalled[1]);
+    CHECK_EQUAL(2, a.m_iInitializeCalled[2]);
+    CHECK_EQUAL(2, b.m_iUpdateCalled[0]);
+}
+
+TEST(StarterKit5, RemoveAgentsCloseGap)
+{
+    MockLeaf a(4), b(4);
+    TreeDefinition def;
+    size_t children[] = { def.addLeaf(a), def.addLeaf(b) };
+    def.addSequence(children, 2);
+
+    BatchedTree bt(def, 4);
+    a.m_eReturnStatus[3] = BH_SUCCESS;
+    bt.tick();
+
+    bt.removeAgents(1, 2);
+    CHECK_EQUAL(2u, bt.getAgentCount());
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(1));
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(1, children[0]));
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(1, children[1]));
+
+    // New agents go after the ones left.
+    CHECK_EQUAL(2u, bt.addAgents(1));
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(2));
+}
+
+TEST(StarterKit5, ReloadKeepsRunningPath)
+{
+    MockLeaf a(2), b(2), c(2);
+    TreeDefinition before;
+    size_t children[] = { before.addLeaf(a), before.addLeaf(b) };
+    before.setKey(children[0], 1);
+    before.setKey(children[1], 2);
+    before.setKey(before.addSequence(children, 2), 3);
+
+    BatchedTree bt(before, 2);
+    a.m_eReturnStatus[0] = a.m_eReturnStatus[1] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(1, b.m_iInitializeCalled[0]);
+
+    // A new first child doesn't make running agents go back to it.
+    TreeDefinition after;
+    size_t more[] = { after.addLeaf(c), after.addLeaf(a), after.addLeaf(b) };
+    after.setKey(more[1], 1);
+    after.setKey(more[2], 2);
+    after.setKey(after.addSequence(more, 3), 3);
+
+    bt.reload(after);
+    CHECK_EQUAL(2u, bt.getStaleCount());
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0, more[2]));
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(0, more[0]));
+
+    b.m_eReturnStatus[0] = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(0u, bt.getStaleCount());
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(0));
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(1));
+    CHECK_EQUAL(1, b.m_iInitializeCalled[0]);
+    CHECK_EQUAL(1, b.m_iInitializeCalled[1]);
+    CHECK_EQUAL(0, b.m_iTerminateCalled[1]);
+    CHECK_EQUAL(0, c.m_iUpdateCalled[0]);
+    CHECK_EQUAL(0, c.m_iUpdateCalled[1]);
+}
+
+TEST(StarterKit5, ReloadRestartsWithoutRunningChild)
+{
+    MockLeaf a(1), b(1), c(1);
+    TreeDefinition before;
+    size_t children[] = { before.addLeaf(a), before.addRepeat(before.addLeaf(b), 2) };
+    before.setKey(children[0], 1);
+    before.setKey(children[1], 2);
+    before.setKey(before.addSequence(children, 2), 3);
+
+    BatchedTree bt(before, 1);
+    a.m_eReturnStatus[0] = BH_SUCCESS;
+    bt.tick();
+
+    TreeDefinition after;
+    size_t others[] = { after.addLeaf(a), after.addLeaf(c) };
+    after.setKey(others[0], 1);
+    after.setKey(after.addSequence(others, 2), 3);
+
+    bt.reload(after);
+    CHECK_EQUAL(0, b.m_iTerminateCalled[0]);
+    bt.tick();
+    CHECK_EQUAL(1, b.m_iTerminateCalled[0]);
+    CHECK_EQUAL(BH_ABORTED, b.m_eTerminateStatus[0]);
+    CHECK_EQUAL(2, a.m_iInitializeCalled[0]);
+    CHECK_EQUAL(1, c.m_iInitializeCalled[0]);
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+}
+
+TEST(StarterKit5, ReloadAbortsLeafOfRestartedComposite)
+{
+    MockLeaf a(1), b(1), c(1);
+    TreeDefinition before;
+    size_t children[] = { before.addLeaf(a), before.addLeaf(b) };
+    before.setKey(children[0], 1);
+    before.setKey(children[1], 2);
+    size_t root = before.addSequence(children, 2);
+    before.setKey(root, 3);
+
+    BatchedTree bt(before, 1);
+    a.m_eReturnStatus[0] = BH_SUCCESS;
+    bt.tick();
+
+    // The leaf is still there, but under a different sequence, so it
+    // starts over along with the rest of the tree.
+    TreeDefinition after;
+    size_t inner[] = { after.addLeaf(b) };
+    after.setKey(inner[0], 2);
+    size_t others[] = { after.addLeaf(c), after.addSequence(inner, 1) };
+    after.setKey(after.addSelector(others, 2), 4);
+
+    bt.reload(after);
+    bt.finishReload();
+    CHECK_EQUAL(1, b.m_iTerminateCalled[0]);
+    CHECK_EQUAL(BH_ABORTED, b.m_eTerminateStatus[0]);
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(0, inner[0]));
+}
+
+TEST(StarterKit5, ReloadMatchesDuplicateKeysByType)
+{
+    MockLeaf a(1), b(1);
+    TreeDefinition before;
+    size_t children[] = { before.addLeaf(a), before.addLeaf(b) };
+    before.setKey(children[0], 1);
+    before.setKey(children[1], 1);
+    before.setKey(before.addSequence(children, 2), 2);
+
+    BatchedTree bt(before, 1);
+    a.m_eReturnStatus[0] = BH_SUCCESS;
+    bt.tick();
+
+    // Both leaves share a key; only the same Leaf object matches.
+    TreeDefinition after;
+    size_t more[] = { after.addLeaf(b), after.addLeaf(a) };
+    after.setKey(more[0], 1);
+    after.setKey(more[1], 1);
+    after.setKey(after.addSequence(more, 2), 2);
+
+    bt.reload(after);
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0, more[0]));
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(0, more[1]));
+    bt.tick();
+    CHECK_EQUAL(0, b.m_iTerminateCalled[0]);
+    CHECK_EQUAL(1, b.m_iInitializeCalled[0]);
+}
+
+TEST(StarterKit5, ReloadMovesAgentsOnTick)
+{
+    MockLeaf leaf(3);
+    TreeDefinition before;
+    before.setKey(before.addRepeat(before.addLeaf(leaf), 3), 1);
+
+    BatchedTree bt(before, 3);
+    leaf.m_eReturnStatus[0] = leaf.m_eReturnStatus[1] = leaf.m_eReturnStatus[2] = BH_SUCCESS;
+    bt.tick(1);
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(1));
+
+    // Same leaf without a key: only the repeat count carries over.
+    TreeDefinition after;
+    after.setKey(after.addRepeat(after.addLeaf(leaf), 3), 1);
+    leaf.m_eReturnStatus[0] = BH_RUNNING;
+    bt.reload(after);
+    bt.tick(0);
+    CHECK_EQUAL(2u, bt.getStaleCount());
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(1));
+
+    bt.addAgents(1);
+    CHECK_EQUAL(0u, bt.getStaleCount());
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(3));
+}
+
+TEST(StarterKit5, SnapshotRollsBackAgents)
+{
+    const size_t k_AgentCount = 4;
+    MockLeaf leaf(k_AgentCount), inner(k_AgentCount);
+    TreeDefinition def;
+    size_t children[] = { def.addLeaf(leaf), def.addRepeat(def.addLeaf(inner), 3) };
+    def.addSequence(children, 2);
+
+    // Odd agents get as far as the repeat.
+    BatchedTree bt(def, k_AgentCount);
+    for (size_t i=0; i<k_AgentCount; ++i)
+    {
+        leaf.m_eReturnStatus[i] = i % 2 ? BH_SUCCESS : BH_RUNNING;
+    }
+    bt.tick();
+
+    std::vector<uint8_t> snapshot(bt.getSnapshotSize(k_AgentCount));
+    bt.save(0, k_AgentCount, &snapshot[0]);
+    CHECK_EQUAL(k_AgentCount * (4 + sizeof(uint16_t) + sizeof(int)), snapshot.size());
+
+    for (size_t i=0; i<k_AgentCount; ++i)
+    {
+        leaf.m_eReturnStatus[i] = BH_SUCCESS;
+        inner.m_eReturnStatus[i] = BH_SUCCESS;
+    }
+    bt.tick();
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(0));
+    CHECK_EQUAL(BH_SUCCESS, bt.getStatus(1));
+
+    bt.restore(0, k_AgentCount, &snapshot[0]);
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(0));
+    CHECK_EQUAL(BH_RUNNING, bt.getStatus(1));
+    CHECK_EQUAL(BH_INVALID, bt.getStatus(0, children[1]));
+
+    // Move agent 1 into a fresh tree, where it carries on with the repeat.
+    BatchedTree other(def, 2);
+    std::vector<uint8_t> agent(bt.getSnapshotSize(1));
+    bt.save(1, 1, &agent[0]);
+    other.restore(0, 1, &agent[0]);
+    CHECK_EQUAL(BH_RUNNING, other.getStatus(0));
+    CHECK_EQUAL(BH_INVALID, other.getStatus(1));
+
+    int updates = leaf.m_iUpdateCalled[0];
+    other.tick(0);
+    CHECK_EQUAL(BH_SUCCESS, other.getStatus(0));
+    CHECK_EQUAL(updates, leaf.m_iUpdateCalled[0]);
+}
+
+TEST(StarterKit5, MemoryScalesWithState)
+{
+    MockLeaf leaf(0);
+    TreeDefinition def;
+    size_t children[] = { def.addLeaf(leaf), def.addLeaf(leaf), def.addLeaf(leaf) };
+    def.addSequence(children, 3);
+
+    BatchedTree bt(def);
+    bt.addAgents(1000);
+    CHECK_EQUAL(1000u, bt.getAgentCount());
+    CHECK_EQUAL(4 * sizeof(uint8_t) + 1 * sizeof(uint16_t), bt.getBytesPerAgent());
+}
+
+TEST(StarterKit5, BatchConditionGuardsAction)
+{
+    const size_t k_AgentCount = 7;
+    float health[k_AgentCount] = { 10, 80, 20, 90, 30, 100, 40 };
+    ThresholdCondition isHurt(health, 50.0f);
+    MockLeaf heal(k_AgentCount);
+
+    TreeDefinition def;
+    size_t children[] = { def.addBatchCondition(isHurt), def.addLeaf(heal) };
+    def.addSequence(children, 2);
+
+    BatchedTree bt(def, k_AgentCount);
+    bt.tick();
+    for (size_t i=0; i<k_AgentCount; ++i)
+    {
+        CHECK_EQUAL(health[i] < 50.0f ? 1 : 0, heal.m_iUpdateCalled[i]);
+        CHECK_EQUAL(health[i] < 50.0f ? BH_RUNNING : BH_FAILURE, bt.getStatus(i));
+    }
+
+    // Ticking a single agent evaluates the condition for it alone.
+    health[1] = 0.0f;
+    CHECK_EQUAL(BH_RUNNING, bt.tick(1));
+    CHECK_EQUAL(1, heal.m_iUpdateCalled[1]);
+    CHECK_EQUAL(3 + sizeof(uint16_t) + sizeof(uint8_t), bt.getBytesPerAgent());
+}
+
+TEST(StarterKit5, DistanceConditionPerAgent)
+{
+    float x[5] = { 0, 3, 10, -1, 5 };
+    float y[5] = { 0, 4, 10, 1, 0 };
+    DistanceCondition near(x, y, 5.0f);
+    near.setTarget(0.0f, 0.0f);
+
+    uint8_t results[5];
+    near.evaluate(0, 5, results);
+    CHECK_EQUAL(BH_SUCCESS, results[0]);
+    CHECK_EQUAL(BH_SUCCESS, results[1]);
+    CHECK_EQUAL(BH_FAILURE, results[2]);
+    CHECK_EQUAL(BH_SUCCESS, results[3]);
+    CHECK_EQUAL(BH_SUCCESS, results[4]);
+
+    ThresholdCondition high(x, 2.0f, ThresholdCondition::GREATER);
+    high.evaluate(1, 4, results);
+    CHECK_EQUAL(BH_SUCCESS, results[0]);
+    CHECK_EQUAL(BH_FAILURE, results[2]);
+    CHECK_EQUAL(BH_SUCCESS, results[3]);
+}
+
+} // namespace bt5
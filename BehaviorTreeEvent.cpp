@@ -6,11 +6,25 @@
  * Credits:         Alex J. Champandard
  *****************************************************************************/
 
-#include <functional>
+#include <stdint.h>
 #include <vector>
-#include <deque>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#endif
 #include "Shared.h"
 #include "Test.h"
+#include "Benchmark.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "LodScheduler.h"
 
 namespace bt4
 {
@@ -26,13 +40,57 @@ enum Status
     BH_SUSPENDED,
 };
 
-typedef std::function<void (Status)> BehaviorObserver;
+class BehaviorObserver
+/**
+ * Non-owning delegate made of an object pointer and a stub that calls one
+ * of its member functions.  It's trivially copyable and never allocates.
+ */
+{
+public:
+    BehaviorObserver()
+    :	m_pObject(NULL)
+    ,	m_pStub(NULL)
+    {
+    }
+
+    template <class T, void (T::*METHOD)(Status)>
+    static BehaviorObserver bind(T* object)
+    {
+        BehaviorObserver observer;
+        observer.m_pObject = object;
+        observer.m_pStub = &invoke<T, METHOD>;
+        return observer;
+    }
+
+    void operator()(Status s) const
+    {
+        ASSERT(m_pStub != NULL);
+        m_pStub(m_pObject, s);
+    }
+
+    explicit operator bool() const
+    {
+        return m_pStub != NULL;
+    }
+
+private:
+    template <class T, void (T::*METHOD)(Status)>
+    static void invoke(void* object, Status s)
+    {
+        (static_cast<T*>(object)->*METHOD)(s);
+    }
+
+    void* m_pObject;
+    void (*m_pStub)(void*, Status);
+};
 
 class Behavior
 {
 public:
     Behavior()
     :	m_eStatus(BH_INVALID)
+    ,	m_iWakeTick(0)
+    ,	m_bQueued(false)
     {
     }
 
@@ -44,13 +102,23 @@ public:
     {
         if (m_eStatus == BH_INVALID)
         {
+            PROFILE_INITIALIZE(this);
+            TRACE_INITIALIZE(this);
             onInitialize();
         }
 
+        PROFILE_UPDATE_BEGIN(this);
+        TRACE_UPDATE_BEGIN(this);
+        METRICS_ADD(COUNTER_NODE_UPDATES, 1);
         m_eStatus = update();
+        PROFILE_UPDATE_END(this);
+        TRACE_UPDATE_END(this, m_eStatus);
 
-        if (m_eStatus != BH_RUNNING)
+        // A suspended task is still in progress, it's just not ticked.
+        if (m_eStatus != BH_RUNNING  &&  m_eStatus != BH_SUSPENDED)
         {
+            PROFILE_TERMINATE(this);
+            TRACE_TERMINATE(this, m_eStatus);
             onTerminate(m_eStatus);
         }
         return m_eStatus;
@@ -63,11 +131,191 @@ public:
 
     Status m_eStatus;
     BehaviorObserver m_Observer;
+    size_t m_iWakeTick;         // Tick of a pending sleep() wake-up, or zero.
+    bool m_bQueued;
+};
+
+const size_t k_TimerWheelSize = 32;
+
+// ----------------------------------------------------------------------------
+
+enum CommandType
+{
+    CMD_START,
+    CMD_STOP,
+    CMD_RESUME,
+};
+
+struct Command
+{
+    Behavior* m_pBehavior;
+    BehaviorObserver m_Observer;    // Used by CMD_START if set.
+    uint32_t m_iSource;
+    uint32_t m_iSequence;
+    CommandType m_eType;
+    Status m_eResult;               // Used by CMD_STOP.
+};
+
+struct CommandSource
+/**
+ * Identifies one thread posting commands, and numbers the commands it
+ * posts.  Give each thread its own source with a unique id.
+ */
+{
+    explicit CommandSource(uint32_t id)
+    :	m_iId(id)
+    ,	m_iSequence(0)
+    {
+    }
+
+    uint32_t m_iId;
+    uint32_t m_iSequence;
+};
+
+class CommandQueue
+/**
+ * Bounded lock-free queue for many producers and one consumer.  Each cell
+ * carries a sequence number saying whether it's free for the producer of a
+ * given position or filled for the consumer, so push() claims a position
+ * with a single compare-exchange and never waits for other producers.
+ */
+{
+public:
+    // 'capacity' must be a power of two, or zero for no queue at all.
+    explicit CommandQueue(size_t capacity)
+    :	m_Cells(capacity)
+    ,	m_iMask(capacity - 1)
+    ,	m_iHead(0)
+    ,	m_iTail(0)
+    {
+        ASSERT((capacity & (capacity - 1)) == 0);
+        for (size_t i=0; i<capacity; ++i)
+        {
+            m_Cells[i].m_iSequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Safe from any thread; false if the queue is full.
+    bool push(const Command& command)
+    {
+        if (m_Cells.empty())
+        {
+            return false;
+        }
+        size_t position = m_iTail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = m_Cells[position & m_iMask];
+            size_t sequence = cell.m_iSequence.load(std::memory_order_acquire);
+            ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+            if (difference == 0)
+            {
+                if (m_iTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.m_Command = command;
+                    cell.m_iSequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_iTail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only; false once no completed command is left.
+    bool pop(Command& command)
+    {
+        if (m_Cells.empty())
+        {
+            return false;
+        }
+        Cell& cell = m_Cells[m_iHead & m_iMask];
+        if (cell.m_iSequence.load(std::memory_order_acquire) != m_iHead + 1)
+        {
+            return false;
+        }
+        command = cell.m_Command;
+        cell.m_iSequence.store(m_iHead + m_Cells.size(), std::memory_order_release);
+        ++m_iHead;
+        return true;
+    }
+
+    size_t getCapacity() const
+    {
+        return m_Cells.size();
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> m_iSequence;
+        Command m_Command;
+    };
+
+    std::vector<Cell> m_Cells;
+    size_t m_iMask;
+
+    // Kept on separate cache lines so producers don't slow the consumer.
+    char m_Padding0[64];
+    size_t m_iHead;
+    char m_Padding1[64];
+    std::atomic<size_t> m_iTail;
+    char m_Padding2[64];
 };
 
+// ----------------------------------------------------------------------------
+
 class BehaviorTree
+/**
+ * Only tasks in the queue are ticked.  A task whose update() returns
+ * BH_SUSPENDED leaves the queue until resume() is called, or until the
+ * timer set with sleep() expires, so idle tasks cost nothing per tick.
+ *
+ * start(), stop() and the other direct calls belong to the ticking thread.
+ * Other threads post commands instead, if the tree was given a command
+ * queue, and tick() applies them before anything else.
+ */
 {
 public:
+    explicit BehaviorTree(size_t commandCapacity = 0)
+    :	m_Commands(commandCapacity)
+    ,	m_iRead(0)
+    ,	m_iWrite(0)
+    ,	m_iTick(0)
+    ,	m_iReportedTasks(0)
+    {
+        m_Drained.reserve(commandCapacity);
+    }
+
+    ~BehaviorTree()
+    {
+        METRICS_ADD(GAUGE_RUNNING_TASKS, -(int64_t)m_iReportedTasks);
+    }
+
+    // Thread-safe counterparts of start(), stop() and resume().  They return
+    // false if the command queue is full, and the command isn't posted.  The
+    // behavior must stay alive until the command has been applied.
+    bool postStart(CommandSource& source, Behavior& bh, const BehaviorObserver* observer = NULL)
+    {
+        return post(source, CMD_START, bh, observer != NULL ? *observer : BehaviorObserver(), BH_INVALID);
+    }
+
+    bool postStop(CommandSource& source, Behavior& bh, Status result)
+    {
+        ASSERT(result != BH_RUNNING  &&  result != BH_SUSPENDED);
+        return post(source, CMD_STOP, bh, BehaviorObserver(), result);
+    }
+
+    bool postResume(CommandSource& source, Behavior& bh)
+    {
+        return post(source, CMD_RESUME, bh, BehaviorObserver(), BH_INVALID);
+    }
 
     void start(Behavior& bh, BehaviorObserver* observer = NULL)
     {
@@ -75,60 +323,261 @@ public:
         {
             bh.m_Observer = *observer;
         }
-        m_Behaviors.push_front(&bh);
+        cancel(bh);
+        bh.m_eStatus = BH_INVALID;
+
+        // Ticked next, during the current tick if there is one.  A task
+        // stopped earlier this tick may not have been dropped yet.
+        if (!bh.m_bQueued)
+        {
+            bh.m_bQueued = true;
+            m_Started.push_back(&bh);
+        }
     }
 
     void stop(Behavior& bh, Status result)
     {
-        ASSERT(result != BH_RUNNING);
+        ASSERT(result != BH_RUNNING  &&  result != BH_SUSPENDED);
+        cancel(bh);
         bh.m_eStatus = result;
 
         if (bh.m_Observer)
         {
+            METRICS_ADD(COUNTER_OBSERVER_CALLS, 1);
             bh.m_Observer(result);
         }
     }
 
+    // Take a running task out of the queue until resume() is called.
+    void suspend(Behavior& bh)
+    {
+        ASSERT(bh.m_eStatus == BH_RUNNING  ||  bh.m_eStatus == BH_SUSPENDED);
+        cancel(bh);
+        bh.m_eStatus = BH_SUSPENDED;
+    }
+
+    // Suspend a task and resume it after 'ticks' ticks.  From within the
+    // task's own update(), return BH_SUSPENDED after calling this.
+    void sleep(Behavior& bh, size_t ticks)
+    {
+        ASSERT(ticks > 0);
+        cancel(bh);
+        bh.m_eStatus = BH_SUSPENDED;
+        bh.m_iWakeTick = m_iTick + ticks;
+        m_Timers[bh.m_iWakeTick % k_TimerWheelSize].push_back(&bh);
+    }
+
+    // Queue a suspended task again; it's next ticked on the following tick().
+    void resume(Behavior& bh)
+    {
+        if (bh.m_eStatus != BH_SUSPENDED)
+        {
+            return;
+        }
+        cancel(bh);
+        bh.m_eStatus = BH_RUNNING;
+        enqueue(bh);
+    }
+
     void tick()
     {
-        // Insert an end-of-update marker into the list of tasks.
-        m_Behaviors.push_back(NULL);
+        ++m_iTick;
+        applyCommands();
+
+        // Tasks whose timer expires now are ticked this time around.
+        expireTimers();
 
-        // Keep going updating tasks until we encounter the marker.
+        // Tasks queued since the last tick go behind the ones still running.
+        m_Tasks.insert(m_Tasks.end(), m_Later.begin(), m_Later.end());
+        m_Later.clear();
+
+        // Keep going updating tasks until this tick's list is empty.
         while (step())
         {
             continue;
         }
+
+        // Report the change in queue length since the last tick.
+        size_t queued = getQueuedCount();
+        METRICS_ADD(COUNTER_TREE_TICKS, 1);
+        METRICS_ADD(GAUGE_RUNNING_TASKS, (int64_t)queued - (int64_t)m_iReportedTasks);
+        m_iReportedTasks = queued;
     }
 
+    // Tick the next task due this tick; false once there are none left.
+    // Started tasks go first, the most recent one first.  The others are
+    // read in order, and the ones still running are written back over
+    // them, so the list for the next tick is built in place.
     bool step()
     {
-        Behavior* current = m_Behaviors.front();
-        m_Behaviors.pop_front();
+        if (!m_Started.empty())
+        {
+            Behavior* current = m_Started.back();
+            m_Started.pop_back();
+            if (update(*current))
+            {
+                enqueue(*current);
+            }
+            return true;
+        }
+        if (m_iRead < m_Tasks.size())
+        {
+            Behavior* current = m_Tasks[m_iRead++];
+            if (update(*current))
+            {
+                current->m_bQueued = true;
+                m_Tasks[m_iWrite++] = current;
+            }
+            return true;
+        }
+        m_Tasks.resize(m_iWrite);
+        m_iRead = m_iWrite = 0;
+        return false;
+    }
+
+    // Tasks waiting to be ticked, including any stopped since they were queued.
+    size_t getQueuedCount() const
+    {
+        return m_Started.size() + m_iWrite + (m_Tasks.size() - m_iRead) + m_Later.size();
+    }
+
+    size_t getTickCount() const
+    {
+        return m_iTick;
+    }
+
+protected:
+    // Tick a task taken off the queue; true if it should stay queued.
+    bool update(Behavior& bh)
+    {
+        bh.m_bQueued = false;
 
-        // If this is the end-of-update marker, stop processing.
-        if (current == NULL)
+        // Tasks stopped or suspended since they were queued are dropped.
+        if (bh.m_eStatus != BH_INVALID  &&  bh.m_eStatus != BH_RUNNING)
         {
             return false;
         }
 
         // Perform the update on this individual task.
-        current->tick();
+        bh.tick();
+
+        // Suspended tasks wait outside the queue to be resumed.
+        if (bh.m_eStatus == BH_SUSPENDED)
+        {
+            return false;
+        }
 
         // Process the observer if the task terminated.
-        if (current->m_eStatus != BH_RUNNING  &&  current->m_Observer)
+        if (bh.m_eStatus != BH_RUNNING)
         {
-            current->m_Observer(current->m_eStatus);
+            if (bh.m_Observer)
+            {
+                METRICS_ADD(COUNTER_OBSERVER_CALLS, 1);
+                bh.m_Observer(bh.m_eStatus);
+            }
+            return false;
         }
-        else // Otherwise drop it into the queue for the next tick().
+        return true;
+    }
+
+    bool post(CommandSource& source, CommandType type, Behavior& bh, BehaviorObserver observer, Status result)
+    {
+        Command command = { &bh, observer, source.m_iId, source.m_iSequence, type, result };
+        if (!m_Commands.push(command))
         {
-            m_Behaviors.push_back(current);
+            return false;
         }
+        ++source.m_iSequence;
         return true;
     }
 
-protected:
-    std::deque<Behavior*> m_Behaviors;
+    static bool isEarlier(const Command& a, const Command& b)
+    {
+        return a.m_iSource != b.m_iSource ? a.m_iSource < b.m_iSource : a.m_iSequence < b.m_iSequence;
+    }
+
+    // The commands that arrived since the last tick are applied in order of
+    // source and then sequence, so the outcome doesn't depend on how the
+    // posting threads happened to interleave.
+    void applyCommands()
+    {
+        Command command;
+        while (m_Commands.pop(command))
+        {
+            m_Drained.push_back(command);
+        }
+        std::sort(m_Drained.begin(), m_Drained.end(), isEarlier);
+
+        for (size_t i=0; i<m_Drained.size(); ++i)
+        {
+            Command& c = m_Drained[i];
+            switch (c.m_eType)
+            {
+            case CMD_START:
+                start(*c.m_pBehavior, c.m_Observer ? &c.m_Observer : NULL);
+                break;
+            case CMD_STOP:
+                stop(*c.m_pBehavior, c.m_eResult);
+                break;
+            case CMD_RESUME:
+                resume(*c.m_pBehavior);
+                break;
+            }
+        }
+        m_Drained.clear();
+    }
+
+    void enqueue(Behavior& bh)
+    {
+        if (!bh.m_bQueued)
+        {
+            bh.m_bQueued = true;
+            m_Later.push_back(&bh);
+        }
+    }
+
+    void cancel(Behavior& bh)
+    {
+        if (bh.m_iWakeTick == 0)
+        {
+            return;
+        }
+        std::vector<Behavior*>& slot = m_Timers[bh.m_iWakeTick % k_TimerWheelSize];
+        slot.erase(std::find(slot.begin(), slot.end(), &bh));
+        bh.m_iWakeTick = 0;
+    }
+
+    void expireTimers()
+    {
+        // Timers further away than one turn of the wheel share the slot with
+        // earlier ones and are kept for a later turn.
+        std::vector<Behavior*>& slot = m_Timers[m_iTick % k_TimerWheelSize];
+        size_t kept = 0;
+        for (size_t i=0; i<slot.size(); ++i)
+        {
+            Behavior* bh = slot[i];
+            if (bh->m_iWakeTick != m_iTick)
+            {
+                slot[kept++] = bh;
+                continue;
+            }
+            bh->m_iWakeTick = 0;
+            bh->m_eStatus = BH_RUNNING;
+            enqueue(*bh);
+        }
+        slot.resize(kept);
+    }
+
+    CommandQueue m_Commands;
+    std::vector<Command> m_Drained;
+    std::vector<Behavior*> m_Started;
+    std::vector<Behavior*> m_Tasks;
+    std::vector<Behavior*> m_Later;
+    size_t m_iRead;
+    size_t m_iWrite;
+    std::vector<Behavior*> m_Timers[k_TimerWheelSize];
+    size_t m_iTick;
+    size_t m_iReportedTasks;
 };
 
 // ----------------------------------------------------------------------------
@@ -212,145 +661,1379 @@ TEST(StarterKit4, TaskTerminate)
     CHECK_EQUAL(1, t.m_iTerminateCalled);
 };
 
+TEST(StarterKit4, TaskRestartAfterTerminate)
+{
+    MockBehavior t;
+    BehaviorTree bt;
+    t.m_eReturnStatus = BH_SUCCESS;
 
-// ============================================================================
+    // Terminated tasks leave the queue, with or without an observer.
+    bt.start(t);
+    bt.tick();
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
 
-class Composite : public Behavior
-{
-public:
-    typedef std::vector<Behavior*> Behaviors;
-    Behaviors m_Children;
+    bt.start(t);
+    bt.tick();
+    CHECK_EQUAL(2, t.m_iInitializeCalled);
+    CHECK_EQUAL(2, t.m_iUpdateCalled);
 };
 
-class Sequence : public Composite
+TEST(StarterKit4, TaskStoppedWhileQueued)
 {
-public:
-    Sequence(BehaviorTree& bt)
-    :	m_pBehaviorTree(&bt)
-    {
-    }
+    MockBehavior t;
+    BehaviorTree bt;
 
-protected:
-    BehaviorTree* m_pBehaviorTree;
+    bt.start(t);
+    bt.tick();
+    bt.stop(t, BH_FAILURE);
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+};
 
-    virtual void onInitialize()
-    {
-        m_Current = m_Children.begin();
-        BehaviorObserver observer = std::bind(&Sequence::onChildComplete, this, std::placeholders::_1);
-        m_pBehaviorTree->start(**m_Current, &observer);
-    }
 
-    void onChildComplete(Status)
-    {
-        Behavior& child = **m_Current;
-        if (child.m_eStatus == BH_FAILURE)
-        {
-            m_pBehaviorTree->stop(*this, BH_FAILURE);
-            return;
-        }
+struct MockObserver
+{
+    int m_iCalled;
+    Status m_eStatus;
 
-        ASSERT(child.m_eStatus == BH_SUCCESS);
-        if (++m_Current == m_Children.end())
-        {
-            m_pBehaviorTree->stop(*this, BH_SUCCESS);
-        }
-        else
-        {
-            BehaviorObserver observer = std::bind(&Sequence::onChildComplete, this, std::placeholders::_1);
-            m_pBehaviorTree->start(**m_Current, &observer);
-        }
+    MockObserver()
+    :	m_iCalled(0)
+    ,	m_eStatus(BH_INVALID)
+    {
     }
 
-    virtual Status update()
+    void onComplete(Status s)
     {
-        return BH_RUNNING;
+        ++m_iCalled;
+        m_eStatus = s;
     }
-
-    Behaviors::iterator m_Current;
 };
 
-// ----------------------------------------------------------------------------
-
-template <class COMPOSITE>
-class MockComposite : public COMPOSITE
+TEST(StarterKit4, ObserverCalledOnTerminate)
 {
-public:
-    MockComposite(BehaviorTree& bt, size_t size)
-    :	COMPOSITE(bt)	
-    {
-        for (size_t i=0; i<size; ++i)
-        {
-            COMPOSITE::m_Children.push_back(new MockBehavior);
-        }
-    }
+    MockBehavior t;
+    MockObserver o;
+    BehaviorTree bt;
 
-    ~MockComposite()
-    {
-        for (size_t i=0; i<COMPOSITE::m_Children.size(); ++i)
-        {
-            delete COMPOSITE::m_Children[i];
-        }
-    }
+    BehaviorObserver observer = BehaviorObserver::bind<MockObserver, &MockObserver::onComplete>(&o);
+    CHECK(observer);
+    CHECK(!BehaviorObserver());
 
-    MockBehavior& operator[](size_t index)
-    {
-        ASSERT(index < COMPOSITE::m_Children.size());
-        return *static_cast<MockBehavior*>(COMPOSITE::m_Children[index]);
-    }
-};
+    bt.start(t, &observer);
+    bt.tick();
+    CHECK_EQUAL(0, o.m_iCalled);
 
-typedef MockComposite<Sequence> MockSequence;
+    t.m_eReturnStatus = BH_FAILURE;
+    bt.tick();
+    CHECK_EQUAL(1, o.m_iCalled);
+    CHECK_EQUAL(BH_FAILURE, o.m_eStatus);
+};
 
-TEST(StarterKit4, SequenceOnePassThrough)
+#if !defined(BTSK_NO_METRICS)
+TEST(StarterKit4, MetricsCountTasksAndObservers)
 {
-    Status status[2] = { BH_SUCCESS, BH_FAILURE };
-    for (int i=0; i<2; ++i)
+    MockBehavior t, u;
+    MockObserver o;
+    BehaviorObserver observer = BehaviorObserver::bind<MockObserver, &MockObserver::onComplete>(&o);
+    metrics::Snapshot before, after;
+    metrics::collect(before);
     {
         BehaviorTree bt;
-        MockSequence seq(bt, 1);
-
-        bt.start(seq);
+        bt.start(t, &observer);
+        bt.start(u);
         bt.tick();
-        CHECK_EQUAL(seq.m_eStatus, BH_RUNNING);
-        CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+        metrics::collect(after);
+        CHECK_EQUAL(1, after.get(metrics::COUNTER_TREE_TICKS) - before.get(metrics::COUNTER_TREE_TICKS));
+        CHECK_EQUAL(2, after.get(metrics::GAUGE_RUNNING_TASKS) - before.get(metrics::GAUGE_RUNNING_TASKS));
 
-        seq[0].m_eReturnStatus = status[i];
+        t.m_eReturnStatus = BH_SUCCESS;
         bt.tick();
-        CHECK_EQUAL(seq.m_eStatus, status[i]);
-        CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+        metrics::collect(after);
+        CHECK_EQUAL(1, after.get(metrics::COUNTER_OBSERVER_CALLS) - before.get(metrics::COUNTER_OBSERVER_CALLS));
+        CHECK_EQUAL(1, after.get(metrics::GAUGE_RUNNING_TASKS) - before.get(metrics::GAUGE_RUNNING_TASKS));
     }
+    metrics::collect(after);
+    CHECK_EQUAL(before.get(metrics::GAUGE_RUNNING_TASKS), after.get(metrics::GAUGE_RUNNING_TASKS));
 }
+#endif
 
-TEST(StarterKit4, SequenceTwoFails)
+struct SleepingBehavior : public MockBehavior
 {
-    BehaviorTree bt;
-    MockSequence seq(bt, 2);
+    BehaviorTree* m_pBehaviorTree;
+    size_t m_iSleepTicks;
+
+    SleepingBehavior(BehaviorTree& bt, size_t ticks)
+    :	m_pBehaviorTree(&bt)
+    ,	m_iSleepTicks(ticks)
+    {
+    }
+
+    virtual Status update()
+    {
+        if (m_iSleepTicks == 0)
+        {
+            return MockBehavior::update();
+        }
+        ++m_iUpdateCalled;
+        m_pBehaviorTree->sleep(*this, m_iSleepTicks);
+        return BH_SUSPENDED;
+    }
+};
+
+TEST(StarterKit4, TaskSuspendUntilResumed)
+{
+    MockBehavior t;
+    BehaviorTree bt;
+
+    bt.start(t);
+    t.m_eReturnStatus = BH_SUSPENDED;
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+    CHECK_EQUAL(0u, bt.getQueuedCount());
+
+    bt.tick();
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+    CHECK_EQUAL(0, t.m_iTerminateCalled);
+
+    t.m_eReturnStatus = BH_SUCCESS;
+    bt.resume(t);
+    bt.tick();
+    CHECK_EQUAL(2, t.m_iUpdateCalled);
+    CHECK_EQUAL(1, t.m_iInitializeCalled);
+    CHECK_EQUAL(1, t.m_iTerminateCalled);
+};
+
+TEST(StarterKit4, TaskSuspendedWhileQueued)
+{
+    MockBehavior t;
+    BehaviorTree bt;
+
+    bt.start(t);
+    bt.tick();
+    bt.suspend(t);
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+
+    // Resuming before the stale entry was dropped mustn't queue it twice.
+    bt.suspend(t);
+    bt.resume(t);
+    bt.tick();
+    CHECK_EQUAL(2, t.m_iUpdateCalled);
+    CHECK_EQUAL(1u, bt.getQueuedCount());
+};
+
+TEST(StarterKit4, TaskSleepWakesOnTimer)
+{
+    const size_t ticks[2] = { 3, k_TimerWheelSize * 2 + 5 };
+    for (int i=0; i<2; ++i)
+    {
+        BehaviorTree bt;
+        SleepingBehavior t(bt, ticks[i]);
+
+        bt.start(t);
+        bt.tick();
+        t.m_iSleepTicks = 0;
+        for (size_t j=1; j<ticks[i]; ++j)
+        {
+            bt.tick();
+        }
+        CHECK_EQUAL(1, t.m_iUpdateCalled);
+
+        bt.tick();
+        CHECK_EQUAL(2, t.m_iUpdateCalled);
+        CHECK_EQUAL(BH_RUNNING, t.m_eStatus);
+    }
+};
+
+TEST(StarterKit4, TaskStopCancelsSleep)
+{
+    BehaviorTree bt;
+    SleepingBehavior t(bt, 2);
+    MockObserver o;
+    BehaviorObserver observer = BehaviorObserver::bind<MockObserver, &MockObserver::onComplete>(&o);
+
+    bt.start(t, &observer);
+    bt.tick();
+    bt.stop(t, BH_FAILURE);
+    CHECK_EQUAL(1, o.m_iCalled);
+
+    bt.tick();
+    bt.tick();
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+    CHECK_EQUAL(1, o.m_iCalled);
+};
+
+TEST(StarterKit4, TaskListSteadyState)
+{
+    MockBehavior t[3];
+    BehaviorTree bt;
+    bt.start(t[0]);
+    bt.start(t[1]);
+    bt.tick();
+
+    // Started tasks go ahead of those queued by the previous tick.
+    bt.start(t[2]);
+    t[2].m_eReturnStatus = BH_SUCCESS;
+    t[0].m_eReturnStatus = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(1, t[2].m_iTerminateCalled);
+    CHECK_EQUAL(1, t[0].m_iTerminateCalled);
+    CHECK_EQUAL(1u, bt.getQueuedCount());
+
+    for (int i=0; i<100; ++i)
+    {
+        bt.tick();
+    }
+    CHECK_EQUAL(102, t[1].m_iUpdateCalled);
+};
+
+TEST(StarterKit4, CommandsAppliedOnTick)
+{
+    MockBehavior t;
+    BehaviorTree bt(16);
+    CommandSource source(0);
+    MockObserver o;
+    BehaviorObserver observer = BehaviorObserver::bind<MockObserver, &MockObserver::onComplete>(&o);
+
+    CHECK(bt.postStart(source, t, &observer));
+    CHECK_EQUAL(0, t.m_iUpdateCalled);
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+
+    CHECK(bt.postStop(source, t, BH_FAILURE));
+    CHECK_EQUAL(0, o.m_iCalled);
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+    CHECK_EQUAL(1, o.m_iCalled);
+    CHECK_EQUAL(2u, source.m_iSequence);
+};
+
+TEST(StarterKit4, CommandsOrderedBySource)
+{
+    // The same commands give the same result whichever arrives first.
+    for (int i=0; i<2; ++i)
+    {
+        MockBehavior t;
+        BehaviorTree bt(16);
+        CommandSource gameplay(1), network(2);
+
+        if (i == 0)
+        {
+            bt.postStart(network, t);
+            bt.postStop(gameplay, t, BH_FAILURE);
+        }
+        else
+        {
+            bt.postStop(gameplay, t, BH_FAILURE);
+            bt.postStart(network, t);
+        }
+        bt.tick();
+        CHECK_EQUAL(1, t.m_iUpdateCalled);
+        CHECK_EQUAL(BH_RUNNING, t.m_eStatus);
+    }
+};
+
+TEST(StarterKit4, CommandQueueFull)
+{
+    MockBehavior t[3];
+    BehaviorTree bt(2);
+    CommandSource source(0);
+
+    CHECK(bt.postStart(source, t[0]));
+    CHECK(bt.postStart(source, t[1]));
+    CHECK(!bt.postStart(source, t[2]));
+    CHECK_EQUAL(2u, source.m_iSequence);
+
+    bt.tick();
+    CHECK(bt.postStart(source, t[2]));
+    bt.tick();
+    CHECK_EQUAL(2, t[0].m_iUpdateCalled);
+    CHECK_EQUAL(1, t[2].m_iUpdateCalled);
+
+    BehaviorTree none;
+    CHECK(!none.postStart(source, t[0]));
+};
+
+TEST(StarterKit4, CommandsFromThreads)
+{
+    const size_t k_ThreadCount = 4;
+    const size_t k_TaskCount = 256;
+    std::vector<MockBehavior> tasks(k_ThreadCount * k_TaskCount);
+    BehaviorTree bt(64);
+
+    std::atomic<size_t> done(0);
+    std::vector<std::thread> threads;
+    for (size_t i=0; i<k_ThreadCount; ++i)
+    {
+        threads.push_back(std::thread([&, i]()
+        {
+            CommandSource source((uint32_t)i);
+            for (size_t j=0; j<k_TaskCount; ++j)
+            {
+                while (!bt.postStart(source, tasks[i * k_TaskCount + j]))
+                {
+                    std::this_thread::yield();
+                }
+            }
+            ++done;
+        }));
+    }
+
+    // Keep ticking so the producers don't stall on a full queue.
+    while (done.load() < k_ThreadCount)
+    {
+        bt.tick();
+    }
+    for (size_t i=0; i<threads.size(); ++i)
+    {
+        threads[i].join();
+    }
+    bt.tick();
+
+    for (size_t i=0; i<tasks.size(); ++i)
+    {
+        CHECK(tasks[i].m_iUpdateCalled >= 1);
+        CHECK_EQUAL(1, tasks[i].m_iInitializeCalled);
+    }
+    CHECK_EQUAL(tasks.size(), bt.getQueuedCount());
+};
+
+// ----------------------------------------------------------------------------
+
+class Scheduler
+/**
+ * Ticks many BehaviorTree instances, typically one per agent, on a pool of
+ * worker threads.  A whole tree is the unit of work, so all the tasks and
+ * observers of an agent run on one thread during a tick.  Each worker keeps
+ * its home trees in a vector from one tick to the next, takes them from the
+ * front of its range and steals from the back of the others' ranges once it
+ * runs dry.  The calling thread acts as worker zero.
+ */
+{
+public:
+    Scheduler(size_t workers)
+    :	m_iFrame(0)
+    ,	m_iBusy(0)
+    ,	m_bQuit(false)
+    ,	m_iSteals(0)
+    {
+        ASSERT(workers > 0);
+        for (size_t i=0; i<workers; ++i)
+        {
+            m_Workers.push_back(new Worker);
+        }
+        for (size_t i=1; i<workers; ++i)
+        {
+            m_Threads.push_back(std::thread(&Scheduler::run, this, i));
+        }
+    }
+
+    ~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bQuit = true;
+        }
+        m_Start.notify_all();
+        for (size_t i=0; i<m_Threads.size(); ++i)
+        {
+            m_Threads[i].join();
+        }
+        for (size_t i=0; i<m_Workers.size(); ++i)
+        {
+            delete m_Workers[i];
+        }
+    }
+
+    // The tree goes to the worker with the fewest, and stays there.
+    void add(BehaviorTree& bt)
+    {
+        Worker* home = m_Workers[0];
+        for (size_t i=1; i<m_Workers.size(); ++i)
+        {
+            if (m_Workers[i]->m_Trees.size() < home->m_Trees.size())
+            {
+                home = m_Workers[i];
+            }
+        }
+        ASSERT(home->m_Trees.size() < 0xffffffffu);
+        home->m_Trees.push_back(&bt);
+    }
+
+    void remove(BehaviorTree& bt)
+    {
+        for (size_t i=0; i<m_Workers.size(); ++i)
+        {
+            std::vector<BehaviorTree*>& trees = m_Workers[i]->m_Trees;
+            std::vector<BehaviorTree*>::iterator it = std::find(trees.begin(), trees.end(), &bt);
+            if (it != trees.end())
+            {
+                trees.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Tick every tree once, returning when all of them are done.
+    void tick()
+    {
+        for (size_t i=0; i<m_Workers.size(); ++i)
+        {
+            m_Workers[i]->m_iRange = makeRange(0, m_Workers[i]->m_Trees.size());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_iBusy = m_Threads.size();
+            ++m_iFrame;
+        }
+        m_Start.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (m_iBusy != 0)
+        {
+            m_Done.wait(lock);
+        }
+    }
+
+    size_t getWorkerCount() const
+    {
+        return m_Workers.size();
+    }
+
+    size_t getStealCount() const
+    {
+        return m_iSteals.load();
+    }
+
+protected:
+    struct Worker
+    {
+        Worker()
+        :	m_iRange(0)
+        {
+        }
+
+        // Only changed between ticks.
+        std::vector<BehaviorTree*> m_Trees;
+
+        // The trees in [next, end) are still to be ticked, with next in the
+        // low half and end in the high half, so the owner and the thieves
+        // each claim a tree with one compare-and-swap.
+        std::atomic<uint64_t> m_iRange;
+
+        // Workers are allocated one by one, so this keeps each range on a
+        // cache line of its own.
+        char m_Padding0[64];
+    };
+
+    static uint64_t makeRange(uint64_t next, uint64_t end)
+    {
+        return next | (end << 32);
+    }
+
+    void run(size_t index)
+    {
+        size_t frame = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                while (!m_bQuit  &&  m_iFrame == frame)
+                {
+                    m_Start.wait(lock);
+                }
+                if (m_bQuit)
+                {
+                    return;
+                }
+                frame = m_iFrame;
+            }
+
+            work(index);
+
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (--m_iBusy == 0)
+            {
+                m_Done.notify_one();
+            }
+        }
+    }
+
+    void work(size_t index)
+    {
+        // Ranges only shrink during a tick, so once every one is empty this
+        // worker's share of the tick is over.
+        BehaviorTree* bt;
+        while ((bt = pop(index)) != NULL  ||  (bt = steal(index)) != NULL)
+        {
+            bt->tick();
+        }
+    }
+
+    BehaviorTree* pop(size_t index)
+    {
+        Worker& w = *m_Workers[index];
+        uint64_t range = w.m_iRange.load();
+        for (;;)
+        {
+            uint64_t next = range & 0xffffffffu, end = range >> 32;
+            if (next >= end)
+            {
+                return NULL;
+            }
+            if (w.m_iRange.compare_exchange_weak(range, makeRange(next + 1, end)))
+            {
+                return w.m_Trees[next];
+            }
+        }
+    }
+
+    BehaviorTree* steal(size_t index)
+    {
+        for (size_t i=1; i<m_Workers.size(); ++i)
+        {
+            Worker& w = *m_Workers[(index + i) % m_Workers.size()];
+            uint64_t range = w.m_iRange.load();
+            for (;;)
+            {
+                uint64_t next = range & 0xffffffffu, end = range >> 32;
+                if (next >= end)
+                {
+                    break;
+                }
+                if (w.m_iRange.compare_exchange_weak(range, makeRange(next, end - 1)))
+                {
+                    ++m_iSteals;
+                    return w.m_Trees[end - 1];
+                }
+            }
+        }
+        return NULL;
+    }
+
+    std::vector<Worker*> m_Workers;
+    std::vector<std::thread> m_Threads;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Start;
+    std::condition_variable m_Done;
+    size_t m_iFrame;
+    size_t m_iBusy;
+    bool m_bQuit;
+    std::atomic<size_t> m_iSteals;
+};
+
+TEST(StarterKit4, SchedulerTicksEveryTree)
+{
+    const size_t k_AgentCount = 64;
+    std::vector<MockBehavior> tasks(k_AgentCount);
+    std::vector<BehaviorTree> trees(k_AgentCount);
+
+    Scheduler scheduler(4);
+    for (size_t i=0; i<k_AgentCount; ++i)
+    {
+        trees[i].start(tasks[i]);
+        scheduler.add(trees[i]);
+    }
+
+    scheduler.tick();
+    for (size_t i=0; i<k_AgentCount; ++i)
+    {
+        CHECK_EQUAL(1, tasks[i].m_iInitializeCalled);
+        CHECK_EQUAL(1, tasks[i].m_iUpdateCalled);
+    }
+
+    for (size_t i=0; i<k_AgentCount; i+=2)
+    {
+        tasks[i].m_eReturnStatus = BH_SUCCESS;
+    }
+    scheduler.tick();
+    for (size_t i=0; i<k_AgentCount; ++i)
+    {
+        CHECK_EQUAL(i % 2 == 0 ? 1 : 0, tasks[i].m_iTerminateCalled);
+        CHECK_EQUAL(2, tasks[i].m_iUpdateCalled);
+    }
+};
+
+TEST(StarterKit4, SchedulerSingleWorker)
+{
+    MockBehavior t;
+    BehaviorTree bt;
+    bt.start(t);
+
+    Scheduler scheduler(1);
+    scheduler.add(bt);
+    scheduler.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+
+    scheduler.remove(bt);
+    scheduler.tick();
+    CHECK_EQUAL(1, t.m_iUpdateCalled);
+    CHECK_EQUAL(0u, scheduler.getStealCount());
+};
+
+
+// ============================================================================
+
+class Composite : public Behavior
+{
+public:
+    typedef std::vector<Behavior*> Behaviors;
+    Behaviors m_Children;
+};
+
+class Sequence : public Composite
+{
+public:
+    Sequence(BehaviorTree& bt)
+    :	m_pBehaviorTree(&bt)
+    {
+    }
+
+protected:
+    BehaviorTree* m_pBehaviorTree;
+
+    virtual void onInitialize()
+    {
+        m_Current = m_Children.begin();
+        BehaviorObserver observer = BehaviorObserver::bind<Sequence, &Sequence::onChildComplete>(this);
+        m_pBehaviorTree->start(**m_Current, &observer);
+    }
+
+    void onChildComplete(Status)
+    {
+        Behavior& child = **m_Current;
+        if (child.m_eStatus == BH_FAILURE)
+        {
+            m_pBehaviorTree->stop(*this, BH_FAILURE);
+            return;
+        }
+
+        ASSERT(child.m_eStatus == BH_SUCCESS);
+        if (++m_Current == m_Children.end())
+        {
+            m_pBehaviorTree->stop(*this, BH_SUCCESS);
+        }
+        else
+        {
+            BehaviorObserver observer = BehaviorObserver::bind<Sequence, &Sequence::onChildComplete>(this);
+            m_pBehaviorTree->start(**m_Current, &observer);
+        }
+    }
+
+    // Children report back through their observers, so there's no need to
+    // tick the sequence itself in the meantime.
+    virtual Status update()
+    {
+        return BH_SUSPENDED;
+    }
+
+    Behaviors::iterator m_Current;
+};
+
+// ----------------------------------------------------------------------------
+
+template <class COMPOSITE>
+class MockComposite : public COMPOSITE
+{
+public:
+    MockComposite(BehaviorTree& bt, size_t size)
+    :	COMPOSITE(bt)	
+    {
+        for (size_t i=0; i<size; ++i)
+        {
+            COMPOSITE::m_Children.push_back(new MockBehavior);
+        }
+    }
+
+    ~MockComposite()
+    {
+        for (size_t i=0; i<COMPOSITE::m_Children.size(); ++i)
+        {
+            delete COMPOSITE::m_Children[i];
+        }
+    }
+
+    MockBehavior& operator[](size_t index)
+    {
+        ASSERT(index < COMPOSITE::m_Children.size());
+        return *static_cast<MockBehavior*>(COMPOSITE::m_Children[index]);
+    }
+};
+
+typedef MockComposite<Sequence> MockSequence;
+
+TEST(StarterKit4, SequenceOnePassThrough)
+{
+    Status status[2] = { BH_SUCCESS, BH_FAILURE };
+    for (int i=0; i<2; ++i)
+    {
+        BehaviorTree bt;
+        MockSequence seq(bt, 1);
+
+        bt.start(seq);
+        bt.tick();
+        CHECK_EQUAL(seq.m_eStatus, BH_SUSPENDED);
+        CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+        seq[0].m_eReturnStatus = status[i];
+        bt.tick();
+        CHECK_EQUAL(seq.m_eStatus, status[i]);
+        CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    }
+}
+
+TEST(StarterKit4, SequenceTwoFails)
+{
+    BehaviorTree bt;
+    MockSequence seq(bt, 2);
+
+    bt.start(seq);
+    bt.tick();
+    CHECK_EQUAL(seq.m_eStatus, BH_SUSPENDED);
+    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+    seq[0].m_eReturnStatus = BH_FAILURE;
+    bt.tick();
+    CHECK_EQUAL(seq.m_eStatus, BH_FAILURE);
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+}
+
+TEST(StarterKit4, SequenceTwoContinues)
+{
+    BehaviorTree bt;
+    MockSequence seq(bt, 2);
 
     bt.start(seq);
     bt.tick();
-    CHECK_EQUAL(seq.m_eStatus, BH_RUNNING);
-    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(seq.m_eStatus, BH_SUSPENDED);
+    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+
+    seq[0].m_eReturnStatus = BH_SUCCESS;
+    bt.tick();
+    CHECK_EQUAL(seq.m_eStatus, BH_SUSPENDED);
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+
+    // Only the running child is queued, the sequence waits on its observer.
+    CHECK_EQUAL(1u, bt.getQueuedCount());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(StarterKit4, LodPeriodsStaggered)
+{
+    const size_t k_TreeCount = 4;
+    BehaviorTree trees[k_TreeCount];
+    MockBehavior tasks[k_TreeCount];
+    lod::LodScheduler lod;
+    for (size_t i=0; i<k_TreeCount; ++i)
+    {
+        trees[i].start(tasks[i]);
+        lod.add(trees[i], 2);
+    }
+
+    for (int frame=0; frame<4; ++frame)
+    {
+        lod.tick();
+        CHECK_EQUAL(2u, lod.getLastFrame().m_iTicked);
+    }
+    for (size_t i=0; i<k_TreeCount; ++i)
+    {
+        CHECK_EQUAL(2, tasks[i].m_iUpdateCalled);
+        CHECK_EQUAL(0u, lod.getStats(i).m_iMaxLateness);
+    }
+
+    // A nearer agent ticks more often from the next frame on.
+    lod.setPeriod(0, 1);
+    lod.tick();
+    lod.tick();
+    CHECK_EQUAL(4, tasks[0].m_iUpdateCalled);
+    CHECK_EQUAL(3, tasks[1].m_iUpdateCalled);
+};
+
+static uint64_t s_iLodTime = 0;
+
+struct CostlyBehavior : public MockBehavior
+{
+    virtual Status update()
+    {
+        s_iLodTime += 100;
+        return MockBehavior::update();
+    }
+};
+
+TEST(StarterKit4, LodBudgetCarriesOver)
+{
+    const size_t k_TreeCount = 5;
+    BehaviorTree trees[k_TreeCount];
+    CostlyBehavior tasks[k_TreeCount];
+    lod::LodScheduler lod;
+    lod.setClock([]() { return s_iLodTime; });
+    lod.setBudget(250);
+    for (size_t i=0; i<k_TreeCount; ++i)
+    {
+        trees[i].start(tasks[i]);
+        lod.add(trees[i]);
+    }
+
+    lod.tick();
+    CHECK_EQUAL(3u, lod.getLastFrame().m_iTicked);
+    CHECK_EQUAL(2u, lod.getLastFrame().m_iDeferred);
+    CHECK_EQUAL(300u, lod.getLastFrame().m_iElapsed);
+    CHECK_EQUAL(0, tasks[3].m_iUpdateCalled);
+
+    // The deferred trees go first, one frame late.
+    lod.tick();
+    CHECK_EQUAL(1, tasks[3].m_iUpdateCalled);
+    CHECK_EQUAL(1, tasks[4].m_iUpdateCalled);
+    CHECK_EQUAL(2, tasks[0].m_iUpdateCalled);
+    CHECK_EQUAL(1, tasks[1].m_iUpdateCalled);
+    CHECK_EQUAL(1u, lod.getStats(3).m_iDeferCount);
+    CHECK_EQUAL(1u, lod.getStats(3).m_iMaxLateness);
+    CHECK_EQUAL(1u, lod.getStats(1).m_iDeferCount);
+
+    // Without a budget everything due is ticked.
+    lod.setBudget(0);
+    lod.tick();
+    CHECK_EQUAL(5u, lod.getLastFrame().m_iTicked);
+    CHECK_EQUAL(1u, lod.getStats(1).m_iMaxLateness);
+};
+
+// ============================================================================
+// Long-running actions written as C++20 coroutines, for compilers that
+// support them.  Each co_await hands control back to the tree with the
+// status given, and the coroutine continues from there on a later tick.
+
+#if defined(__cpp_impl_coroutine)
+
+class FrameArena
+/**
+ * Memory for coroutine frames, carved out of large chunks that are only
+ * released with the arena.  Each CoroutineBehavior takes one block and
+ * reuses it every time it restarts, so frames never touch the heap once
+ * the behaviors have run.
+ */
+{
+public:
+    static const size_t k_FrameAlignment = 16;
+
+    FrameArena(size_t chunkSize = 4096)
+    :	m_pBase(NULL)
+    ,	m_iChunkSize(chunkSize)
+    ,	m_iOffset(chunkSize)
+    ,	m_iAllocated(0)
+    {
+    }
+
+    ~FrameArena()
+    {
+        for (size_t i=0; i<m_Chunks.size(); ++i)
+        {
+            delete [] m_Chunks[i];
+        }
+    }
+
+    void* allocate(size_t size)
+    {
+        size = (size + k_FrameAlignment - 1) & ~(k_FrameAlignment - 1);
+        m_iAllocated += size;
+
+        // Frames larger than a chunk get one of their own.
+        if (size > m_iChunkSize)
+        {
+            m_Chunks.push_back(new char[size + k_FrameAlignment]);
+            return alignFrame(m_Chunks.back());
+        }
+        if (m_iOffset + size > m_iChunkSize)
+        {
+            m_Chunks.push_back(new char[m_iChunkSize + k_FrameAlignment]);
+            m_pBase = alignFrame(m_Chunks.back());
+            m_iOffset = 0;
+        }
+        void* frame = m_pBase + m_iOffset;
+        m_iOffset += size;
+        return frame;
+    }
+
+    size_t getAllocatedBytes() const
+    {
+        return m_iAllocated;
+    }
+
+private:
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+
+    static char* alignFrame(char* p)
+    {
+        return (char*)(((uintptr_t)p + k_FrameAlignment - 1) & ~(uintptr_t)(k_FrameAlignment - 1));
+    }
+
+    std::vector<char*> m_Chunks;
+    char* m_pBase;
+    size_t m_iChunkSize;
+    size_t m_iOffset;
+    size_t m_iAllocated;
+};
+
+class CoroutineBehavior;
+
+class Action
+/**
+ * Return type of CoroutineBehavior::run(), owning the coroutine's frame.
+ */
+{
+public:
+    struct promise_type
+    {
+        Status m_eStatus;           // Yielded last, then the co_return value.
+
+        promise_type()
+        :	m_eStatus(BH_RUNNING)
+        {
+        }
+
+        // Frames come from the behavior running the coroutine, which is
+        // passed here as the implicit object argument of run().
+        static void* operator new(size_t size, CoroutineBehavior& behavior);
+        static void operator delete(void*, size_t)
+        {
+        }
+
+        Action get_return_object()
+        {
+            return Action(Handle::from_promise(*this));
+        }
+
+        // The body starts on the first update(), not in onInitialize().
+        std::suspend_always initial_suspend() { return std::suspend_always(); }
+        std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+
+        void return_value(Status status)
+        {
+            ASSERT(status == BH_SUCCESS  ||  status == BH_FAILURE);
+            m_eStatus = status;
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Action()
+    {
+    }
+
+    Action(Action&& other)
+    :	m_Handle(other.m_Handle)
+    {
+        other.m_Handle = Handle();
+    }
+
+    Action& operator=(Action&& other)
+    {
+        std::swap(m_Handle, other.m_Handle);
+        return *this;
+    }
+
+    ~Action()
+    {
+        if (m_Handle)
+        {
+            m_Handle.destroy();
+        }
+    }
+
+    // Run until the next co_await or the end, and return the status.
+    Status resume()
+    {
+        ASSERT(m_Handle  &&  !m_Handle.done());
+        m_Handle.resume();
+        return m_Handle.promise().m_eStatus;
+    }
+
+    explicit operator bool() const
+    {
+        return (bool)m_Handle;
+    }
+
+private:
+    explicit Action(Handle handle)
+    :	m_Handle(handle)
+    {
+    }
+
+    Handle m_Handle;
+};
+
+class CoroutineBehavior : public Behavior
+/**
+ * Leaf whose update() is the coroutine run(), so its progress is kept in
+ * local variables rather than hand-written state.  Stopping or restarting
+ * the behavior destroys the coroutine along with its locals.
+ */
+{
+public:
+    // Hands control back to the tree with 'status' until the next resume.
+    struct Yield
+    {
+        Status m_eStatus;
+
+        bool await_ready() const { return false; }
+        void await_suspend(Action::Handle handle) { handle.promise().m_eStatus = m_eStatus; }
+        void await_resume() const {}
+    };
+
+    CoroutineBehavior(BehaviorTree& bt, FrameArena& arena)
+    :	m_pBehaviorTree(&bt)
+    ,	m_pArena(&arena)
+    ,	m_pFrame(NULL)
+    ,	m_iFrameSize(0)
+    {
+    }
+
+    virtual Action run() = 0;
+
+    void* allocateFrame(size_t size)
+    {
+        ASSERT(!m_Action);
+        if (size > m_iFrameSize)
+        {
+            m_pFrame = m_pArena->allocate(size);
+            m_iFrameSize = size;
+        }
+        return m_pFrame;
+    }
+
+protected:
+    // Continue on the next tick.
+    Yield nextTick()
+    {
+        Yield y = { BH_RUNNING };
+        return y;
+    }
+
+    // Leave the queue for 'ticks' ticks, at no cost in between.
+    Yield sleep(size_t ticks)
+    {
+        m_pBehaviorTree->sleep(*this, ticks);
+        Yield y = { BH_SUSPENDED };
+        return y;
+    }
+
+    // Leave the queue until something calls BehaviorTree::resume().
+    Yield suspend()
+    {
+        Yield y = { BH_SUSPENDED };
+        return y;
+    }
+
+    virtual void onInitialize()
+    {
+        m_Action = Action();
+        m_Action = run();
+    }
+
+    virtual Status update()
+    {
+        return m_Action.resume();
+    }
+
+    virtual void onTerminate(Status)
+    {
+        m_Action = Action();
+    }
+
+    BehaviorTree* m_pBehaviorTree;
+
+private:
+    FrameArena* m_pArena;
+    Action m_Action;
+    void* m_pFrame;
+    size_t m_iFrameSize;
+};
+
+inline void* Action::promise_type::operator new(size_t size, CoroutineBehavior& behavior)
+{
+    return behavior.allocateFrame(size);
+}
+
+// ----------------------------------------------------------------------------
+
+struct MockCoroutine : public CoroutineBehavior
+{
+    int m_iSteps;
+    int m_iStepsDone;
+    size_t m_iSleepTicks;
+
+    MockCoroutine(BehaviorTree& bt, FrameArena& arena, int steps, size_t sleepTicks = 0)
+    :	CoroutineBehavior(bt, arena)
+    ,	m_iSteps(steps)
+    ,	m_iStepsDone(0)
+    ,	m_iSleepTicks(sleepTicks)
+    {
+    }
+
+    virtual Action run()
+    {
+        m_iStepsDone = 0;
+        for (int i=0; i<m_iSteps; ++i)
+        {
+            ++m_iStepsDone;
+            co_await nextTick();
+        }
+        if (m_iSleepTicks > 0)
+        {
+            co_await sleep(m_iSleepTicks);
+            ++m_iStepsDone;
+        }
+        co_return BH_SUCCESS;
+    }
+};
+
+TEST(StarterKit4, CoroutineRunsAcrossTicks)
+{
+    BehaviorTree bt;
+    FrameArena arena;
+    MockCoroutine t(bt, arena, 3);
+    MockObserver o;
+    BehaviorObserver observer = BehaviorObserver::bind<MockObserver, &MockObserver::onComplete>(&o);
+
+    bt.start(t, &observer);
+    for (int i=1; i<=3; ++i)
+    {
+        bt.tick();
+        CHECK_EQUAL(i, t.m_iStepsDone);
+        CHECK_EQUAL(BH_RUNNING, t.m_eStatus);
+    }
+    bt.tick();
+    CHECK_EQUAL(BH_SUCCESS, t.m_eStatus);
+    CHECK_EQUAL(1, o.m_iCalled);
+    CHECK_EQUAL(BH_SUCCESS, o.m_eStatus);
+};
 
-    seq[0].m_eReturnStatus = BH_FAILURE;
+TEST(StarterKit4, CoroutineSleepLeavesQueue)
+{
+    BehaviorTree bt;
+    FrameArena arena;
+    MockCoroutine t(bt, arena, 0, 4);
+
+    bt.start(t);
     bt.tick();
-    CHECK_EQUAL(seq.m_eStatus, BH_FAILURE);
-    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
-}
+    CHECK_EQUAL(BH_SUSPENDED, t.m_eStatus);
+    for (int i=0; i<3; ++i)
+    {
+        bt.tick();
+        CHECK_EQUAL(0u, bt.getQueuedCount());
+    }
+    bt.tick();
+    CHECK_EQUAL(1, t.m_iStepsDone);
+    CHECK_EQUAL(BH_SUCCESS, t.m_eStatus);
+};
 
-TEST(StarterKit4, SequenceTwoContinues)
+TEST(StarterKit4, CoroutineFrameReused)
 {
     BehaviorTree bt;
-    MockSequence seq(bt, 2);
+    FrameArena arena;
+    MockCoroutine t(bt, arena, 2);
 
-    bt.start(seq);
+    bt.start(t);
     bt.tick();
-    CHECK_EQUAL(seq.m_eStatus, BH_RUNNING);
-    CHECK_EQUAL(0, seq[0].m_iTerminateCalled);
+    size_t allocated = arena.getAllocatedBytes();
+    CHECK(allocated > 0);
 
-    seq[0].m_eReturnStatus = BH_SUCCESS;
+    // Restarting mid-way discards the old coroutine and reuses its memory.
+    bt.stop(t, BH_FAILURE);
+    bt.start(t);
+    for (int i=0; i<3; ++i)
+    {
+        bt.tick();
+    }
+    CHECK_EQUAL(BH_SUCCESS, t.m_eStatus);
+    CHECK_EQUAL(2, t.m_iStepsDone);
+
+    bt.start(t);
     bt.tick();
-    CHECK_EQUAL(seq.m_eStatus, BH_RUNNING);
-    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(allocated, arena.getAllocatedBytes());
+};
+
+#endif // __cpp_impl_coroutine
+
+// ============================================================================
+
+struct BenchmarkBehavior : public Behavior
+{
+    size_t m_iDuration;
+    size_t m_iRemaining;
+
+    BenchmarkBehavior(size_t duration)
+    :	m_iDuration(duration)
+    ,	m_iRemaining(0)
+    {
+    }
+
+    virtual void onInitialize()
+    {
+        m_iRemaining = m_iDuration;
+    }
+
+    virtual Status update()
+    {
+        return --m_iRemaining > 0 ? BH_RUNNING : BH_SUCCESS;
+    }
+};
+
+Behavior* createBenchmarkTree(BehaviorTree& bt, const bench::Config& config, size_t depth, size_t& leaves, Composite::Behaviors& nodes)
+{
+    Behavior* node;
+    if (depth == 0)
+    {
+        node = new BenchmarkBehavior(config.isRunningLeaf(leaves++) ? config.m_iRunningTicks : 1);
+    }
+    else
+    {
+        Sequence* seq = new Sequence(bt);
+        for (size_t i=0; i<config.m_iBranching; ++i)
+        {
+            seq->m_Children.push_back(createBenchmarkTree(bt, config, depth - 1, leaves, nodes));
+        }
+        node = seq;
+    }
+    nodes.push_back(node);
+    return node;
+}
+
+BENCHMARK(StarterKit4, SyntheticTree)
+{
+    const bench::Config& config = benchmark.getConfig();
+    Composite::Behaviors nodes;
+    nodes.reserve(config.getNodeCount());
+    size_t leaves = 0;
+
+    benchmark.beginSetup();
+    BehaviorTree bt;
+    Behavior* root = createBenchmarkTree(bt, config, config.m_iDepth, leaves, nodes);
+    bt.start(*root);
+    benchmark.endSetup(sizeof(bt));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        if (root->m_eStatus == BH_SUCCESS  ||  root->m_eStatus == BH_FAILURE)
+        {
+            bt.start(*root);
+        }
+        bt.tick();
+    }
+    benchmark.endTicks();
+
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        delete nodes[i];
+    }
+}
+
+const size_t k_QueuedTaskCount = 100000;
+
+// Many independent tasks in one tree, all running, so every tick goes
+// through the whole queue.  Uses a thousandth of the usual tick count.
+BENCHMARK(StarterKit4, QueuedTasks)
+{
+    benchmark.setTickCount(std::max<size_t>(benchmark.getTickCount() / 1000, 1));
+    std::vector<BenchmarkBehavior> tasks(k_QueuedTaskCount, BenchmarkBehavior(std::numeric_limits<size_t>::max()));
+
+    benchmark.beginSetup();
+    BehaviorTree bt;
+    for (size_t i=0; i<tasks.size(); ++i)
+    {
+        bt.start(tasks[i]);
+    }
+    bt.tick();
+    benchmark.endSetup(sizeof(bt));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        bt.tick();
+    }
+    benchmark.endTicks();
+}
+
+const size_t k_ScheduledAgentCount = 1024;
+
+// Many agents with a small tree each, ticked by a Scheduler with the given
+// number of workers, so the benchmarks below show how it scales from one
+// to several cores.  Uses a thousandth of the usual tick count.
+void runSchedulerBenchmark(bench::Benchmark& benchmark, size_t workers)
+{
+    benchmark.setTickCount(std::max<size_t>(benchmark.getTickCount() / 1000, 1));
+    bench::Config config = benchmark.getConfig();
+    config.m_iDepth = std::min<size_t>(config.m_iDepth, 2);
+    std::vector<Composite::Behaviors> nodes(k_ScheduledAgentCount);
+    std::vector<Behavior*> roots(k_ScheduledAgentCount);
+
+    benchmark.beginSetup();
+    std::vector<BehaviorTree> trees(k_ScheduledAgentCount);
+    Scheduler scheduler(workers);
+    for (size_t i=0; i<k_ScheduledAgentCount; ++i)
+    {
+        size_t leaves = 0;
+        roots[i] = createBenchmarkTree(trees[i], config, config.m_iDepth, leaves, nodes[i]);
+        trees[i].start(*roots[i]);
+        scheduler.add(trees[i]);
+    }
+    benchmark.endSetup(sizeof(scheduler));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        for (size_t j=0; j<k_ScheduledAgentCount; ++j)
+        {
+            if (roots[j]->m_eStatus == BH_SUCCESS  ||  roots[j]->m_eStatus == BH_FAILURE)
+            {
+                trees[j].start(*roots[j]);
+            }
+        }
+        scheduler.tick();
+    }
+    benchmark.endTicks();
+
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        for (size_t j=0; j<nodes[i].size(); ++j)
+        {
+            delete nodes[i][j];
+        }
+    }
+}
+
+BENCHMARK(StarterKit4, Scheduler1Worker)
+{
+    runSchedulerBenchmark(benchmark, 1);
+}
+
+BENCHMARK(StarterKit4, Scheduler2Workers)
+{
+    runSchedulerBenchmark(benchmark, 2);
+}
+
+BENCHMARK(StarterKit4, Scheduler4Workers)
+{
+    runSchedulerBenchmark(benchmark, 4);
+}
+
+BENCHMARK(StarterKit4, Scheduler8Workers)
+{
+    runSchedulerBenchmark(benchmark, 8);
 }
 
 } // namespace bt4
@@ -0,0 +1,430 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#ifndef BEHAVIORTREEIMAGE_H
+#define BEHAVIORTREEIMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include "Shared.h"
+
+namespace image
+{
+
+// ============================================================================
+// Binary tree definitions, laid out so that a file can be memory-mapped and
+// read in place.  All values are little-endian and 32-bit aligned:
+//
+//      Header
+//      TypeName[m_iTypeCount]
+//      Node records, root first, in depth-first order
+//
+// Each Node record is followed by its children's offsets, counted in bytes
+// from the record itself.  Children always come after their parent, which
+// is the same rule bt3 applies to composites in its arena, so a tree can
+// be instantiated in one forward pass over the file.
+
+const uint32_t k_ImageMagic = 0x4b535442;   // "BTSK"
+const uint16_t k_ImageVersion = 1;
+const size_t k_MaxTypeNameLength = 32;      // Terminator included.
+const size_t k_MaxImageDepth = 64;
+
+struct Header
+{
+    uint32_t m_iMagic;
+    uint16_t m_iVersion;
+    uint16_t m_iTypeCount;
+    uint32_t m_iNodeCount;
+    uint32_t m_iSize;           // Of the whole image, header included.
+};
+
+struct TypeName
+{
+    char m_Name[k_MaxTypeNameLength];
+};
+
+struct Node
+{
+    uint16_t m_iType;           // Index into the type names.
+    uint16_t m_iChildCount;
+    uint32_t m_iParameter;      // Free for the node's factory to interpret.
+};
+
+// ----------------------------------------------------------------------------
+
+class Image
+/**
+ * Read-only view of an image in memory, typically a mapped file.  Nothing
+ * is copied; check isValid() before using anything else.
+ */
+{
+public:
+    Image(const void* data, size_t size)
+    :	m_pData(static_cast<const uint8_t*>(data))
+    ,	m_iSize(size)
+    ,	m_bValid(false)
+    {
+        m_bValid = validate();
+    }
+
+    bool isValid() const
+    {
+        return m_bValid;
+    }
+
+    size_t getTypeCount() const
+    {
+        return getHeader().m_iTypeCount;
+    }
+
+    const char* getTypeName(size_t index) const
+    {
+        ASSERT(index < getTypeCount());
+        return reinterpret_cast<const TypeName*>(m_pData + sizeof(Header))[index].m_Name;
+    }
+
+    size_t getNodeCount() const
+    {
+        return getHeader().m_iNodeCount;
+    }
+
+    const Node& getRoot() const
+    {
+        return getNode(getNodeOffset());
+    }
+
+    const Node& getChild(const Node& node, size_t index) const
+    {
+        ASSERT(index < node.m_iChildCount);
+        return *reinterpret_cast<const Node*>((const uint8_t*)&node + getChildOffsets(node)[index]);
+    }
+
+    // The record after this one in the file, i.e. in depth-first order.
+    const Node& getNext(const Node& node) const
+    {
+        return *reinterpret_cast<const Node*>((const uint8_t*)&node + getRecordSize(node));
+    }
+
+    static size_t getRecordSize(const Node& node)
+    {
+        return sizeof(Node) + node.m_iChildCount * sizeof(uint32_t);
+    }
+
+private:
+    const Header& getHeader() const
+    {
+        return *reinterpret_cast<const Header*>(m_pData);
+    }
+
+    size_t getNodeOffset() const
+    {
+        return sizeof(Header) + getHeader().m_iTypeCount * sizeof(TypeName);
+    }
+
+    const Node& getNode(size_t offset) const
+    {
+        return *reinterpret_cast<const Node*>(m_pData + offset);
+    }
+
+    static const uint32_t* getChildOffsets(const Node& node)
+    {
+        return reinterpret_cast<const uint32_t*>(&node + 1);
+    }
+
+    // Check the records really form one tree in depth-first order, so users
+    // can walk them without any bounds checks of their own.
+    bool validate() const
+    {
+        if (m_iSize < sizeof(Header)  ||  ((uintptr_t)m_pData & (sizeof(uint32_t) - 1)) != 0)
+        {
+            return false;
+        }
+        const Header& header = getHeader();
+        if (header.m_iMagic != k_ImageMagic  ||  header.m_iVersion != k_ImageVersion
+        ||  header.m_iSize > m_iSize  ||  header.m_iNodeCount == 0)
+        {
+            return false;
+        }
+
+        size_t offset = getNodeOffset();
+        if (offset > header.m_iSize)
+        {
+            return false;
+        }
+        for (size_t i=0; i<header.m_iTypeCount; ++i)
+        {
+            if (memchr(getTypeName(i), 0, k_MaxTypeNameLength) == NULL)
+            {
+                return false;
+            }
+        }
+
+        // Parents waiting for more children, with the next one's position.
+        struct Pending { size_t m_iOffset; size_t m_iNext; };
+        Pending stack[k_MaxImageDepth];
+        size_t depth = 0;
+
+        for (size_t i=0; i<header.m_iNodeCount; ++i)
+        {
+            if (offset + sizeof(Node) > header.m_iSize)
+            {
+                return false;
+            }
+            const Node& node = getNode(offset);
+            if (node.m_iType >= header.m_iTypeCount  ||  offset + getRecordSize(node) > header.m_iSize)
+            {
+                return false;
+            }
+
+            if (depth > 0)
+            {
+                Pending& parent = stack[depth - 1];
+                const Node& p = getNode(parent.m_iOffset);
+                if (parent.m_iOffset + getChildOffsets(p)[parent.m_iNext++] != offset)
+                {
+                    return false;
+                }
+            }
+            else if (i > 0)
+            {
+                return false;
+            }
+
+            if (node.m_iChildCount > 0)
+            {
+                if (depth == k_MaxImageDepth)
+                {
+                    return false;
+                }
+                Pending pending = { offset, 0 };
+                stack[depth++] = pending;
+            }
+            offset += getRecordSize(node);
+
+            // Completed subtrees may close several levels at once.
+            while (depth > 0  &&  stack[depth - 1].m_iNext == getNode(stack[depth - 1].m_iOffset).m_iChildCount)
+            {
+                --depth;
+            }
+        }
+        return depth == 0;
+    }
+
+    const uint8_t* m_pData;
+    size_t m_iSize;
+    bool m_bValid;
+};
+
+// ----------------------------------------------------------------------------
+
+class ImageBuilder
+/**
+ * Collects a tree node by node, then writes it out in the binary format.
+ * Used by the converter and by tools or tests that build images directly.
+ */
+{
+public:
+    static const size_t k_NoParent = (size_t)-1;
+
+    // The first node added without a parent is the root; children keep the
+    // order they were added in.
+    size_t add(const std::string& type, uint32_t parameter = 0, size_t parent = k_NoParent)
+    {
+        ASSERT(type.size() < k_MaxTypeNameLength);
+        ASSERT((parent == k_NoParent) == m_Nodes.empty());
+
+        Entry entry;
+        entry.m_iType = findType(type);
+        entry.m_iParameter = parameter;
+        m_Nodes.push_back(entry);
+
+        size_t index = m_Nodes.size() - 1;
+        if (parent != k_NoParent)
+        {
+            ASSERT(parent < index);
+            m_Nodes[parent].m_Children.push_back(index);
+        }
+        return index;
+    }
+
+    size_t getNodeCount() const
+    {
+        return m_Nodes.size();
+    }
+
+    void write(std::vector<uint8_t>& data) const
+    {
+        ASSERT(!m_Nodes.empty());
+
+        // Order the records depth-first to know where each one goes.
+        std::vector<size_t> order, offsets(m_Nodes.size());
+        order.reserve(m_Nodes.size());
+        size_t offset = sizeof(Header) + m_Types.size() * sizeof(TypeName);
+        visit(0, order, offsets, offset);
+
+        data.assign(offset, 0);
+        Header header = { k_ImageMagic, k_ImageVersion, (uint16_t)m_Types.size(), (uint32_t)m_Nodes.size(), (uint32_t)offset };
+        memcpy(&data[0], &header, sizeof(header));
+
+        for (size_t i=0; i<m_Types.size(); ++i)
+        {
+            memcpy(&data[sizeof(Header) + i * sizeof(TypeName)], m_Types[i].c_str(), m_Types[i].size());
+        }
+
+        for (size_t i=0; i<order.size(); ++i)
+        {
+            const Entry& entry = m_Nodes[order[i]];
+            size_t base = offsets[order[i]];
+
+            Node node = { entry.m_iType, (uint16_t)entry.m_Children.size(), entry.m_iParameter };
+            memcpy(&data[base], &node, sizeof(node));
+            for (size_t c=0; c<entry.m_Children.size(); ++c)
+            {
+                uint32_t relative = (uint32_t)(offsets[entry.m_Children[c]] - base);
+                memcpy(&data[base + sizeof(Node) + c * sizeof(uint32_t)], &relative, sizeof(relative));
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint16_t m_iType;
+        uint32_t m_iParameter;
+        std::vector<size_t> m_Children;
+    };
+
+    uint16_t findType(const std::string& type)
+    {
+        for (size_t i=0; i<m_Types.size(); ++i)
+        {
+            if (m_Types[i] == type)
+            {
+                return (uint16_t)i;
+            }
+        }
+        m_Types.push_back(type);
+        return (uint16_t)(m_Types.size() - 1);
+    }
+
+    void visit(size_t index, std::vector<size_t>& order, std::vector<size_t>& offsets, size_t& offset) const
+    {
+        const Entry& entry = m_Nodes[index];
+        ASSERT(entry.m_Children.size() <= 0xffff);
+        order.push_back(index);
+        offsets[index] = offset;
+        offset += sizeof(Node) + entry.m_Children.size() * sizeof(uint32_t);
+        for (size_t c=0; c<entry.m_Children.size(); ++c)
+        {
+            visit(entry.m_Children[c], order, offsets, offset);
+        }
+    }
+
+    std::vector<std::string> m_Types;
+    std::vector<Entry> m_Nodes;
+};
+
+// ----------------------------------------------------------------------------
+// Text form of a tree: one node per line, children indented deeper than
+// their parent, and an optional unsigned parameter after the type name.
+//
+//      Selector
+//          Sequence
+//              IsHealthy
+//              Attack 3
+//          Flee
+//
+// Blank lines are skipped and '#' starts a comment.  Tabs count as four
+// spaces.  On failure 'error' says what went wrong on which line.
+
+inline bool parse(const std::string& text, ImageBuilder& builder, std::string& error)
+{
+    struct Level { size_t m_iIndent; size_t m_iNode; };
+    std::vector<Level> levels;
+
+    std::istringstream lines(text);
+    std::string line;
+    for (size_t number=1; std::getline(lines, line); ++number)
+    {
+        line = line.substr(0, line.find('#'));
+
+        size_t indent = 0, i = 0;
+        for (; i<line.size()  &&  (line[i] == ' '  ||  line[i] == '\t'); ++i)
+        {
+            indent += line[i] == '\t' ? 4 : 1;
+        }
+
+        std::istringstream tokens(line.substr(i));
+        std::string type, value, extra;
+        if (!(tokens >> type))
+        {
+            continue;
+        }
+
+        std::ostringstream where;
+        where << "line " << number << ": ";
+
+        uint32_t parameter = 0;
+        if (tokens >> value)
+        {
+            char* end = NULL;
+            unsigned long v = strtoul(value.c_str(), &end, 10);
+            if (value[0] < '0'  ||  value[0] > '9'  ||  *end != 0  ||  v > 0xffffffffUL)
+            {
+                error = where.str() + "parameter must be an unsigned integer";
+                return false;
+            }
+            parameter = (uint32_t)v;
+        }
+        if (tokens >> extra)
+        {
+            error = where.str() + "unexpected '" + extra + "'";
+            return false;
+        }
+        if (type.size() >= k_MaxTypeNameLength)
+        {
+            error = where.str() + "type name '" + type + "' is too long";
+            return false;
+        }
+
+        while (!levels.empty()  &&  levels.back().m_iIndent >= indent)
+        {
+            levels.pop_back();
+        }
+        if (levels.empty()  &&  builder.getNodeCount() > 0)
+        {
+            error = where.str() + "a tree has only one root";
+            return false;
+        }
+        if (levels.size() == k_MaxImageDepth)
+        {
+            error = where.str() + "tree is too deep";
+            return false;
+        }
+
+        size_t parent = levels.empty() ? ImageBuilder::k_NoParent : levels.back().m_iNode;
+        Level level = { indent, builder.add(type, parameter, parent) };
+        levels.push_back(level);
+    }
+
+    if (builder.getNodeCount() == 0)
+    {
+        error = "no nodes";
+        return false;
+    }
+    return true;
+}
+
+} // namespace image
+
+#endif // BEHAVIORTREEIMAGE_H
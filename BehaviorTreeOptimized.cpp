@@ -7,10 +7,19 @@
  *****************************************************************************/
 
 #include <stdint.h>
+#include <string.h>
 #include <vector>
 #include <limits>
+#include <new>
+#include <type_traits>
 #include "Shared.h"
+#include "Blackboard.h"
+#include "BehaviorTreeImage.h"
 #include "Test.h"
+#include "Benchmark.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "Metrics.h"
 
 namespace bt3
 {
@@ -23,6 +32,7 @@ enum Status
     BH_SUCCESS,
     BH_FAILURE,
     BH_RUNNING,
+    BH_ABORTED,
 };
 
 class Behavior
@@ -39,23 +49,52 @@ public:
 
     Status tick()
     {
-        if (m_eStatus == BH_INVALID)
+        if (m_eStatus != BH_RUNNING)
+        {
+            PROFILE_INITIALIZE(this);
+            TRACE_INITIALIZE(this);
             onInitialize();
+        }
 
+        PROFILE_UPDATE_BEGIN(this);
+        TRACE_UPDATE_BEGIN(this);
+        METRICS_ADD(COUNTER_NODE_UPDATES, 1);
         m_eStatus = update();
+        PROFILE_UPDATE_END(this);
+        TRACE_UPDATE_END(this, m_eStatus);
 
         if (m_eStatus != BH_RUNNING)
+        {
+            PROFILE_TERMINATE(this);
+            TRACE_TERMINATE(this, m_eStatus);
             onTerminate(m_eStatus);
+        }
+        return m_eStatus;
+    }
 
+    Status getStatus() const
+    {
         return m_eStatus;
     }
 
 protected:
+    friend class ActivePath;
+
 	virtual Status update() = 0;
 
     virtual void onInitialize() {}
     virtual void onTerminate(Status) {}
 
+    // Where a running sequence or selector carries on from once its current
+    // child terminates, so the ActivePath can skip over it.  Anything else
+    // keeps this default and is ticked as a whole.
+    struct ResumePoint;
+
+    virtual bool getResumePoint(ResumePoint&)
+    {
+        return false;
+    }
+
     Status m_eStatus;
 };
 
@@ -63,34 +102,234 @@ typedef std::vector<Behavior*> Behaviors;
 
 // ----------------------------------------------------------------------------
 
-const size_t k_MaxBehaviorTreeMemory = 8192;
+const size_t k_BehaviorTreeChunkSize = 8192;
+const size_t k_MaxChildrenPerComposite = 7;
+
+class Composite;
+
+enum OffsetMode
+/**
+ * Width of the offsets from a composite to its children.  Wide offsets
+ * are only useful with chunks larger than 64KB.
+ */
+{
+    OFFSET_16,
+    OFFSET_32,
+};
 
 class BehaviorTree
+/**
+ * Chunked arena for the nodes of a tree.  Nodes are never moved once
+ * allocated, so the relative offsets stored by composites stay valid.  A
+ * child out of reach of its composite's offsets, typically one that went
+ * into a later chunk, is linked by pointer instead.
+ */
 {
 public:
-    BehaviorTree()
-	:	m_pBuffer(new uint8_t[k_MaxBehaviorTreeMemory])
+    BehaviorTree(size_t chunkSize = k_BehaviorTreeChunkSize)
+    :	m_pBuffer(NULL)
     ,	m_iOffset(0)
+    ,	m_iCapacity(0)
+    ,	m_iChunk(0)
+    ,	m_iChunkSize(chunkSize)
+    ,	m_iBytesUsed(0)
+    ,	m_iHighWaterMark(0)
+    ,	m_bFixed(false)
     {
     }
 
     ~BehaviorTree()
     {
-        delete [] m_pBuffer;
+        METRICS_ADD(GAUGE_ARENA_BYTES, -(int64_t)m_iBytesUsed);
+        for (size_t i=0; i<m_Chunks.size(); ++i)
+        {
+            delete [] m_Chunks[i];
+        }
     }
 
+    // Composites get room for k_MaxChildrenPerComposite children.
     template <typename T>
     T& allocate()
     {
-		T* node = new ((void*)((uintptr_t)m_pBuffer + m_iOffset)) T;
-        m_iOffset += sizeof(T);
-		ASSERT(m_iOffset < k_MaxBehaviorTreeMemory);
+        return allocateNode<T>(std::is_base_of<Composite, T>());
+    }
+
+    // The composite's child offsets are stored right behind it in the same
+    // allocation, so a large fan-out costs no extra indirection.
+    template <typename T>
+    T& allocateComposite(size_t capacity, OffsetMode mode = OFFSET_16)
+    {
+        ASSERT(capacity <= std::numeric_limits<uint16_t>::max());
+        size_t offsetSize = mode == OFFSET_32 ? sizeof(uint32_t) : sizeof(uint16_t);
+        size_t table = (sizeof(T) + offsetSize - 1) & ~(offsetSize - 1);
+        size_t alignment = ALIGNOF(T) > offsetSize ? ALIGNOF(T) : offsetSize;
+
+		T* node = new (allocateBytes(table + capacity * offsetSize, alignment)) T;
+        node->initializeChildren(*this, table, capacity, mode);
         return *node;
     }
 
+    // The entries follow the blackboard in the same allocation, so they sit
+    // next to the nodes that read them.
+    blackboard::Blackboard& allocateBlackboard(const blackboard::Layout& layout)
+    {
+        size_t alignment = layout.getAlignment();
+        size_t block = (sizeof(blackboard::Blackboard) + alignment - 1) & ~(alignment - 1);
+        if (ALIGNOF(blackboard::Blackboard) > alignment)
+        {
+            alignment = ALIGNOF(blackboard::Blackboard);
+        }
+
+        char* memory = static_cast<char*>(allocateBytes(block + layout.getBlockSize(), alignment));
+        return *new (memory) blackboard::Blackboard(layout, memory + block);
+    }
+
+    // Start a new chunk unless the next 'size' bytes fit in the current one,
+    // e.g. to keep a whole subtree within reach of its parent's offsets.
+    void reserve(size_t size)
+    {
+        if (m_pBuffer == NULL  ||  m_iOffset + size > m_iCapacity)
+        {
+            addChunk(size);
+        }
+    }
+
+    // Drop every node and start over in the first chunk, keeping all the
+    // chunks for the nodes allocated next.  As when the tree is destroyed,
+    // the nodes' destructors aren't called.
+    void clear()
+    {
+        METRICS_ADD(GAUGE_ARENA_BYTES, -(int64_t)m_iBytesUsed);
+        m_iChunk = 0;
+        if (!m_Chunks.empty())
+        {
+            m_pBuffer = m_Chunks[0];
+            m_iCapacity = m_ChunkSizes[0];
+        }
+        m_iOffset = 0;
+        m_iBytesUsed = 0;
+    }
+
+    size_t getBytesUsed() const
+    {
+        return m_iBytesUsed;
+    }
+
+    size_t getBytesReserved() const
+    {
+        size_t total = 0;
+        for (size_t i=0; i<m_Chunks.size(); ++i)
+        {
+            total += m_ChunkSizes[i];
+        }
+        return total;
+    }
+
+    size_t getHighWaterMark() const
+    {
+        return m_iHighWaterMark;
+    }
+
+    size_t getChunkCount() const
+    {
+        return m_Chunks.size();
+    }
+
 protected:
+    friend class Composite;
+    friend class TreeBatch;
+    friend class TaggedTree;
+
+    // Single chunk of memory owned by the caller, which the tree can't grow
+    // past, e.g. one agent's slot in a TreeBatch.
+    BehaviorTree(void* buffer, size_t size)
+    :	m_pBuffer(static_cast<uint8_t*>(buffer))
+    ,	m_iOffset(0)
+    ,	m_iCapacity(size)
+    ,	m_iChunk(0)
+    ,	m_iChunkSize(size)
+    ,	m_iBytesUsed(0)
+    ,	m_iHighWaterMark(0)
+    ,	m_bFixed(true)
+    {
+    }
+
+    template <typename T>
+    T& allocateNode(std::false_type)
+    {
+		T* node = new (allocateBytes(sizeof(T), ALIGNOF(T))) T;
+        return *node;
+    }
+
+    template <typename T>
+    T& allocateNode(std::true_type)
+    {
+        return allocateComposite<T>(k_MaxChildrenPerComposite);
+    }
+
+    void* allocateBytes(size_t size, size_t alignment)
+    {
+        ASSERT((alignment & (alignment - 1)) == 0);
+        size_t start = alignOffset(m_iOffset, alignment);
+        if (m_pBuffer == NULL  ||  start + size > m_iCapacity)
+        {
+            addChunk(size + alignment - 1);
+            start = alignOffset(0, alignment);
+        }
+        ASSERT(start + size <= m_iCapacity);
+
+        METRICS_ADD(GAUGE_ARENA_BYTES, (int64_t)(start + size - m_iOffset));
+        m_iBytesUsed += start + size - m_iOffset;
+        m_iOffset = start + size;
+        if (m_iBytesUsed > m_iHighWaterMark)
+        {
+            m_iHighWaterMark = m_iBytesUsed;
+        }
+        return (void*)((uintptr_t)m_pBuffer + start);
+    }
+
+    size_t alignOffset(size_t offset, size_t alignment) const
+    {
+        uintptr_t p = (uintptr_t)m_pBuffer + offset;
+        uintptr_t aligned = (p + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        return offset + (size_t)(aligned - p);
+    }
+
+    void addChunk(size_t minimumSize)
+    {
+        ASSERT(!m_bFixed);
+
+        // After clear(), the chunks already there are used again in order.
+        size_t next = m_pBuffer == NULL ? 0 : m_iChunk + 1;
+        if (next < m_Chunks.size()  &&  m_ChunkSizes[next] >= minimumSize)
+        {
+            m_iChunk = next;
+            m_pBuffer = m_Chunks[next];
+            m_iOffset = 0;
+            m_iCapacity = m_ChunkSizes[next];
+            return;
+        }
+
+        // Oversized requests get a chunk of their own rather than failing.
+        size_t size = minimumSize > m_iChunkSize ? minimumSize : m_iChunkSize;
+        m_pBuffer = new uint8_t[size];
+        m_Chunks.insert(m_Chunks.begin() + next, m_pBuffer);
+        m_ChunkSizes.insert(m_ChunkSizes.begin() + next, size);
+        m_iChunk = next;
+        m_iOffset = 0;
+        m_iCapacity = size;
+    }
+
 	uint8_t* m_pBuffer;
     size_t m_iOffset;
+    size_t m_iCapacity;
+    size_t m_iChunk;
+    size_t m_iChunkSize;
+    size_t m_iBytesUsed;
+    size_t m_iHighWaterMark;
+    bool m_bFixed;
+    std::vector<uint8_t*> m_Chunks;
+    std::vector<size_t> m_ChunkSizes;
 };
 
 // ----------------------------------------------------------------------------
@@ -167,31 +406,120 @@ TEST(StarterKit2, TaskTerminate)
     CHECK_EQUAL(1, t.m_iTerminateCalled);
 };
 
+TEST(StarterKit2, TaskInitializeAfterTerminate)
+{
+    BehaviorTree bt;
+    MockBehavior& t = bt.allocate<MockBehavior>();
+    t.m_eReturnStatus = BH_SUCCESS;
 
-// ============================================================================
+    // Ticking a terminated node starts it over.
+    t.tick();
+    t.tick();
+    CHECK_EQUAL(2, t.m_iInitializeCalled);
+    CHECK_EQUAL(2, t.m_iTerminateCalled);
+};
 
-const size_t k_MaxChildrenPerComposite = 7;
+TEST(StarterKit2, TreeGrowsPastOneChunk)
+{
+    BehaviorTree bt(256);
+    std::vector<MockBehavior*> nodes;
+    for (int i=0; i<64; ++i)
+    {
+        nodes.push_back(&bt.allocate<MockBehavior>());
+    }
+    CHECK(bt.getChunkCount() > 1);
+    CHECK(bt.getBytesReserved() >= bt.getBytesUsed());
+    CHECK(bt.getBytesUsed() >= 64 * sizeof(MockBehavior));
+
+    for (size_t i=0; i<nodes.size(); ++i)
+    {
+        nodes[i]->tick();
+        CHECK_EQUAL(1, nodes[i]->m_iUpdateCalled);
+    }
+};
+
+TEST(StarterKit2, AllocateRespectsAlignment)
+{
+    BehaviorTree bt;
+    bt.allocate<uint8_t>();
+    MockBehavior& m = bt.allocate<MockBehavior>();
+    CHECK_EQUAL(0u, (uintptr_t)&m % ALIGNOF(MockBehavior));
+
+    bt.allocate<uint16_t>();
+    double& d = bt.allocate<double>();
+    CHECK_EQUAL(0u, (uintptr_t)&d % ALIGNOF(double));
+};
+
+struct LargeBehavior : public MockBehavior
+{
+    uint8_t m_Data[256];
+};
+
+TEST(StarterKit2, OversizedAllocationGetsOwnChunk)
+{
+    BehaviorTree bt(64);
+    bt.allocate<MockBehavior>();
+    LargeBehavior& l = bt.allocate<LargeBehavior>();
+    CHECK_EQUAL(0u, (uintptr_t)&l % ALIGNOF(LargeBehavior));
+    CHECK_EQUAL(2u, bt.getChunkCount());
+    CHECK(bt.getBytesReserved() >= 64 + sizeof(LargeBehavior));
+    CHECK_EQUAL(bt.getBytesUsed(), bt.getHighWaterMark());
+};
+
+
+// ============================================================================
 
 class Composite : public Behavior
+/**
+ * Children are referenced by their offset from the composite, stored in a
+ * table that BehaviorTree places directly behind the composite's memory.
+ * Children the offsets can't reach get a zero offset, and a pointer in a
+ * table of far children that the tree allocates the first time one is
+ * added.
+ */
 {
+    friend class BehaviorTree;
+
 public:
     Composite()
-    :	m_ChildCount(0)
+    :	m_pTree(NULL)
+    ,	m_ChildTable(0)
+    ,	m_ChildCount(0)
+    ,	m_ChildCapacity(0)
+    ,	m_bWideOffsets(false)
+    ,	m_bFarChildren(false)
     {
     }
 
     void addChild(Behavior& child)
     {
-		ASSERT(m_ChildCount < k_MaxChildrenPerComposite);
+		ASSERT(m_ChildCount < m_ChildCapacity);
 		ptrdiff_t p = (uintptr_t)&child - (uintptr_t)this;
-		ASSERT(p < std::numeric_limits<uint16_t>::max());
-		m_Children[m_ChildCount++] = static_cast<uint16_t>(p);
+        uint64_t limit = m_bWideOffsets ? std::numeric_limits<uint32_t>::max() : std::numeric_limits<uint16_t>::max();
+        size_t offset = p > 0  &&  (uint64_t)p < limit ? (size_t)p : 0;
+        if (offset == 0)
+        {
+            getFarChildren()[m_ChildCount] = &child;
+        }
+        if (m_bWideOffsets)
+        {
+            getTable<uint32_t>()[m_ChildCount++] = static_cast<uint32_t>(offset);
+        }
+        else
+        {
+            getTable<uint16_t>()[m_ChildCount++] = static_cast<uint16_t>(offset);
+        }
     }
 
 	Behavior& getChild(size_t index)
     {
 		ASSERT(index < m_ChildCount);
-		return *(Behavior*)((uintptr_t)this + m_Children[index]);
+        size_t offset = m_bWideOffsets ? getTable<uint32_t>()[index] : getTable<uint16_t>()[index];
+        if (offset == 0)
+        {
+            return *m_pFarChildren[index];
+        }
+		return *(Behavior*)((uintptr_t)this + offset);
     }
 
 	size_t getChildCount() const
@@ -199,9 +527,57 @@ public:
         return m_ChildCount;
     }
 
+	size_t getChildCapacity() const
+    {
+        return m_ChildCapacity;
+    }
+
 private:
-	uint16_t m_Children[k_MaxChildrenPerComposite];
+    void initializeChildren(BehaviorTree& tree, size_t table, size_t capacity, OffsetMode mode)
+    {
+        ASSERT(table <= std::numeric_limits<uint16_t>::max());
+        m_pTree = &tree;
+        m_ChildTable = static_cast<uint16_t>(table);
+        m_ChildCapacity = static_cast<uint16_t>(capacity);
+        m_bWideOffsets = mode == OFFSET_32;
+    }
+
+    Behavior** getFarChildren()
+    {
+        if (!m_bFarChildren)
+        {
+            ASSERT(m_pTree != NULL);
+            void* table = m_pTree->allocateBytes(m_ChildCapacity * sizeof(Behavior*), ALIGNOF(Behavior*));
+            m_pFarChildren = static_cast<Behavior**>(table);
+            m_bFarChildren = true;
+        }
+        return m_pFarChildren;
+    }
+
+    template <typename OFFSET>
+    OFFSET* getTable()
+    {
+        return (OFFSET*)((uintptr_t)this + m_ChildTable);
+    }
+
+    // The tree is only needed until the far children's table exists.
+    union
+    {
+        BehaviorTree* m_pTree;
+        Behavior** m_pFarChildren;
+    };
+	uint16_t m_ChildTable;
 	uint16_t m_ChildCount;
+	uint16_t m_ChildCapacity;
+	bool m_bWideOffsets;
+	bool m_bFarChildren;
+};
+
+struct Behavior::ResumePoint
+{
+    Composite* m_pNode;
+    uint16_t* m_pCurrent;
+    Status m_eProceed;          // Result that moves on to the next child.
 };
 
 class Sequence : public Composite
@@ -233,6 +609,14 @@ protected:
         }
     }
 
+    virtual bool getResumePoint(ResumePoint& point)
+    {
+        point.m_pNode = this;
+        point.m_pCurrent = &m_Current;
+        point.m_eProceed = BH_SUCCESS;
+        return true;
+    }
+
 	uint16_t m_Current;
 };
 
@@ -278,6 +662,24 @@ TEST(StarterKit2, SequenceOnePassThrough)
     }
 }
 
+TEST(StarterKit2, BlackboardInArena)
+{
+    blackboard::Layout layout;
+    blackboard::Key<int> health = layout.add<int>("health");
+    blackboard::Key<double> range = layout.add<double>("range");
+
+    BehaviorTree bt;
+    bt.allocate<uint8_t>();
+    blackboard::Blackboard& bb = bt.allocateBlackboard(layout);
+    CHECK_EQUAL(0, bb.get(health));
+
+    bb.set(health, 10);
+    bb.set(range, 2.5);
+    CHECK_EQUAL(10, bb.get(health));
+    CHECK_EQUAL(0u, (uintptr_t)&bb.get(range) % ALIGNOF(double));
+    CHECK(bt.getBytesUsed() >= sizeof(bb) + layout.getBlockSize());
+}
+
 TEST(StarterKit2, SequenceTwoFails)
 {
     BehaviorTree bt;
@@ -307,6 +709,48 @@ TEST(StarterKit2, SequenceTwoContinues)
 }
 
 
+TEST(StarterKit2, SequenceLargeFanOut)
+{
+    BehaviorTree bt;
+    MockSequence& seq = bt.allocateComposite<MockSequence>(30);
+    seq.initialize(bt, 30);
+    CHECK_EQUAL(30u, seq.getChildCount());
+
+    for (size_t i=0; i<29; ++i)
+    {
+        seq[i].m_eReturnStatus = BH_SUCCESS;
+    }
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, seq[28].m_iTerminateCalled);
+    CHECK_EQUAL(1, seq[29].m_iInitializeCalled);
+
+    seq[29].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(seq.tick(), BH_SUCCESS);
+}
+
+struct Padding
+{
+    uint8_t m_Data[70000];
+};
+
+TEST(StarterKit2, SequenceWideOffsets)
+{
+    BehaviorTree bt(256 * 1024);
+    MockSequence& seq = bt.allocateComposite<MockSequence>(2, OFFSET_32);
+    MockBehavior& first = bt.allocate<MockBehavior>();
+    bt.allocate<Padding>();
+    MockBehavior& last = bt.allocate<MockBehavior>();
+    CHECK_EQUAL(1u, bt.getChunkCount());
+
+    seq.addChild(first);
+    seq.addChild(last);
+    CHECK_EQUAL(&last, &seq[1]);
+
+    first.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(seq.tick(), BH_RUNNING);
+    CHECK_EQUAL(1, last.m_iUpdateCalled);
+}
+
 // ============================================================================
 
 class Selector : public Composite
@@ -338,6 +782,14 @@ protected:
         }
     }
 
+    virtual bool getResumePoint(ResumePoint& point)
+    {
+        point.m_pNode = this;
+        point.m_pCurrent = &m_Current;
+        point.m_eProceed = BH_FAILURE;
+        return true;
+    }
+
 	uint16_t m_Current;
 };
 
@@ -392,4 +844,1195 @@ TEST(StarterKit2, SelectorTwoSucceeds)
     CHECK_EQUAL(1, sel[0].m_iTerminateCalled);
 }
 
+TEST(StarterKit2, ClearReusesChunks)
+{
+    BehaviorTree bt(256);
+    MockBehavior* first = &bt.allocate<MockBehavior>();
+    for (size_t i=0; i<16; ++i)
+    {
+        bt.allocate<MockBehavior>();
+    }
+    size_t chunks = bt.getChunkCount();
+    CHECK(chunks > 1);
+
+    size_t used = bt.getBytesUsed();
+    bt.clear();
+    CHECK_EQUAL(0u, bt.getBytesUsed());
+    CHECK_EQUAL(used, bt.getHighWaterMark());
+    CHECK(&bt.allocate<MockBehavior>() == first);
+    for (size_t i=0; i<16; ++i)
+    {
+        bt.allocate<MockBehavior>();
+    }
+    CHECK_EQUAL(chunks, bt.getChunkCount());
+}
+
+// Children are added once their own subtree is built, as a loader would.
+Behavior& createDeepTree(BehaviorTree& bt, size_t depth, std::vector<MockBehavior*>& leaves)
+{
+    if (depth == 0)
+    {
+        MockBehavior& leaf = bt.allocate<MockBehavior>();
+        leaf.m_eReturnStatus = BH_SUCCESS;
+        leaves.push_back(&leaf);
+        return leaf;
+    }
+    MockSequence& seq = bt.allocateComposite<MockSequence>(3);
+    for (size_t i=0; i<3; ++i)
+    {
+        seq.addChild(createDeepTree(bt, depth - 1, leaves));
+    }
+    return seq;
+}
+
+TEST(StarterKit2, TreeSpansManyChunks)
+{
+    BehaviorTree bt(256);
+    std::vector<MockBehavior*> leaves;
+    Behavior& root = createDeepTree(bt, 5, leaves);
+    CHECK(bt.getChunkCount() > 10);
+
+    CHECK_EQUAL(BH_SUCCESS, root.tick());
+    CHECK_EQUAL(243u, leaves.size());
+    for (size_t i=0; i<leaves.size(); ++i)
+    {
+        CHECK_EQUAL(1, leaves[i]->m_iUpdateCalled);
+    }
+}
+
+#if !defined(BTSK_NO_METRICS)
+TEST(StarterKit2, ArenaBytesGauge)
+{
+    metrics::Snapshot before, after;
+    metrics::collect(before);
+    {
+        BehaviorTree bt;
+        bt.allocate<MockBehavior>();
+        metrics::collect(after);
+        CHECK_EQUAL((int64_t)bt.getBytesUsed(), after.get(metrics::GAUGE_ARENA_BYTES) - before.get(metrics::GAUGE_ARENA_BYTES));
+
+        bt.clear();
+        bt.allocate<MockBehavior>();
+        bt.allocate<MockBehavior>();
+        metrics::collect(after);
+        CHECK_EQUAL((int64_t)bt.getBytesUsed(), after.get(metrics::GAUGE_ARENA_BYTES) - before.get(metrics::GAUGE_ARENA_BYTES));
+    }
+    metrics::collect(after);
+    CHECK_EQUAL(before.get(metrics::GAUGE_ARENA_BYTES), after.get(metrics::GAUGE_ARENA_BYTES));
+}
+#endif
+
+// ============================================================================
+
+const size_t k_TreeBatchAlignment = 16;
+
+class TreeBatch
+/**
+ * Copies of one tree placed back to back in a single block, so spawning a
+ * wave of agents is one allocation rather than one per agent.  Each copy is
+ * built in place by the same builder, which must lay out the same nodes in
+ * the same order every time; their constructors run as usual, and as in
+ * the arena, their destructors don't.  Each copy gets its own slot aligned
+ * to k_TreeBatchAlignment, whatever the heap aligns the block to.
+ */
+{
+public:
+    typedef Behavior& (*Builder)(BehaviorTree& tree, void* data);
+
+    TreeBatch(Builder builder, void* data, size_t count)
+    :	m_pBuilder(builder)
+    ,	m_pData(data)
+    ,	m_pBlock(NULL)
+    ,	m_iCount(count)
+    ,	m_iRoot(0)
+    {
+        // Measure one copy in an ordinary arena, with a chunk big enough
+        // for all of it, plus room for the slot's alignment to differ.
+        size_t size = k_BehaviorTreeChunkSize;
+        for (;;)
+        {
+            BehaviorTree measure(size);
+            builder(measure, data);
+            if (measure.getChunkCount() == 1)
+            {
+                size = measure.getBytesUsed();
+                break;
+            }
+            size = measure.getBytesReserved() * 2;
+        }
+        m_iStride = (size + 2 * k_TreeBatchAlignment - 1) & ~(k_TreeBatchAlignment - 1);
+        m_pBlock = new uint8_t[m_iStride * count + k_TreeBatchAlignment];
+        for (size_t i=0; i<count; ++i)
+        {
+            build(i);
+        }
+    }
+
+    ~TreeBatch()
+    {
+        delete [] m_pBlock;
+    }
+
+    // Build agents [first, first + count) again from scratch.
+    void reset(size_t first, size_t count)
+    {
+        ASSERT(first + count <= m_iCount);
+        for (size_t i=first; i<first + count; ++i)
+        {
+            build(i);
+        }
+    }
+
+    void reset()
+    {
+        reset(0, m_iCount);
+    }
+
+    Behavior& getRoot(size_t index)
+    {
+        ASSERT(index < m_iCount);
+        return *reinterpret_cast<Behavior*>(getInstance(index) + m_iRoot);
+    }
+
+    size_t getCount() const
+    {
+        return m_iCount;
+    }
+
+    size_t getStride() const
+    {
+        return m_iStride;
+    }
+
+private:
+    TreeBatch(const TreeBatch&);
+    TreeBatch& operator=(const TreeBatch&);
+
+    uint8_t* getInstance(size_t index)
+    {
+        uintptr_t base = ((uintptr_t)m_pBlock + k_TreeBatchAlignment - 1) & ~(uintptr_t)(k_TreeBatchAlignment - 1);
+        return (uint8_t*)base + index * m_iStride;
+    }
+
+    void build(size_t index)
+    {
+        uint8_t* instance = getInstance(index);
+        BehaviorTree tree(instance, m_iStride);
+        size_t root = (size_t)((uint8_t*)&m_pBuilder(tree, m_pData) - instance);
+        ASSERT(index == 0  ||  root == m_iRoot);
+        m_iRoot = root;
+    }
+
+    Builder m_pBuilder;
+    void* m_pData;
+    uint8_t* m_pBlock;
+    size_t m_iCount;
+    size_t m_iStride;
+    size_t m_iRoot;
+};
+
+Behavior& buildBatchSequence(BehaviorTree& bt, void* data)
+{
+    size_t children = *static_cast<size_t*>(data);
+    MockSequence& seq = bt.allocateComposite<MockSequence>(children);
+    seq.initialize(bt, children);
+    seq[0].m_eReturnStatus = BH_SUCCESS;
+    return seq;
+}
+
+TEST(StarterKit2, TreeBatchBuildsCopies)
+{
+    size_t children = 2;
+    TreeBatch batch(&buildBatchSequence, &children, 3);
+    CHECK_EQUAL(3u, batch.getCount());
+    CHECK_EQUAL(0u, batch.getStride() % k_TreeBatchAlignment);
+
+    MockSequence& copy = static_cast<MockSequence&>(batch.getRoot(1));
+    CHECK_EQUAL(0u, (uintptr_t)&copy % k_TreeBatchAlignment);
+    CHECK_EQUAL(2u, copy.getChildCount());
+    CHECK_EQUAL(BH_RUNNING, copy.tick());
+    CHECK_EQUAL(1, copy[0].m_iTerminateCalled);
+    CHECK_EQUAL(1, copy[1].m_iUpdateCalled);
+
+    // The other agents are unaffected.
+    MockSequence& other = static_cast<MockSequence&>(batch.getRoot(2));
+    CHECK_EQUAL(0, other[1].m_iUpdateCalled);
+    CHECK(&other[1] != &copy[1]);
+}
+
+TEST(StarterKit2, TreeBatchResetsRange)
+{
+    size_t children = 2;
+    TreeBatch batch(&buildBatchSequence, &children, 4);
+    for (size_t i=0; i<batch.getCount(); ++i)
+    {
+        batch.getRoot(i).tick();
+    }
+
+    batch.reset(1, 2);
+    CHECK_EQUAL(BH_RUNNING, batch.getRoot(0).getStatus());
+    CHECK_EQUAL(BH_INVALID, batch.getRoot(1).getStatus());
+    CHECK_EQUAL(BH_INVALID, batch.getRoot(2).getStatus());
+    CHECK_EQUAL(BH_RUNNING, batch.getRoot(3).getStatus());
+
+    MockSequence& reset = static_cast<MockSequence&>(batch.getRoot(1));
+    CHECK_EQUAL(0, reset[0].m_iUpdateCalled);
+    reset.tick();
+    CHECK_EQUAL(1, reset[0].m_iInitializeCalled);
+}
+
+// Trees bigger than a chunk are measured in one piece and still fit a slot.
+TEST(StarterKit2, TreeBatchLargeTree)
+{
+    size_t children = 600;
+    TreeBatch batch(&buildBatchSequence, &children, 2);
+    CHECK(batch.getStride() > k_BehaviorTreeChunkSize);
+    MockSequence& copy = static_cast<MockSequence&>(batch.getRoot(1));
+    CHECK_EQUAL(600u, copy.getChildCount());
+    CHECK_EQUAL(BH_RUNNING, copy.tick());
+}
+
+// ============================================================================
+
+class NodeFactory
+/**
+ * Maps the type names used in tree images to functions that allocate the
+ * matching nodes.  Composites get exactly as many child slots as the image
+ * gives them.
+ */
+{
+public:
+    typedef Behavior& (*CreateFunction)(BehaviorTree&, const image::Node&, OffsetMode);
+
+    struct Entry
+    {
+        std::string m_Name;
+        CreateFunction m_pCreate;
+        size_t m_iSize;         // Upper bound, child offsets aside.
+        bool m_bComposite;
+    };
+
+    template <class T>
+    void add(const std::string& name)
+    {
+        add(name, &create<T>, sizeof(T) + ALIGNOF(T), std::is_base_of<Composite, T>::value);
+    }
+
+    // For nodes that take the image's parameter, or need other setup.
+    void add(const std::string& name, CreateFunction function, size_t size, bool composite)
+    {
+        Entry entry = { name, function, size, composite };
+        m_Entries.push_back(entry);
+    }
+
+    const Entry* find(const char* name) const
+    {
+        for (size_t i=0; i<m_Entries.size(); ++i)
+        {
+            if (m_Entries[i].m_Name == name)
+            {
+                return &m_Entries[i];
+            }
+        }
+        return NULL;
+    }
+
+private:
+    template <class T>
+    static Behavior& create(BehaviorTree& bt, const image::Node& node, OffsetMode mode)
+    {
+        return createNode<T>(bt, node, mode, std::is_base_of<Composite, T>());
+    }
+
+    template <class T>
+    static Behavior& createNode(BehaviorTree& bt, const image::Node&, OffsetMode, std::false_type)
+    {
+        return bt.allocate<T>();
+    }
+
+    template <class T>
+    static Behavior& createNode(BehaviorTree& bt, const image::Node& node, OffsetMode mode, std::true_type)
+    {
+        return bt.allocateComposite<T>(node.m_iChildCount, mode);
+    }
+
+    std::vector<Entry> m_Entries;
+};
+
+// Builds the tree stored in an image, walking its records front to back:
+// once to size the tree so it fits in one chunk, and once to allocate and
+// link the nodes.  Node types have vtables, so the image can't simply be
+// copied into the arena.  Returns NULL for invalid images, or images using
+// types the factory doesn't know.
+Behavior* instantiate(BehaviorTree& bt, const image::Image& img, const NodeFactory& factory)
+{
+    if (!img.isValid())
+    {
+        return NULL;
+    }
+
+    // Type names are resolved once per image rather than once per node.
+    std::vector<const NodeFactory::Entry*> types(img.getTypeCount());
+    for (size_t i=0; i<types.size(); ++i)
+    {
+        if ((types[i] = factory.find(img.getTypeName(i))) == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    size_t size = 0;
+    const image::Node* node = &img.getRoot();
+    for (size_t i=0; i<img.getNodeCount(); ++i, node = &img.getNext(*node))
+    {
+        const NodeFactory::Entry& type = *types[node->m_iType];
+        if (node->m_iChildCount > 0  &&  !type.m_bComposite)
+        {
+            return NULL;
+        }
+        size += type.m_iSize + (node->m_iChildCount + 1) * sizeof(uint32_t);
+    }
+    OffsetMode mode = size > std::numeric_limits<uint16_t>::max() ? OFFSET_32 : OFFSET_16;
+    bt.reserve(size);
+
+    // Composites still waiting for children, innermost last.
+    struct Pending { Composite* m_pComposite; size_t m_iRemaining; };
+    Pending stack[image::k_MaxImageDepth];
+    size_t depth = 0;
+    Behavior* root = NULL;
+
+    node = &img.getRoot();
+    for (size_t i=0; i<img.getNodeCount(); ++i, node = &img.getNext(*node))
+    {
+        const NodeFactory::Entry& type = *types[node->m_iType];
+        Behavior& b = type.m_pCreate(bt, *node, mode);
+        if (depth > 0)
+        {
+            Pending& parent = stack[depth - 1];
+            parent.m_pComposite->addChild(b);
+            if (--parent.m_iRemaining == 0)
+            {
+                --depth;
+            }
+        }
+        else
+        {
+            root = &b;
+        }
+
+        if (node->m_iChildCount > 0)
+        {
+            Pending pending = { static_cast<Composite*>(&b), node->m_iChildCount };
+            stack[depth++] = pending;
+        }
+    }
+    return root;
+}
+
+// ----------------------------------------------------------------------------
+
+Behavior& createParameterBehavior(BehaviorTree& bt, const image::Node& node, OffsetMode)
+{
+    MockBehavior& b = bt.allocate<MockBehavior>();
+    b.m_eReturnStatus = static_cast<Status>(node.m_iParameter);
+    return b;
+}
+
+TEST(StarterKit2, InstantiateImage)
+{
+    const char* text =
+        "# Falls back on the last action.\n"
+        "Selector\n"
+        "    Sequence\n"
+        "        Action 1\n"
+        "        Action 2\n"
+        "    Action 3\n";
+
+    image::ImageBuilder builder;
+    std::string error;
+    CHECK(image::parse(text, builder, error));
+    std::vector<uint8_t> data;
+    builder.write(data);
+
+    image::Image img(&data[0], data.size());
+    CHECK(img.isValid());
+    CHECK_EQUAL(5u, img.getNodeCount());
+    CHECK_EQUAL(3u, img.getTypeCount());
+    CHECK_EQUAL(2u, img.getChild(img.getRoot(), 0).m_iChildCount);
+
+    NodeFactory factory;
+    factory.add<MockSelector>("Selector");
+    factory.add<MockSequence>("Sequence");
+    factory.add("Action", &createParameterBehavior, sizeof(MockBehavior) + ALIGNOF(MockBehavior), false);
+
+    BehaviorTree bt;
+    MockSelector* sel = static_cast<MockSelector*>(instantiate(bt, img, factory));
+    CHECK(sel != NULL);
+    CHECK_EQUAL(2u, sel->getChildCount());
+    CHECK_EQUAL(2u, sel->getChildCapacity());
+    CHECK_EQUAL(1u, bt.getChunkCount());
+
+    MockSequence& seq = static_cast<MockSequence&>(sel->getChild(0));
+    CHECK_EQUAL(BH_FAILURE, seq[1].m_eReturnStatus);
+    CHECK_EQUAL(BH_RUNNING, sel->tick());
+    CHECK_EQUAL(1, (*sel)[1].m_iUpdateCalled);
+}
+
+TEST(StarterKit2, InstantiateRejectsBadImages)
+{
+    image::ImageBuilder builder;
+    size_t root = builder.add("Sequence");
+    builder.add("Action", 0, root);
+    std::vector<uint8_t> data;
+    builder.write(data);
+
+    NodeFactory factory;
+    factory.add<MockSequence>("Sequence");
+
+    BehaviorTree bt;
+    image::Image unknown(&data[0], data.size());
+    CHECK(instantiate(bt, unknown, factory) == NULL);
+
+    factory.add<MockBehavior>("Action");
+    CHECK(instantiate(bt, unknown, factory) != NULL);
+
+    image::Image truncated(&data[0], data.size() - 1);
+    CHECK(!truncated.isValid());
+
+    data[0] ^= 0xff;
+    image::Image corrupt(&data[0], data.size());
+    CHECK(!corrupt.isValid());
+
+    image::ImageBuilder text;
+    std::string error;
+    CHECK(!image::parse("Selector\nAction\n", text, error));
+    CHECK(error.find("line 2") != std::string::npos);
+
+    image::ImageBuilder parameter;
+    CHECK(!image::parse("Selector\n  Action -1\n", parameter, error));
+    CHECK(error.find("parameter") != std::string::npos);
+}
+
+// ============================================================================
+
+class ActivePath
+/**
+ * Ticks a tree from the node it was running last time instead of from the
+ * root, and climbs back up only once that node terminates.  The path goes
+ * through sequences and selectors, and stops at the first node without a
+ * resume point, which is ticked as a whole so it can react to changes.
+ */
+{
+public:
+    ActivePath(Behavior& root)
+    :	m_pRoot(&root)
+    ,	m_pResume(NULL)
+    {
+    }
+
+    Status tick()
+    {
+        if (m_pResume == NULL)
+        {
+            Status s = m_pRoot->tick();
+            if (s == BH_RUNNING)
+            {
+                record(*m_pRoot);
+            }
+            return s;
+        }
+
+        Status s = m_pResume->tick();
+        while (s != BH_RUNNING)
+        {
+            if (m_Path.empty())
+            {
+                m_pResume = NULL;
+                return s;
+            }
+            Entry entry = m_Path.back();
+            m_Path.pop_back();
+            s = resume(entry, s);
+            if (s == BH_RUNNING)
+            {
+                record(*entry.m_pNode);
+            }
+        }
+        return BH_RUNNING;
+    }
+
+    // Composites skipped by the next tick, the root included.
+    size_t getDepth() const
+    {
+        return m_Path.size();
+    }
+
+    Behavior* getResumeNode() const
+    {
+        return m_pResume;
+    }
+
+    // Stop the running nodes, innermost first, when the tree is interrupted
+    // from outside; the next tick starts over from the root.
+    void abort()
+    {
+        if (m_pResume == NULL)
+        {
+            return;
+        }
+        if (m_pResume->getStatus() == BH_RUNNING)
+        {
+            terminate(*m_pResume, BH_ABORTED);
+        }
+        while (!m_Path.empty())
+        {
+            terminate(*m_Path.back().m_pNode, BH_ABORTED);
+            m_Path.pop_back();
+        }
+        m_pResume = NULL;
+    }
+
+protected:
+    typedef Behavior::ResumePoint Entry;
+
+    static void terminate(Behavior& node, Status s)
+    {
+        if (s == BH_ABORTED)
+        {
+            METRICS_ADD(COUNTER_ABORTS, 1);
+        }
+        node.m_eStatus = s;
+        PROFILE_TERMINATE(&node);
+        TRACE_TERMINATE(&node, s);
+        node.onTerminate(s);
+    }
+
+    // The current child of a composite on the path finished with 's': the
+    // composite goes on with its next child, or finishes with 's' too.
+    Status resume(const Entry& entry, Status s)
+    {
+        Composite& node = *entry.m_pNode;
+        if (s == entry.m_eProceed  &&  ++*entry.m_pCurrent != node.getChildCount())
+        {
+            return node.tick();
+        }
+        terminate(node, s);
+        return s;
+    }
+
+    void record(Behavior& bh)
+    {
+        Behavior* node = &bh;
+        Entry entry;
+        while (node->getStatus() == BH_RUNNING  &&  node->getResumePoint(entry))
+        {
+            m_Path.push_back(entry);
+            node = &entry.m_pNode->getChild(*entry.m_pCurrent);
+        }
+        m_pResume = node;
+    }
+
+    Behavior* m_pRoot;
+    Behavior* m_pResume;
+    std::vector<Entry> m_Path;
+};
+
+TEST(StarterKit2, ActivePathResumesAtLeaf)
+{
+    BehaviorTree bt;
+    MockSelector& sel = bt.allocateComposite<MockSelector>(2);
+    MockSequence& seq = bt.allocate<MockSequence>();
+    sel.addChild(seq);
+    seq.initialize(bt, 2);
+    MockBehavior& fallback = bt.allocate<MockBehavior>();
+    sel.addChild(fallback);
+
+    ActivePath path(sel);
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2u, path.getDepth());
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2, seq[0].m_iUpdateCalled);
+
+    seq[0].m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK(path.getResumeNode() == &seq[1]);
+
+    seq[1].m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK(path.getResumeNode() == &fallback);
+    CHECK_EQUAL(BH_FAILURE, seq.getStatus());
+
+    fallback.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, path.tick());
+    CHECK_EQUAL(BH_SUCCESS, sel.getStatus());
+    CHECK(path.getResumeNode() == NULL);
+
+    // Starting over goes through the root again.
+    CHECK_EQUAL(BH_SUCCESS, path.tick());
+    CHECK_EQUAL(4, seq[0].m_iUpdateCalled);
+    CHECK_EQUAL(2, seq[0].m_iInitializeCalled);
+}
+
+TEST(StarterKit2, ActivePathAbortsRunningNodes)
+{
+    BehaviorTree bt;
+    MockSelector& sel = bt.allocateComposite<MockSelector>(2);
+    MockSequence& seq = bt.allocate<MockSequence>();
+    sel.addChild(seq);
+    seq.initialize(bt, 2);
+    MockBehavior& fallback = bt.allocate<MockBehavior>();
+    sel.addChild(fallback);
+
+    ActivePath path(sel);
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    path.abort();
+    CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
+    CHECK_EQUAL(BH_ABORTED, seq[0].m_eTerminateStatus);
+    CHECK_EQUAL(BH_ABORTED, seq.getStatus());
+    CHECK_EQUAL(BH_ABORTED, sel.getStatus());
+    CHECK_EQUAL(0, seq[1].m_iTerminateCalled);
+    CHECK(path.getResumeNode() == NULL);
+
+    // Nothing is left running, so the next tick starts at the root.
+    CHECK_EQUAL(BH_RUNNING, path.tick());
+    CHECK_EQUAL(2, seq[0].m_iInitializeCalled);
+    CHECK_EQUAL(2u, path.getDepth());
+}
+
+// ============================================================================
+// Nodes without virtual functions.  Each starts with a type tag instead of
+// a vtable pointer, and TaggedTree dispatches on it, so the built-in
+// composites are updated inline.  Leaves go through a table of functions
+// registered once per type; hooks a leaf type doesn't define are skipped
+// rather than called empty.
+
+enum TaggedType
+{
+    TAGGED_SEQUENCE,
+    TAGGED_SELECTOR,
+    TAGGED_FIRST_LEAF,
+};
+
+const size_t k_MaxTaggedLeafTypes = 32;
+
+struct TaggedNode
+{
+    uint8_t m_iType;
+    uint8_t m_eStatus;
+};
+
+struct TaggedLeaf : public TaggedNode
+/**
+ * Base for leaf types, with the hooks they don't need to define.  They're
+ * found by name, not called virtually, so derived types declare their own
+ * with the same signature.
+ */
+{
+    void onInitialize() {}
+    void onTerminate(Status) {}
+};
+
+struct TaggedComposite : public TaggedNode
+/**
+ * Sequence or selector, followed in memory by the offsets to its
+ * children.  They're always 32-bit, so large trees need no other mode.
+ */
+{
+    uint16_t m_iCurrent;
+    uint16_t m_iChildCount;
+    uint16_t m_iChildCapacity;
+
+    void addChild(TaggedNode& child)
+    {
+        ASSERT(m_iChildCount < m_iChildCapacity);
+        ptrdiff_t p = (uintptr_t)&child - (uintptr_t)this;
+        ASSERT(p > 0  &&  (uint64_t)p < std::numeric_limits<uint32_t>::max());
+        getOffsets()[m_iChildCount++] = static_cast<uint32_t>(p);
+    }
+
+    TaggedNode& getChild(size_t index)
+    {
+        ASSERT(index < m_iChildCount);
+        return *(TaggedNode*)((uintptr_t)this + getOffsets()[index]);
+    }
+
+    uint32_t* getOffsets()
+    {
+        return reinterpret_cast<uint32_t*>(this + 1);
+    }
+};
+
+class TaggedTree
+/**
+ * Arena and dispatch table for tagged nodes.  Register every leaf type
+ * before allocating leaves of that type.
+ */
+{
+public:
+    TaggedTree(size_t chunkSize = k_BehaviorTreeChunkSize)
+    :	m_Arena(chunkSize)
+    ,	m_iLeafTypeCount(0)
+    {
+    }
+
+    template <class T>
+    void addLeafType()
+    {
+        ASSERT(m_iLeafTypeCount < k_MaxTaggedLeafTypes);
+        ASSERT(findLeafType(getType<T>()) == 0);
+        LeafType& type = m_LeafTypes[m_iLeafTypeCount++];
+        type.m_pType = getType<T>();
+        type.m_pInitialize = (&T::onInitialize == &TaggedLeaf::onInitialize) ? NULL : &initializeLeaf<T>;
+        type.m_pUpdate = &updateLeaf<T>;
+        type.m_pTerminate = (&T::onTerminate == &TaggedLeaf::onTerminate) ? NULL : &terminateLeaf<T>;
+    }
+
+    template <class T>
+    T& allocateLeaf()
+    {
+        uint8_t tag = findLeafType(getType<T>());
+        ASSERT(tag != 0);
+        T* leaf = new (m_Arena.allocateBytes(sizeof(T), ALIGNOF(T))) T;
+        leaf->m_iType = tag;
+        leaf->m_eStatus = BH_INVALID;
+        return *leaf;
+    }
+
+    TaggedComposite& allocateSequence(size_t capacity)
+    {
+        return allocateComposite(TAGGED_SEQUENCE, capacity);
+    }
+
+    TaggedComposite& allocateSelector(size_t capacity)
+    {
+        return allocateComposite(TAGGED_SELECTOR, capacity);
+    }
+
+    // Start a new chunk unless the next 'size' bytes fit in this one.
+    void reserve(size_t size)
+    {
+        m_Arena.reserve(size);
+    }
+
+    Status tick(TaggedNode& node)
+    {
+        if (node.m_iType < TAGGED_FIRST_LEAF)
+        {
+            return tickComposite(static_cast<TaggedComposite&>(node));
+        }
+        return tickLeaf(node, getLeafType(node));
+    }
+
+    size_t getBytesUsed() const
+    {
+        return m_Arena.getBytesUsed();
+    }
+
+protected:
+    struct LeafType
+    {
+        const void* m_pType;
+        void (*m_pInitialize)(TaggedNode&);
+        Status (*m_pUpdate)(TaggedNode&);
+        void (*m_pTerminate)(TaggedNode&, Status);
+    };
+
+    TaggedComposite& allocateComposite(TaggedType type, size_t capacity)
+    {
+        ASSERT(capacity <= std::numeric_limits<uint16_t>::max());
+        void* memory = m_Arena.allocateBytes(sizeof(TaggedComposite) + capacity * sizeof(uint32_t), ALIGNOF(uint32_t));
+        TaggedComposite* node = new (memory) TaggedComposite;
+        node->m_iType = static_cast<uint8_t>(type);
+        node->m_eStatus = BH_INVALID;
+        node->m_iCurrent = 0;
+        node->m_iChildCount = 0;
+        node->m_iChildCapacity = static_cast<uint16_t>(capacity);
+        return *node;
+    }
+
+    // Composites need no hooks of their own, so they're always inlined.
+    Status tickComposite(TaggedComposite& node)
+    {
+        if (node.m_eStatus != BH_RUNNING)
+        {
+            PROFILE_INITIALIZE(&node);
+            TRACE_INITIALIZE(&node);
+            node.m_iCurrent = 0;
+        }
+
+        PROFILE_UPDATE_BEGIN(&node);
+        TRACE_UPDATE_BEGIN(&node);
+        METRICS_ADD(COUNTER_NODE_UPDATES, 1);
+        Status s = updateComposite(node, node.m_iType == TAGGED_SEQUENCE ? BH_SUCCESS : BH_FAILURE);
+        node.m_eStatus = static_cast<uint8_t>(s);
+        PROFILE_UPDATE_END(&node);
+        TRACE_UPDATE_END(&node, s);
+
+        if (s != BH_RUNNING)
+        {
+            PROFILE_TERMINATE(&node);
+            TRACE_TERMINATE(&node, s);
+        }
+        return s;
+    }
+
+    Status tickLeaf(TaggedNode& node, const LeafType& type)
+    {
+        if (node.m_eStatus != BH_RUNNING)
+        {
+            PROFILE_INITIALIZE(&node);
+            TRACE_INITIALIZE(&node);
+            if (type.m_pInitialize != NULL)
+            {
+                type.m_pInitialize(node);
+            }
+        }
+
+        PROFILE_UPDATE_BEGIN(&node);
+        TRACE_UPDATE_BEGIN(&node);
+        METRICS_ADD(COUNTER_NODE_UPDATES, 1);
+        Status s = type.m_pUpdate(node);
+        node.m_eStatus = static_cast<uint8_t>(s);
+        PROFILE_UPDATE_END(&node);
+        TRACE_UPDATE_END(&node, s);
+
+        if (s != BH_RUNNING)
+        {
+            PROFILE_TERMINATE(&node);
+            TRACE_TERMINATE(&node, s);
+            if (type.m_pTerminate != NULL)
+            {
+                type.m_pTerminate(node, s);
+            }
+        }
+        return s;
+    }
+
+    // Sequences keep going while children succeed, selectors while they fail.
+    Status updateComposite(TaggedComposite& node, Status proceed)
+    {
+        for (;;)
+        {
+            Status s = tick(node.getChild(node.m_iCurrent));
+            if (s != proceed)
+            {
+                return s;
+            }
+            if (++node.m_iCurrent == node.m_iChildCount)
+            {
+                return proceed;
+            }
+        }
+    }
+
+    const LeafType& getLeafType(const TaggedNode& node) const
+    {
+        ASSERT(node.m_iType >= TAGGED_FIRST_LEAF  &&  node.m_iType < TAGGED_FIRST_LEAF + m_iLeafTypeCount);
+        return m_LeafTypes[node.m_iType - TAGGED_FIRST_LEAF];
+    }
+
+    // Tag of a registered leaf type, or zero.
+    uint8_t findLeafType(const void* type) const
+    {
+        for (size_t i=0; i<m_iLeafTypeCount; ++i)
+        {
+            if (m_LeafTypes[i].m_pType == type)
+            {
+                return static_cast<uint8_t>(TAGGED_FIRST_LEAF + i);
+            }
+        }
+        return 0;
+    }
+
+    template <class T>
+    static const void* getType()
+    {
+        static const char s_Type = 0;
+        return &s_Type;
+    }
+
+    template <class T>
+    static void initializeLeaf(TaggedNode& node)
+    {
+        static_cast<T&>(node).onInitialize();
+    }
+
+    template <class T>
+    static Status updateLeaf(TaggedNode& node)
+    {
+        return static_cast<T&>(node).update();
+    }
+
+    template <class T>
+    static void terminateLeaf(TaggedNode& node, Status s)
+    {
+        static_cast<T&>(node).onTerminate(s);
+    }
+
+    BehaviorTree m_Arena;
+    LeafType m_LeafTypes[k_MaxTaggedLeafTypes];
+    size_t m_iLeafTypeCount;
+};
+
+struct MockTaggedLeaf : public TaggedLeaf
+{
+    int m_iInitializeCalled;
+    int m_iTerminateCalled;
+    int m_iUpdateCalled;
+    Status m_eReturnStatus;
+    Status m_eTerminateStatus;
+
+    MockTaggedLeaf()
+    :	m_iInitializeCalled(0)
+    ,	m_iTerminateCalled(0)
+    ,	m_iUpdateCalled(0)
+    ,	m_eReturnStatus(BH_RUNNING)
+    ,	m_eTerminateStatus(BH_INVALID)
+    {
+    }
+
+    void onInitialize()
+    {
+        ++m_iInitializeCalled;
+    }
+
+    void onTerminate(Status s)
+    {
+        ++m_iTerminateCalled;
+        m_eTerminateStatus = s;
+    }
+
+    Status update()
+    {
+        ++m_iUpdateCalled;
+        return m_eReturnStatus;
+    }
+};
+
+struct CountingTaggedLeaf : public TaggedLeaf
+{
+    int m_iUpdateCalled;
+
+    CountingTaggedLeaf()
+    :	m_iUpdateCalled(0)
+    {
+    }
+
+    Status update()
+    {
+        return ++m_iUpdateCalled < 2 ? BH_RUNNING : BH_SUCCESS;
+    }
+};
+
+TEST(StarterKit2, TaggedSequenceAndSelector)
+{
+    TaggedTree tree;
+    tree.addLeafType<MockTaggedLeaf>();
+    TaggedComposite& sel = tree.allocateSelector(2);
+    TaggedComposite& seq = tree.allocateSequence(2);
+    MockTaggedLeaf& a = tree.allocateLeaf<MockTaggedLeaf>();
+    MockTaggedLeaf& b = tree.allocateLeaf<MockTaggedLeaf>();
+    MockTaggedLeaf& fallback = tree.allocateLeaf<MockTaggedLeaf>();
+    seq.addChild(a);
+    seq.addChild(b);
+    sel.addChild(seq);
+    sel.addChild(fallback);
+
+    a.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, tree.tick(sel));
+    CHECK_EQUAL(1, a.m_iTerminateCalled);
+    CHECK_EQUAL(1, b.m_iInitializeCalled);
+
+    b.m_eReturnStatus = BH_FAILURE;
+    fallback.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, tree.tick(sel));
+    CHECK_EQUAL(BH_FAILURE, b.m_eTerminateStatus);
+    CHECK_EQUAL(1, fallback.m_iTerminateCalled);
+
+    // Running again starts over from the first child.
+    CHECK_EQUAL(BH_SUCCESS, tree.tick(sel));
+    CHECK_EQUAL(2, a.m_iInitializeCalled);
+    CHECK_EQUAL(2, fallback.m_iUpdateCalled);
+}
+
+TEST(StarterKit2, TaggedLeafTypes)
+{
+    TaggedTree tree;
+    tree.addLeafType<MockTaggedLeaf>();
+    tree.addLeafType<CountingTaggedLeaf>();
+    TaggedComposite& seq = tree.allocateSequence(2);
+    CountingTaggedLeaf& counting = tree.allocateLeaf<CountingTaggedLeaf>();
+    MockTaggedLeaf& mock = tree.allocateLeaf<MockTaggedLeaf>();
+    seq.addChild(counting);
+    seq.addChild(mock);
+    CHECK(counting.m_iType != mock.m_iType);
+
+    CHECK_EQUAL(BH_RUNNING, tree.tick(seq));
+    CHECK_EQUAL(0, mock.m_iUpdateCalled);
+    CHECK_EQUAL(BH_RUNNING, tree.tick(seq));
+    CHECK_EQUAL(2, counting.m_iUpdateCalled);
+    CHECK_EQUAL(1, mock.m_iUpdateCalled);
+}
+
+// ============================================================================
+
+struct BenchmarkBehavior : public Behavior
+{
+    size_t m_iDuration;
+    size_t m_iRemaining;
+
+    BenchmarkBehavior()
+    :	m_iDuration(1)
+    ,	m_iRemaining(0)
+    {
+    }
+
+    virtual void onInitialize()
+    {
+        m_iRemaining = m_iDuration;
+    }
+
+    virtual Status update()
+    {
+        return --m_iRemaining > 0 ? BH_RUNNING : BH_SUCCESS;
+    }
+};
+
+struct BenchmarkSequence : public Sequence
+{
+};
+
+Behavior& createBenchmarkTree(BehaviorTree& bt, const bench::Config& config, OffsetMode mode, size_t depth, size_t& leaves)
+{
+    if (depth == 0)
+    {
+        BenchmarkBehavior& leaf = bt.allocate<BenchmarkBehavior>();
+        leaf.m_iDuration = config.isRunningLeaf(leaves++) ? config.m_iRunningTicks : 1;
+        return leaf;
+    }
+
+    BenchmarkSequence& seq = bt.allocateComposite<BenchmarkSequence>(config.m_iBranching, mode);
+    for (size_t i=0; i<config.m_iBranching; ++i)
+    {
+        seq.addChild(createBenchmarkTree(bt, config, mode, depth - 1, leaves));
+    }
+    return seq;
+}
+
+// Children live at positive offsets from their parents, so the whole tree
+// goes in one chunk; 16-bit offsets are enough for small trees.
+size_t getBenchmarkTreeSize(const bench::Config& config)
+{
+    size_t nodeSize = sizeof(BenchmarkSequence) + config.m_iBranching * sizeof(uint32_t);
+    if (nodeSize < sizeof(BenchmarkBehavior))
+    {
+        nodeSize = sizeof(BenchmarkBehavior);
+    }
+    return config.getNodeCount() * (nodeSize + ALIGNOF(BenchmarkSequence));
+}
+
+BENCHMARK(StarterKit2, SyntheticTree)
+{
+    const bench::Config& config = benchmark.getConfig();
+
+    size_t treeSize = getBenchmarkTreeSize(config);
+    OffsetMode mode = treeSize > std::numeric_limits<uint16_t>::max() ? OFFSET_32 : OFFSET_16;
+
+    size_t leaves = 0;
+    benchmark.beginSetup();
+    BehaviorTree bt(treeSize);
+    Behavior& root = createBenchmarkTree(bt, config, mode, config.m_iDepth, leaves);
+    benchmark.endSetup(sizeof(bt));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        root.tick();
+    }
+    benchmark.endTicks();
+}
+
+// Resumed at the running leaves instead of descending from the root; try
+// a deep tree with long-running leaves, e.g. --depth 8 --duration 20.
+BENCHMARK(StarterKit2, ActivePath)
+{
+    const bench::Config& config = benchmark.getConfig();
+    size_t treeSize = getBenchmarkTreeSize(config);
+    OffsetMode mode = treeSize > std::numeric_limits<uint16_t>::max() ? OFFSET_32 : OFFSET_16;
+
+    size_t leaves = 0;
+    benchmark.beginSetup();
+    BehaviorTree bt(treeSize);
+    Behavior& root = createBenchmarkTree(bt, config, mode, config.m_iDepth, leaves);
+    ActivePath path(root);
+    benchmark.endSetup(sizeof(bt) + sizeof(path));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        path.tick();
+    }
+    benchmark.endTicks();
+}
+
+
+// The same tree and leaves as SyntheticTree, with the tagged nodes.
+struct BenchmarkTaggedLeaf : public TaggedLeaf
+{
+    size_t m_iDuration;
+    size_t m_iRemaining;
+
+    BenchmarkTaggedLeaf()
+    :	m_iDuration(1)
+    ,	m_iRemaining(0)
+    {
+    }
+
+    void onInitialize()
+    {
+        m_iRemaining = m_iDuration;
+    }
+
+    Status update()
+    {
+        return --m_iRemaining > 0 ? BH_RUNNING : BH_SUCCESS;
+    }
+};
+
+TaggedNode& createBenchmarkTaggedTree(TaggedTree& tree, const bench::Config& config, size_t depth, size_t& leaves)
+{
+    if (depth == 0)
+    {
+        BenchmarkTaggedLeaf& leaf = tree.allocateLeaf<BenchmarkTaggedLeaf>();
+        leaf.m_iDuration = config.isRunningLeaf(leaves++) ? config.m_iRunningTicks : 1;
+        return leaf;
+    }
+
+    TaggedComposite& seq = tree.allocateSequence(config.m_iBranching);
+    for (size_t i=0; i<config.m_iBranching; ++i)
+    {
+        seq.addChild(createBenchmarkTaggedTree(tree, config, depth - 1, leaves));
+    }
+    return seq;
+}
+
+BENCHMARK(StarterKit2, TaggedTree)
+{
+    const bench::Config& config = benchmark.getConfig();
+
+    size_t leaves = 0;
+    benchmark.beginSetup();
+    TaggedTree tree(getBenchmarkTreeSize(config));
+    tree.addLeafType<BenchmarkTaggedLeaf>();
+    TaggedNode& root = createBenchmarkTaggedTree(tree, config, config.m_iDepth, leaves);
+    benchmark.endSetup(sizeof(tree));
+
+    benchmark.beginTicks();
+    for (size_t i=0; i<benchmark.getTickCount(); ++i)
+    {
+        tree.tick(root);
+    }
+    benchmark.endTicks();
+}
+
 } // namespace bt3
@@ -7,8 +7,14 @@
  *****************************************************************************/
 
 #include <vector>
+#include <new>
+#include <type_traits>
 #include "Shared.h"
 #include "Test.h"
+#include "Benchmark.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "Metrics.h"
 
 namespace bt2
 {
@@ -87,6 +93,7 @@ public:
 
 		m_pNode = &node;
 		m_pTask = node.create();
+		m_eStatus = BH_INVALID;
 	}
 	void teardown()
 	{
@@ -102,15 +109,25 @@ public:
 
 	Status tick()
 	{
+		// Profiled per node, so the numbers add up across all agents.
 		if (m_eStatus == BH_INVALID)
 		{
+			PROFILE_INITIALIZE(m_pNode);
+			TRACE_INITIALIZE(m_pNode);
 			m_pTask->onInitialize();
 		}
 
+		PROFILE_UPDATE_BEGIN(m_pNode);
+		TRACE_UPDATE_BEGIN(m_pNode);
+		METRICS_ADD(COUNTER_NODE_UPDATES, 1);
 		m_eStatus = m_pTask->update();
+		PROFILE_UPDATE_END(m_pNode);
+		TRACE_UPDATE_END(m_pNode, m_eStatus);
 
 		if (m_eStatus != BH_RUNNING)
 		{
+			PROFILE_TERMINATE(m_pNode);
+			TRACE_TERMINATE(m_pNode, m_eStatus);
 			m_pTask->onTerminate(m_eStatus);
 		}
 
@@ -345,6 +362,20 @@ TEST(StarterKit3, SequenceTwoContinues)
 	CHECK_EQUAL(1, seq[0].m_iTerminateCalled);
 }
 
+TEST(StarterKit3, SequenceInitializesNextChild)
+{
+	MockSequence seq(2);
+	Behavior bh(seq);
+	bh.tick();
+
+	seq[0].m_eReturnStatus = BH_SUCCESS;
+	CHECK_EQUAL(bh.tick(), BH_RUNNING);
+
+	// The behavior reused for the next child starts out invalid again.
+	CHECK_EQUAL(1, seq[1].m_iInitializeCalled);
+	CHECK_EQUAL(1, seq[1].m_iUpdateCalled);
+}
+
 TEST(StarterKit3, SequenceOnePassThrough)
 {
 	Status status[2] = { BH_SUCCESS, BH_FAILURE };
@@ -451,4 +482,311 @@ TEST(StarterKit3, SelectorTwoSucceeds)
 	CHECK_EQUAL(1, sel[0].m_iTerminateCalled);
 }
 
+// ============================================================================
+
+const size_t k_TaskPoolBlockSize = 64;
+
+template <class TASK>
+class TaskPool
+/**
+ * Recycles the memory of one type of task through a free list.  Slots are
+ * allocated k_TaskPoolBlockSize at a time and only returned to the heap
+ * along with the pool.  A pool isn't thread-safe, so agents sharing one
+ * must be set up and torn down from a single thread.
+ */
+{
+public:
+	TaskPool(size_t blockSize = k_TaskPoolBlockSize)
+	:	m_pFree(NULL)
+	,	m_iBlockSize(blockSize)
+	,	m_iLiveCount(0)
+	{
+		ASSERT(blockSize > 0);
+	}
+
+	~TaskPool()
+	{
+		ASSERT(m_iLiveCount == 0);
+		for (size_t i=0; i<m_Blocks.size(); ++i)
+		{
+			delete [] m_Blocks[i];
+		}
+	}
+
+	template <class NODE>
+	TASK* create(NODE& node)
+	{
+		if (m_pFree == NULL)
+		{
+			addBlock();
+		}
+		Slot* slot = m_pFree;
+		m_pFree = slot->m_pNext;
+		++m_iLiveCount;
+		return new (slot) TASK(node);
+	}
+
+	void destroy(Task* task)
+	{
+		ASSERT(m_iLiveCount > 0);
+		// Find the slot while the task is still alive to cast from.
+		TASK* typed = static_cast<TASK*>(task);
+		Slot* slot = reinterpret_cast<Slot*>(typed);
+		typed->~TASK();
+		slot->m_pNext = m_pFree;
+		m_pFree = slot;
+		--m_iLiveCount;
+	}
+
+	// Make room for 'count' tasks ahead of time, e.g. before spawning agents.
+	void reserve(size_t count)
+	{
+		while (m_Blocks.size() * m_iBlockSize < count)
+		{
+			addBlock();
+		}
+	}
+
+	size_t getLiveCount() const
+	{
+		return m_iLiveCount;
+	}
+
+	size_t getBlockCount() const
+	{
+		return m_Blocks.size();
+	}
+
+private:
+	union Slot
+	{
+		Slot* m_pNext;
+		typename std::aligned_storage<sizeof(TASK), ALIGNOF(TASK)>::type m_Storage;
+	};
+
+	void addBlock()
+	{
+		Slot* block = new Slot[m_iBlockSize];
+		for (size_t i=0; i<m_iBlockSize; ++i)
+		{
+			block[i].m_pNext = i + 1 < m_iBlockSize ? &block[i + 1] : m_pFree;
+		}
+		m_pFree = block;
+		m_Blocks.push_back(block);
+	}
+
+	Slot* m_pFree;
+	std::vector<Slot*> m_Blocks;
+	size_t m_iBlockSize;
+	size_t m_iLiveCount;
+};
+
+template <class TASK, class BASE = Node>
+class PooledNode : public BASE
+/**
+ * A node that creates its tasks from its own pool.  Since the node is
+ * shared by every agent running it, spawning many agents costs a few
+ * block allocations per node rather than one per task.
+ */
+{
+public:
+	virtual Task* create()
+	{
+		return m_Pool.create(*this);
+	}
+
+	virtual void destroy(Task* task)
+	{
+		m_Pool.destroy(task);
+	}
+
+	TaskPool<TASK>& getPool()
+	{
+		return m_Pool;
+	}
+
+protected:
+	TaskPool<TASK> m_Pool;
+};
+
+// ----------------------------------------------------------------------------
+
+TEST(StarterKit3, TaskPoolReusesSlots)
+{
+	MockNode n;
+	TaskPool<MockTask> pool(2);
+
+	MockTask* a = pool.create(n);
+	MockTask* b = pool.create(n);
+	CHECK_EQUAL(1u, pool.getBlockCount());
+	CHECK_EQUAL(2u, pool.getLiveCount());
+
+	pool.destroy(a);
+	MockTask* c = pool.create(n);
+	CHECK(c == a);
+	CHECK_EQUAL(0, c->m_iUpdateCalled);
+
+	MockTask* d = pool.create(n);
+	CHECK_EQUAL(2u, pool.getBlockCount());
+
+	pool.destroy(b);
+	pool.destroy(c);
+	pool.destroy(d);
+	CHECK_EQUAL(0u, pool.getLiveCount());
+
+	pool.reserve(10);
+	CHECK_EQUAL(5u, pool.getBlockCount());
+}
+
+TEST(StarterKit3, PooledNodesShareBlocks)
+{
+	const size_t k_AgentCount = 100;
+	PooledNode<MockTask> action;
+	PooledNode<Sequence, Composite> seq;
+	seq.m_Children.push_back(&action);
+	seq.m_Children.push_back(&action);
+
+	{
+		std::vector<Behavior> agents(k_AgentCount);
+		for (size_t i=0; i<k_AgentCount; ++i)
+		{
+			agents[i].setup(seq);
+			CHECK_EQUAL(BH_RUNNING, agents[i].tick());
+		}
+		CHECK_EQUAL(k_AgentCount, seq.getPool().getLiveCount());
+		CHECK_EQUAL(k_AgentCount, action.getPool().getLiveCount());
+		CHECK_EQUAL(2u, seq.getPool().getBlockCount());
+	}
+	CHECK_EQUAL(0u, seq.getPool().getLiveCount());
+	CHECK_EQUAL(0u, action.getPool().getLiveCount());
+}
+
+// ============================================================================
+
+struct BenchmarkLeaf : public Node
+{
+	size_t m_iDuration;
+
+	BenchmarkLeaf()
+	:	m_iDuration(1)
+	{
+	}
+};
+
+struct BenchmarkTask : public Task
+{
+	size_t m_iDuration;
+	size_t m_iRemaining;
+
+	BenchmarkTask(BenchmarkLeaf& node)
+	:	Task(node)
+	,	m_iDuration(node.m_iDuration)
+	,	m_iRemaining(0)
+	{
+	}
+
+	virtual void onInitialize()
+	{
+		m_iRemaining = m_iDuration;
+	}
+
+	virtual Status update()
+	{
+		return --m_iRemaining > 0 ? BH_RUNNING : BH_SUCCESS;
+	}
+};
+
+struct BenchmarkNode : public BenchmarkLeaf
+{
+	virtual Task* create()
+	{
+		return new BenchmarkTask(*this);
+	}
+
+	virtual void destroy(Task* task)
+	{
+		delete task;
+	}
+};
+
+struct BenchmarkComposite : public Composite
+{
+	virtual Task* create()
+	{
+		return new Sequence(*this);
+	}
+
+	virtual void destroy(Task* task)
+	{
+		delete task;
+	}
+};
+
+template <class LEAF, class COMPOSITE>
+Node* createBenchmarkTree(const bench::Config& config, size_t depth, size_t& leaves, Nodes& nodes)
+{
+	Node* node;
+	if (depth == 0)
+	{
+		LEAF* leaf = new LEAF;
+		leaf->m_iDuration = config.isRunningLeaf(leaves++) ? config.m_iRunningTicks : 1;
+		node = leaf;
+	}
+	else
+	{
+		COMPOSITE* composite = new COMPOSITE;
+		for (size_t i=0; i<config.m_iBranching; ++i)
+		{
+			composite->m_Children.push_back(createBenchmarkTree<LEAF, COMPOSITE>(config, depth - 1, leaves, nodes));
+		}
+		node = composite;
+	}
+	nodes.push_back(node);
+	return node;
+}
+
+template <class LEAF, class COMPOSITE>
+void runBenchmark(bench::Benchmark& benchmark)
+{
+	const bench::Config& config = benchmark.getConfig();
+	Nodes nodes;
+	nodes.reserve(config.getNodeCount());
+	size_t leaves = 0;
+
+	// The node graph is shared by all agents, so only the behavior and the
+	// tasks it creates while running count towards the cost of an agent.
+	Node* root = createBenchmarkTree<LEAF, COMPOSITE>(config, config.m_iDepth, leaves, nodes);
+	{
+		benchmark.beginSetup();
+		Behavior bh(*root);
+		benchmark.endSetup(sizeof(bh));
+
+		benchmark.beginTicks();
+		for (size_t i=0; i<benchmark.getTickCount(); ++i)
+		{
+			if (bh.tick() != BH_RUNNING)
+			{
+				bh.setup(*root);
+			}
+		}
+		benchmark.endTicks();
+	}
+
+	for (size_t i=0; i<nodes.size(); ++i)
+	{
+		delete nodes[i];
+	}
+}
+
+BENCHMARK(StarterKit3, SyntheticTree)
+{
+	runBenchmark<BenchmarkNode, BenchmarkComposite>(benchmark);
+}
+
+// Bytes per agent include a first block in each node's pool.
+BENCHMARK(StarterKit3, PooledTree)
+{
+	runBenchmark<PooledNode<BenchmarkTask, BenchmarkLeaf>, PooledNode<Sequence, Composite> >(benchmark);
+}
+
 } // namespace bt2
@@ -0,0 +1,158 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#include <type_traits>
+#include "BehaviorTreeStatic.h"
+#include "Test.h"
+
+namespace bt6
+{
+
+// ============================================================================
+
+struct MockContext
+{
+    int m_iHealth;
+    Status m_eReturnStatus;
+    int m_iUpdateCalled;
+
+    MockContext()
+    :	m_iHealth(100)
+    ,	m_eReturnStatus(BH_RUNNING)
+    ,	m_iUpdateCalled(0)
+    {
+    }
+};
+
+struct IsHealthy
+{
+    bool operator()(MockContext& context) const
+    {
+        return context.m_iHealth > 50;
+    }
+};
+
+struct MockAction
+{
+    int m_iInitializeCalled;
+    int m_iTerminateCalled;
+    int m_iUpdateCalled;
+    Status m_eReturnStatus;
+    Status m_eTerminateStatus;
+
+    MockAction()
+    :	m_iInitializeCalled(0)
+    ,	m_iTerminateCalled(0)
+    ,	m_iUpdateCalled(0)
+    ,	m_eReturnStatus(BH_RUNNING)
+    ,	m_eTerminateStatus(BH_INVALID)
+    {
+    }
+
+    void onInitialize(MockContext&)
+    {
+        ++m_iInitializeCalled;
+    }
+
+    void onTerminate(MockContext&, Status s)
+    {
+        ++m_iTerminateCalled;
+        m_eTerminateStatus = s;
+    }
+
+    Status update(MockContext&)
+    {
+        ++m_iUpdateCalled;
+        return m_eReturnStatus;
+    }
+};
+
+// Driven by the context, so the status can be changed from outside a tree.
+struct ContextAction : public ActionBase
+{
+    Status update(MockContext& context)
+    {
+        ++context.m_iUpdateCalled;
+        return context.m_eReturnStatus;
+    }
+};
+
+TEST(StarterKit6, ActionLifecycle)
+{
+    MockContext context;
+    Action<MockAction> action;
+
+    CHECK_EQUAL(BH_RUNNING, action.tick(context));
+    CHECK_EQUAL(1, action.get().m_iInitializeCalled);
+    CHECK_EQUAL(0, action.get().m_iTerminateCalled);
+
+    action.get().m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, action.tick(context));
+    CHECK_EQUAL(1, action.get().m_iInitializeCalled);
+    CHECK_EQUAL(1, action.get().m_iTerminateCalled);
+    CHECK_EQUAL(2, action.get().m_iUpdateCalled);
+}
+
+TEST(StarterKit6, SequenceTwoContinues)
+{
+    MockContext context;
+    Sequence<Action<MockAction>, Action<MockAction> > seq;
+
+    CHECK_EQUAL(BH_RUNNING, seq.tick(context));
+    CHECK_EQUAL(0, seq.getChild<1>().get().m_iInitializeCalled);
+
+    seq.getChild<0>().get().m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_RUNNING, seq.tick(context));
+    CHECK_EQUAL(1, seq.getChild<0>().get().m_iTerminateCalled);
+    CHECK_EQUAL(1, seq.getChild<1>().get().m_iInitializeCalled);
+
+    seq.getChild<1>().get().m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_FAILURE, seq.tick(context));
+    CHECK_EQUAL(2, seq.getChild<0>().get().m_iUpdateCalled);
+}
+
+TEST(StarterKit6, SelectorWithCondition)
+{
+    typedef Selector<Sequence<Condition<IsHealthy>, Action<MockAction> >, Action<ContextAction> > Combat;
+    CHECK(!std::is_polymorphic<Combat>::value);
+
+    MockContext context;
+    Combat combat;
+    MockAction& attack = combat.getChild<0>().getChild<1>().get();
+
+    CHECK_EQUAL(BH_RUNNING, combat.tick(context));
+    CHECK_EQUAL(1, attack.m_iUpdateCalled);
+    CHECK_EQUAL(0, context.m_iUpdateCalled);
+
+    attack.m_eReturnStatus = BH_FAILURE;
+    CHECK_EQUAL(BH_RUNNING, combat.tick(context));
+    CHECK_EQUAL(1, context.m_iUpdateCalled);
+
+    context.m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, combat.tick(context));
+
+    context.m_iHealth = 10;
+    CHECK_EQUAL(BH_SUCCESS, combat.tick(context));
+    CHECK_EQUAL(2, attack.m_iUpdateCalled);
+    CHECK_EQUAL(3, context.m_iUpdateCalled);
+    CHECK_EQUAL(BH_FAILURE, combat.getChild<0>().getChild<0>().getStatus());
+}
+
+TEST(StarterKit6, RepeatCounts)
+{
+    MockContext context;
+    Repeat<3, Action<MockAction> > repeat;
+
+    CHECK_EQUAL(BH_RUNNING, repeat.tick(context));
+    repeat.getChild().get().m_eReturnStatus = BH_SUCCESS;
+    CHECK_EQUAL(BH_SUCCESS, repeat.tick(context));
+    CHECK_EQUAL(3, repeat.getChild().get().m_iTerminateCalled);
+    CHECK_EQUAL(4, repeat.getChild().get().m_iUpdateCalled);
+}
+
+} // namespace bt6
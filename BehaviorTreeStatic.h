@@ -0,0 +1,262 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#ifndef BEHAVIORTREESTATIC_H
+#define BEHAVIORTREESTATIC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tuple>
+#include "Shared.h"
+
+namespace bt6
+{
+
+// ============================================================================
+// Trees composed at compile time, e.g.
+//
+//      typedef Selector<Sequence<Condition<IsHealthy>, Action<Attack> >,
+//                       Action<Flee> > Combat;
+//
+// The whole tree is a single type; every node keeps its status inline, so
+// a tree instance is one small object and tick() has no virtual calls.
+// Leaves receive a caller-defined context, typically the agent.
+
+enum Status
+{
+    BH_INVALID,
+    BH_SUCCESS,
+    BH_FAILURE,
+    BH_RUNNING,
+};
+
+struct ActionBase
+/**
+ * Optional base for actions that don't need initialize/terminate hooks.
+ */
+{
+    template <class CONTEXT>
+    void onInitialize(CONTEXT&) {}
+
+    template <class CONTEXT>
+    void onTerminate(CONTEXT&, Status) {}
+};
+
+// ----------------------------------------------------------------------------
+
+template <class CONDITION>
+class Condition
+/**
+ * Leaf wrapping a predicate: bool CONDITION::operator()(CONTEXT&).
+ */
+{
+public:
+    Condition()
+    :	m_eStatus(BH_INVALID)
+    {
+    }
+
+    template <class CONTEXT>
+    Status tick(CONTEXT& context)
+    {
+        m_eStatus = static_cast<uint8_t>(m_Condition(context) ? BH_SUCCESS : BH_FAILURE);
+        return getStatus();
+    }
+
+    Status getStatus() const
+    {
+        return static_cast<Status>(m_eStatus);
+    }
+
+protected:
+    CONDITION m_Condition;
+    uint8_t m_eStatus;
+};
+
+template <class ACTION>
+class Action
+/**
+ * Leaf wrapping ACTION::update(CONTEXT&), plus onInitialize(CONTEXT&) and
+ * onTerminate(CONTEXT&, Status) which ActionBase provides empty.
+ */
+{
+public:
+    Action()
+    :	m_eStatus(BH_INVALID)
+    {
+    }
+
+    template <class CONTEXT>
+    Status tick(CONTEXT& context)
+    {
+        if (m_eStatus != BH_RUNNING)
+        {
+            m_Action.onInitialize(context);
+        }
+
+        Status s = m_Action.update(context);
+        m_eStatus = static_cast<uint8_t>(s);
+
+        if (s != BH_RUNNING)
+        {
+            m_Action.onTerminate(context, s);
+        }
+        return s;
+    }
+
+    Status getStatus() const
+    {
+        return static_cast<Status>(m_eStatus);
+    }
+
+    ACTION& get()
+    {
+        return m_Action;
+    }
+
+protected:
+    ACTION m_Action;
+    uint8_t m_eStatus;
+};
+
+// ----------------------------------------------------------------------------
+
+namespace detail
+{
+    // Ticks the children of a composite from 'current' onwards, for as long
+    // as they return PROCEED.  Unrolled into a chain of inlined branches.
+    template <Status PROCEED, size_t I, size_t N>
+    struct TickFrom
+    {
+        template <class CHILDREN, class CONTEXT>
+        static Status tick(CHILDREN& children, uint8_t& current, CONTEXT& context)
+        {
+            if (current == I)
+            {
+                Status s = std::get<I>(children).tick(context);
+                if (s != PROCEED)
+                {
+                    return s;
+                }
+                ++current;
+            }
+            return TickFrom<PROCEED, I + 1, N>::tick(children, current, context);
+        }
+    };
+
+    template <Status PROCEED, size_t N>
+    struct TickFrom<PROCEED, N, N>
+    {
+        template <class CHILDREN, class CONTEXT>
+        static Status tick(CHILDREN&, uint8_t&, CONTEXT&)
+        {
+            return PROCEED;
+        }
+    };
+}
+
+template <Status PROCEED, class... CHILDREN>
+class Composite
+{
+public:
+    Composite()
+    :	m_iCurrent(0)
+    ,	m_eStatus(BH_INVALID)
+    {
+    }
+
+    template <class CONTEXT>
+    Status tick(CONTEXT& context)
+    {
+        if (m_eStatus != BH_RUNNING)
+        {
+            m_iCurrent = 0;
+        }
+
+        Status s = detail::TickFrom<PROCEED, 0, sizeof...(CHILDREN)>::tick(m_Children, m_iCurrent, context);
+        m_eStatus = static_cast<uint8_t>(s);
+        return s;
+    }
+
+    Status getStatus() const
+    {
+        return static_cast<Status>(m_eStatus);
+    }
+
+    template <size_t I>
+    typename std::tuple_element<I, std::tuple<CHILDREN...> >::type& getChild()
+    {
+        return std::get<I>(m_Children);
+    }
+
+protected:
+    std::tuple<CHILDREN...> m_Children;
+    uint8_t m_iCurrent;
+    uint8_t m_eStatus;
+};
+
+template <class... CHILDREN>
+class Sequence : public Composite<BH_SUCCESS, CHILDREN...>
+{
+};
+
+template <class... CHILDREN>
+class Selector : public Composite<BH_FAILURE, CHILDREN...>
+{
+};
+
+// ----------------------------------------------------------------------------
+
+template <int COUNT, class CHILD>
+class Repeat
+{
+public:
+    Repeat()
+    :	m_iCounter(0)
+    ,	m_eStatus(BH_INVALID)
+    {
+    }
+
+    template <class CONTEXT>
+    Status tick(CONTEXT& context)
+    {
+        if (m_eStatus != BH_RUNNING)
+        {
+            m_iCounter = 0;
+        }
+
+        Status s;
+        for (;;)
+        {
+            s = m_Child.tick(context);
+            if (s == BH_RUNNING  ||  s == BH_FAILURE) break;
+            if (++m_iCounter == COUNT) break;
+        }
+        m_eStatus = static_cast<uint8_t>(s);
+        return s;
+    }
+
+    Status getStatus() const
+    {
+        return static_cast<Status>(m_eStatus);
+    }
+
+    CHILD& getChild()
+    {
+        return m_Child;
+    }
+
+protected:
+    CHILD m_Child;
+    int m_iCounter;
+    uint8_t m_eStatus;
+};
+
+} // namespace bt6
+
+#endif // BEHAVIORTREESTATIC_H
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <new>
+#include "Benchmark.h"
+
+using namespace bench;
+
+void* operator new(size_t size)
+{
+    ++allocationCount();
+    allocatedBytes() += size;
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+// Called instead of the one above for objects of known size since C++14.
+void operator delete(void* p, size_t) throw()
+{
+    operator delete(p);
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void* p) throw()
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) throw()
+{
+    operator delete(p);
+}
+
+int main(int argc, char* argv[])
+{
+    Config config;
+    std::string filter;
+
+    for (int i=1; i+1<argc; i+=2)
+    {
+        if (strcmp(argv[i], "--depth") == 0)            config.m_iDepth = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--branching") == 0)   config.m_iBranching = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--running") == 0)     config.m_fRunningRatio = (float)atof(argv[i+1]);
+        else if (strcmp(argv[i], "--duration") == 0)    config.m_iRunningTicks = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--ticks") == 0)       config.m_iTicks = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--filter") == 0)      filter = argv[i+1];
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--depth N] [--branching N] [--running RATIO]"
+                      << " [--duration TICKS] [--ticks N] [--filter NAME]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "depth " << config.m_iDepth << ", branching " << config.m_iBranching
+              << ", running " << config.m_fRunningRatio << " x " << config.m_iRunningTicks
+              << " ticks, " << config.m_iTicks << " ticks per run" << std::endl;
+
+    BenchmarkSuite::getInstance().runAllBenchmarks(config, filter);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "Shared.h"
+
+namespace bench
+{
+    // Updated by the global operator new in Benchmark.cpp.  Builds without
+    // that file, like the test runner, simply report no allocations.
+    inline size_t& allocationCount()
+    {
+        static size_t count = 0;
+        return count;
+    }
+
+    inline size_t& allocatedBytes()
+    {
+        static size_t bytes = 0;
+        return bytes;
+    }
+
+    struct Config
+    /**
+     * Shape of the synthetic trees: composites down to m_iDepth levels with
+     * m_iBranching children each, where m_fRunningRatio of the leaves stay
+     * running for m_iRunningTicks ticks and the others succeed immediately.
+     */
+    {
+        size_t m_iDepth;
+        size_t m_iBranching;
+        float m_fRunningRatio;
+        size_t m_iRunningTicks;
+        size_t m_iTicks;
+
+        Config()
+        :   m_iDepth(4)
+        ,   m_iBranching(4)
+        ,   m_fRunningRatio(0.25f)
+        ,   m_iRunningTicks(3)
+        ,   m_iTicks(100000)
+        {
+        }
+
+        size_t getNodeCount() const
+        {
+            size_t count = 0, level = 1;
+            for (size_t i=0; i<=m_iDepth; ++i, level *= m_iBranching)
+            {
+                count += level;
+            }
+            return count;
+        }
+
+        // Spreads the running leaves evenly over the leaf indices.
+        bool isRunningLeaf(size_t index) const
+        {
+            return (size_t)((index + 1) * m_fRunningRatio) > (size_t)(index * m_fRunningRatio);
+        }
+    };
+
+    class Benchmark
+    {
+    public:
+        typedef std::chrono::high_resolution_clock Clock;
+
+        Benchmark(const Config& config)
+        :   m_Config(config)
+        ,   m_iSetupBytes(0)
+        ,   m_iTickAllocations(0)
+        ,   m_fNanoseconds(0.0)
+        ,   m_iBytesPerAgent(0)
+        ,   m_pSkipped(NULL)
+        {
+        }
+
+        // For tree shapes an implementation can't represent.
+        void skip(const char* reason)
+        {
+            m_pSkipped = reason;
+        }
+
+        const char* getSkipped() const
+        {
+            return m_pSkipped;
+        }
+
+        const Config& getConfig() const
+        {
+            return m_Config;
+        }
+
+        size_t getTickCount() const
+        {
+            return m_Config.m_iTicks;
+        }
+
+        // For benchmarks doing far more work per tick than the others, so
+        // the whole suite still runs in reasonable time.
+        void setTickCount(size_t ticks)
+        {
+            ASSERT(ticks > 0);
+            m_Config.m_iTicks = ticks;
+        }
+
+        void beginSetup()
+        {
+            m_iSetupBytes = allocatedBytes();
+        }
+
+        // Objects that live outside the heap, like a root on the stack, can
+        // be accounted for with 'extraBytes'.
+        void endSetup(size_t extraBytes = 0)
+        {
+            m_iBytesPerAgent = allocatedBytes() - m_iSetupBytes + extraBytes;
+        }
+
+        void beginTicks()
+        {
+            m_iTickAllocations = allocationCount();
+            m_Start = Clock::now();
+        }
+
+        void endTicks()
+        {
+            Clock::time_point end = Clock::now();
+            m_fNanoseconds = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_Start).count();
+            m_iTickAllocations = allocationCount() - m_iTickAllocations;
+        }
+
+        double getNanosecondsPerTick() const
+        {
+            return m_fNanoseconds / (double)m_Config.m_iTicks;
+        }
+
+        double getAllocationsPerTick() const
+        {
+            return (double)m_iTickAllocations / (double)m_Config.m_iTicks;
+        }
+
+        size_t getBytesPerAgent() const
+        {
+            return m_iBytesPerAgent;
+        }
+
+    private:
+        Config m_Config;
+        size_t m_iSetupBytes;
+        size_t m_iTickAllocations;
+        Clock::time_point m_Start;
+        double m_fNanoseconds;
+        size_t m_iBytesPerAgent;
+        const char* m_pSkipped;
+    };
+
+    typedef void (*BenchmarkFunction)(Benchmark&);
+
+    class BenchmarkSuite
+    {
+    private:
+        typedef std::pair<std::string, BenchmarkFunction> RegisteredBenchmark;
+        typedef std::vector<RegisteredBenchmark> RegisteredBenchmarks;
+
+    public:
+        void registerBenchmark(const std::string& name, BenchmarkFunction function)
+        {
+            m_benchmarks.push_back(RegisteredBenchmark(name, function));
+        }
+
+        // Runs every benchmark whose name contains 'filter'.
+        void runAllBenchmarks(const Config& config, const std::string& filter = "")
+        {
+            std::cout << std::left << std::setw(40) << "benchmark"
+                      << std::right << std::setw(14) << "ns/tick"
+                      << std::setw(14) << "allocs/tick"
+                      << std::setw(14) << "bytes/agent" << std::endl;
+
+            for (RegisteredBenchmarks::const_iterator b = m_benchmarks.begin(); b != m_benchmarks.end(); ++b)
+            {
+                if (b->first.find(filter) == std::string::npos)
+                {
+                    continue;
+                }
+
+                Benchmark benchmark(config);
+                b->second(benchmark);
+
+                std::cout << std::left << std::setw(40) << b->first;
+                if (benchmark.getSkipped() != NULL)
+                {
+                    std::cout << "skipped: " << benchmark.getSkipped() << std::endl << std::flush;
+                    continue;
+                }
+                std::cout
+                          << std::right << std::fixed << std::setprecision(2)
+                          << std::setw(14) << benchmark.getNanosecondsPerTick()
+                          << std::setw(14) << benchmark.getAllocationsPerTick()
+                          << std::setw(14) << benchmark.getBytesPerAgent() << std::endl << std::flush;
+            }
+        }
+
+        static BenchmarkSuite& getInstance()
+        {
+            static BenchmarkSuite instance;
+            return instance;
+        }
+
+    private:
+        RegisteredBenchmarks m_benchmarks;
+    };
+
+    class AutoBenchmarkRegister
+    {
+    public:
+        AutoBenchmarkRegister(const std::string& name, BenchmarkFunction function)
+        {
+            BenchmarkSuite::getInstance().registerBenchmark(name, function);
+        }
+    };
+}
+
+#define BENCHMARK(SUITENAME, BENCHNAME)                       \
+    void SUITENAME##_##BENCHNAME##_Benchmark(bench::Benchmark&); \
+    static bench::AutoBenchmarkRegister autoBenchmarkRegister_##SUITENAME##_##BENCHNAME(#SUITENAME "_" #BENCHNAME, SUITENAME##_##BENCHNAME##_Benchmark); \
+    void SUITENAME##_##BENCHNAME##_Benchmark(bench::Benchmark& benchmark)
+
+#endif // BENCHMARK_H
@@ -0,0 +1,244 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#ifndef BLACKBOARD_H
+#define BLACKBOARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Shared.h"
+
+namespace blackboard
+{
+
+// ============================================================================
+// Per-agent data shared by the behaviors of a tree.  Entries are declared
+// by name on a Layout while the trees are built, which hands out typed
+// keys holding the entry's byte offset.  Each agent's Blackboard is then a
+// single flat block, so reading an entry on the hot path is one indexed
+// load with no string or hash lookup.  Every entry also has a version that
+// set() bumps when the value changes; bt1::Condition takes these as inputs.
+
+template <class T>
+struct Key
+/**
+ * Typed handle to an entry, resolved once by Layout::add().
+ */
+{
+    uint32_t m_iOffset;         // Byte offset of the value within the block.
+    uint32_t m_iIndex;          // Index of the entry, and of its version.
+};
+
+class Layout
+/**
+ * Names, types and positions of the entries in every blackboard created
+ * from it.  Finish adding entries before creating any blackboards.  Values
+ * must be plain data since blocks are cleared and copied as raw memory.
+ */
+{
+public:
+    Layout()
+    :	m_iValueBytes(0)
+    ,	m_iAlignment(ALIGNOF(uint32_t))
+    {
+    }
+
+    // Adding a name twice returns the key of the existing entry.
+    template <class T>
+    Key<T> add(const std::string& name)
+    {
+        Key<T> key;
+        for (size_t i=0; i<m_Entries.size(); ++i)
+        {
+            if (m_Entries[i].m_Name == name)
+            {
+                ASSERT(m_Entries[i].m_pType == getType<T>());
+                key.m_iOffset = (uint32_t)m_Entries[i].m_iOffset;
+                key.m_iIndex = (uint32_t)i;
+                return key;
+            }
+        }
+
+        size_t alignment = ALIGNOF(T);
+        m_iValueBytes = (m_iValueBytes + alignment - 1) & ~(alignment - 1);
+        if (alignment > m_iAlignment)
+        {
+            m_iAlignment = alignment;
+        }
+
+        Entry entry = { name, getType<T>(), m_iValueBytes };
+        m_Entries.push_back(entry);
+        m_iValueBytes += sizeof(T);
+
+        key.m_iOffset = (uint32_t)entry.m_iOffset;
+        key.m_iIndex = (uint32_t)(m_Entries.size() - 1);
+        return key;
+    }
+
+    // Build-time lookup of an entry added elsewhere; false if it's missing
+    // or has another type.
+    template <class T>
+    bool find(const std::string& name, Key<T>& key) const
+    {
+        for (size_t i=0; i<m_Entries.size(); ++i)
+        {
+            if (m_Entries[i].m_Name == name  &&  m_Entries[i].m_pType == getType<T>())
+            {
+                key.m_iOffset = (uint32_t)m_Entries[i].m_iOffset;
+                key.m_iIndex = (uint32_t)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t getEntryCount() const
+    {
+        return m_Entries.size();
+    }
+
+    // Values come first, followed by one 32-bit version per entry.
+    size_t getVersionOffset() const
+    {
+        return (m_iValueBytes + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+    }
+
+    size_t getBlockSize() const
+    {
+        size_t size = getVersionOffset() + m_Entries.size() * sizeof(uint32_t);
+        return (size + m_iAlignment - 1) & ~(m_iAlignment - 1);
+    }
+
+    size_t getAlignment() const
+    {
+        return m_iAlignment;
+    }
+
+protected:
+    struct Entry
+    {
+        std::string m_Name;
+        const void* m_pType;
+        size_t m_iOffset;
+    };
+
+    // One unique address per type, without needing RTTI.
+    template <class T>
+    static const void* getType()
+    {
+        static const char s_Type = 0;
+        return &s_Type;
+    }
+
+    std::vector<Entry> m_Entries;
+    size_t m_iValueBytes;
+    size_t m_iAlignment;
+};
+
+// ----------------------------------------------------------------------------
+
+class Blackboard
+/**
+ * One agent's entries.  It either owns its block or uses memory provided
+ * by the caller, such as a bt3 arena, which must hold getBlockSize() bytes
+ * aligned to getAlignment().  Entries start out zeroed.
+ */
+{
+public:
+    Blackboard(const Layout& layout)
+    :	m_pData(new char[layout.getBlockSize()])
+    ,	m_iSize(layout.getBlockSize())
+    ,	m_iEntryCount(layout.getEntryCount())
+    ,	m_bOwned(true)
+    {
+        ASSERT(layout.getAlignment() <= ALIGNOF(double));
+        initialize(layout);
+    }
+
+    Blackboard(const Layout& layout, void* memory)
+    :	m_pData(static_cast<char*>(memory))
+    ,	m_iSize(layout.getBlockSize())
+    ,	m_iEntryCount(layout.getEntryCount())
+    ,	m_bOwned(false)
+    {
+        ASSERT(((uintptr_t)memory & (layout.getAlignment() - 1)) == 0);
+        initialize(layout);
+    }
+
+    ~Blackboard()
+    {
+        if (m_bOwned)
+        {
+            delete [] m_pData;
+        }
+    }
+
+    template <class T>
+    const T& get(Key<T> key) const
+    {
+        return *reinterpret_cast<const T*>(m_pData + key.m_iOffset);
+    }
+
+    // Writing the value an entry already has leaves its version alone, so
+    // conditions that depend on it keep their cached result.
+    template <class T>
+    void set(Key<T> key, const T& value)
+    {
+        T& current = *reinterpret_cast<T*>(m_pData + key.m_iOffset);
+        if (!(current == value))
+        {
+            current = value;
+            ++m_pVersions[key.m_iIndex];
+        }
+    }
+
+    template <class T>
+    const uint32_t* getVersion(Key<T> key) const
+    {
+        return &m_pVersions[key.m_iIndex];
+    }
+
+    // Zero all the values; versions are bumped rather than reset so that
+    // nothing cached before can be mistaken for current.
+    void clear()
+    {
+        memset(m_pData, 0, (char*)m_pVersions - m_pData);
+        for (size_t i=0; i<m_iEntryCount; ++i)
+        {
+            ++m_pVersions[i];
+        }
+    }
+
+    size_t getSize() const
+    {
+        return m_iSize;
+    }
+
+private:
+    Blackboard(const Blackboard&);
+    Blackboard& operator=(const Blackboard&);
+
+    void initialize(const Layout& layout)
+    {
+        memset(m_pData, 0, m_iSize);
+        m_pVersions = reinterpret_cast<uint32_t*>(m_pData + layout.getVersionOffset());
+    }
+
+    char* m_pData;
+    uint32_t* m_pVersions;
+    size_t m_iSize;
+    size_t m_iEntryCount;
+    bool m_bOwned;
+};
+
+} // namespace blackboard
+
+#endif // BLACKBOARD_H
@@ -0,0 +1,57 @@
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "BehaviorTreeImage.h"
+
+// Converts trees from the text form described in BehaviorTreeImage.h into
+// binary images that can be memory-mapped and instantiated at load time.
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        std::cerr << "usage: " << argv[0] << " INPUT.txt OUTPUT.bti" << std::endl;
+        return 1;
+    }
+
+    std::ifstream input(argv[1]);
+    if (!input)
+    {
+        std::cerr << argv[1] << ": cannot open file" << std::endl;
+        return 1;
+    }
+    std::stringstream text;
+    text << input.rdbuf();
+
+    image::ImageBuilder builder;
+    std::string error;
+    if (!image::parse(text.str(), builder, error))
+    {
+        std::cerr << argv[1] << ": " << error << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    builder.write(data);
+
+    // Catch anything the builder got wrong before it ships in a build.
+    image::Image img(&data[0], data.size());
+    if (!img.isValid())
+    {
+        std::cerr << argv[1] << ": produced an invalid image" << std::endl;
+        return 1;
+    }
+
+    std::ofstream output(argv[2], std::ios::binary);
+    output.write(reinterpret_cast<const char*>(&data[0]), data.size());
+    if (!output)
+    {
+        std::cerr << argv[2] << ": cannot write file" << std::endl;
+        return 1;
+    }
+
+    std::cout << argv[2] << ": " << img.getNodeCount() << " nodes, "
+              << img.getTypeCount() << " types, " << data.size() << " bytes" << std::endl;
+    return 0;
+}
@@ -0,0 +1,229 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#ifndef LODSCHEDULER_H
+#define LODSCHEDULER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include "Shared.h"
+
+namespace lod
+{
+
+// ============================================================================
+// Level-of-detail ticking for any tree type with a tick() member, such as a
+// bt1 root Behavior, a bt4 BehaviorTree or a bt5 BatchedTree.  Each tree is
+// ticked once every 'period' frames; trees sharing a period are staggered
+// over different frames so they don't all land on the same one.  A frame
+// stops ticking trees once its budget is spent, and the trees it didn't get
+// to go first on the next frame.
+
+struct TreeStats
+{
+    uint32_t m_iTickCount;
+    uint32_t m_iDeferCount;     // Frames the tree was due but missed the budget.
+    uint32_t m_iMaxLateness;    // Most frames it was ever ticked late.
+};
+
+struct FrameStats
+{
+    size_t m_iTicked;
+    size_t m_iDeferred;         // Trees due this frame left for the next.
+    uint64_t m_iElapsed;        // Nanoseconds spent ticking.
+};
+
+class LodScheduler
+/**
+ * Runs once per frame on the calling thread.  Trees are only referenced,
+ * and must be removed before they are destroyed.
+ */
+{
+public:
+    typedef size_t Handle;
+    typedef uint64_t (*Clock)();    // Nanoseconds.
+
+    LodScheduler()
+    :	m_iFrame(0)
+    ,	m_iBudget(0)
+    ,	m_pClock(&now)
+    {
+        FrameStats empty = { 0, 0, 0 };
+        m_LastFrame = empty;
+    }
+
+    template <class TREE>
+    Handle add(TREE& tree, uint32_t period = 1)
+    {
+        ASSERT(period > 0);
+        Entry entry;
+        entry.m_pTree = &tree;
+        entry.m_pTick = &tickTree<TREE>;
+        entry.m_iPeriod = period;
+        // Stagger new trees so equal periods spread over the frames.
+        entry.m_iDueFrame = m_iFrame + m_Entries.size() % period;
+        TreeStats stats = { 0, 0, 0 };
+        entry.m_Stats = stats;
+
+        for (size_t i=0; i<m_Entries.size(); ++i)
+        {
+            if (m_Entries[i].m_pTree == NULL)
+            {
+                m_Entries[i] = entry;
+                return i;
+            }
+        }
+        m_Entries.push_back(entry);
+        return m_Entries.size() - 1;
+    }
+
+    void remove(Handle handle)
+    {
+        ASSERT(handle < m_Entries.size()  &&  m_Entries[handle].m_pTree != NULL);
+        m_Entries[handle].m_pTree = NULL;
+    }
+
+    // Typically derived from the agent's priority or distance to the camera.
+    // A shorter period brings the next tick forward if it was further away.
+    void setPeriod(Handle handle, uint32_t period)
+    {
+        ASSERT(handle < m_Entries.size()  &&  period > 0);
+        Entry& entry = m_Entries[handle];
+        entry.m_iPeriod = period;
+        if (entry.m_iDueFrame > m_iFrame + period)
+        {
+            entry.m_iDueFrame = m_iFrame + period;
+        }
+    }
+
+    uint32_t getPeriod(Handle handle) const
+    {
+        ASSERT(handle < m_Entries.size());
+        return m_Entries[handle].m_iPeriod;
+    }
+
+    // Nanoseconds of ticking allowed per frame, or zero for no limit.  At
+    // least one due tree is ticked each frame, so nothing starves.
+    void setBudget(uint64_t nanoseconds)
+    {
+        m_iBudget = nanoseconds;
+    }
+
+    void setClock(Clock clock)
+    {
+        m_pClock = clock;
+    }
+
+    void tick()
+    {
+        // Most overdue first, which puts trees deferred by the previous
+        // frame ahead of those only due now; ties keep the adding order.
+        m_Due.clear();
+        for (size_t i=0; i<m_Entries.size(); ++i)
+        {
+            if (m_Entries[i].m_pTree != NULL  &&  m_Entries[i].m_iDueFrame <= m_iFrame)
+            {
+                m_Due.push_back(i);
+            }
+        }
+        std::sort(m_Due.begin(), m_Due.end(), DueEarlier(m_Entries));
+
+        uint64_t start = m_pClock();
+        FrameStats frame = { 0, 0, 0 };
+        for (size_t i=0; i<m_Due.size(); ++i)
+        {
+            Entry& entry = m_Entries[m_Due[i]];
+            if (frame.m_iTicked > 0  &&  m_iBudget > 0  &&  m_pClock() - start >= m_iBudget)
+            {
+                ++entry.m_Stats.m_iDeferCount;
+                ++frame.m_iDeferred;
+                continue;
+            }
+
+            uint32_t lateness = (uint32_t)(m_iFrame - entry.m_iDueFrame);
+            entry.m_Stats.m_iMaxLateness = std::max(entry.m_Stats.m_iMaxLateness, lateness);
+            ++entry.m_Stats.m_iTickCount;
+            ++frame.m_iTicked;
+
+            // Late trees keep their cadence from now, rather than catching up.
+            entry.m_iDueFrame = m_iFrame + entry.m_iPeriod;
+            entry.m_pTick(entry.m_pTree);
+        }
+        frame.m_iElapsed = m_pClock() - start;
+        m_LastFrame = frame;
+        ++m_iFrame;
+    }
+
+    const TreeStats& getStats(Handle handle) const
+    {
+        ASSERT(handle < m_Entries.size());
+        return m_Entries[handle].m_Stats;
+    }
+
+    const FrameStats& getLastFrame() const
+    {
+        return m_LastFrame;
+    }
+
+    uint64_t getFrame() const
+    {
+        return m_iFrame;
+    }
+
+    static uint64_t now()
+    {
+        typedef std::chrono::steady_clock Clock;
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct Entry
+    {
+        void* m_pTree;
+        void (*m_pTick)(void*);
+        uint64_t m_iDueFrame;
+        uint32_t m_iPeriod;
+        TreeStats m_Stats;
+    };
+
+    struct DueEarlier
+    {
+        const std::vector<Entry>* m_pEntries;
+
+        DueEarlier(const std::vector<Entry>& entries)
+        :	m_pEntries(&entries)
+        {
+        }
+
+        bool operator()(size_t a, size_t b) const
+        {
+            uint64_t da = (*m_pEntries)[a].m_iDueFrame, db = (*m_pEntries)[b].m_iDueFrame;
+            return da != db ? da < db : a < b;
+        }
+    };
+
+    template <class TREE>
+    static void tickTree(void* tree)
+    {
+        static_cast<TREE*>(tree)->tick();
+    }
+
+    std::vector<Entry> m_Entries;
+    std::vector<size_t> m_Due;
+    uint64_t m_iFrame;
+    uint64_t m_iBudget;
+    Clock m_pClock;
+    FrameStats m_LastFrame;
+};
+
+} // namespace lod
+
+#endif // LODSCHEDULER_H
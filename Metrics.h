@@ -0,0 +1,250 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include "Shared.h"
+
+namespace metrics
+{
+
+// ============================================================================
+// Aggregate counters that stay on in release builds, for telemetry rather
+// than profiling.  Each thread adds to a block of its own, so counting is a
+// plain load and store with no locked instruction or shared cache line, and
+// collect() sums the blocks whenever a monitoring thread asks, while trees
+// keep ticking.  Define BTSK_NO_METRICS to compile the hooks out.
+//
+// Counters only go up; rates such as ticks per second, or node updates per
+// tick, come from comparing two collections.  Gauges are kept as the sum of
+// the changes every thread made, so they add up to the current total across
+// all trees even when a tree changes threads.
+
+enum Counter
+{
+    COUNTER_TREE_TICKS,         // Whole-tree ticks in bt4, and ticked agents in bt5.
+    COUNTER_NODE_UPDATES,       // Calls to a node's update(), in every variant.
+    COUNTER_OBSERVER_CALLS,     // Observers notified by a bt4 BehaviorTree.
+    COUNTER_ABORTS,             // Behaviors cut off before finishing, in bt1, bt3 and bt5.
+    GAUGE_RUNNING_TASKS,        // Queued in bt4 trees, as of their last tick.
+    GAUGE_ARENA_BYTES,          // Allocated in bt3's BehaviorTree arenas.
+    k_CounterCount
+};
+
+inline bool isGauge(Counter counter)
+{
+    return counter >= GAUGE_RUNNING_TASKS;
+}
+
+// Named after the Prometheus conventions.
+inline const char* getName(Counter counter)
+{
+    static const char* s_Names[k_CounterCount] =
+    {
+        "btsk_tree_ticks_total",
+        "btsk_node_updates_total",
+        "btsk_observer_calls_total",
+        "btsk_aborts_total",
+        "btsk_running_tasks",
+        "btsk_arena_bytes",
+    };
+    ASSERT(counter < k_CounterCount);
+    return s_Names[counter];
+}
+
+struct Snapshot
+{
+    int64_t m_Values[k_CounterCount];
+
+    int64_t get(Counter counter) const
+    {
+        ASSERT(counter < k_CounterCount);
+        return m_Values[counter];
+    }
+};
+
+// ----------------------------------------------------------------------------
+
+class ThreadBlock
+/**
+ * One thread's counters, kept in thread-local storage so that counting
+ * needs no lookup.  Only that thread writes them; the atomics are there so
+ * collect() can read them at any time without tearing.  A block joins the
+ * registry when its thread first counts, and hands its counts over to it
+ * when the thread exits.
+ */
+{
+public:
+    // Owning thread only.
+    void add(Counter counter, int64_t amount)
+    {
+        if (!m_bJoined)
+        {
+            join();
+        }
+        std::atomic<int64_t>& value = m_Values[counter];
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    int64_t get(Counter counter) const
+    {
+        return m_Values[counter].load(std::memory_order_relaxed);
+    }
+
+    // Zero-initialized without a constructor, so using it costs no guard.
+    static ThreadBlock& getInstance()
+    {
+        static thread_local ThreadBlock instance;
+        return instance;
+    }
+
+private:
+    // Out of line, to keep the hooks small where they are inlined.
+    void join();
+
+    // Padded on both sides, so other thread-local data never shares a
+    // cache line with a block that collect() is reading.
+    char m_Padding0[64];
+    bool m_bJoined;
+    std::atomic<int64_t> m_Values[k_CounterCount];
+    char m_Padding1[64];
+};
+
+class Registry
+/**
+ * Knows every live thread's block, plus the totals of threads that have
+ * exited.  The registry itself is never destroyed, so trees can still
+ * count from static destructors.
+ */
+{
+public:
+    static Registry& getInstance()
+    {
+        static Registry* s_pInstance = new Registry;
+        return *s_pInstance;
+    }
+
+    // Safe from any thread.  Each value is exact as of some moment during
+    // the call, but different values may be from slightly different ticks.
+    void collect(Snapshot& snapshot)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        snapshot = m_Retired;
+        for (size_t i=0; i<m_Blocks.size(); ++i)
+        {
+            for (size_t c=0; c<k_CounterCount; ++c)
+            {
+                snapshot.m_Values[c] += m_Blocks[i]->get((Counter)c);
+            }
+        }
+    }
+
+private:
+    friend class ThreadBlock;
+
+    // Tied to the thread's lifetime, unlike the block itself.
+    struct Membership
+    {
+        const ThreadBlock* m_pBlock;
+
+        explicit Membership(const ThreadBlock& block)
+        :	m_pBlock(&block)
+        {
+            getInstance().addBlock(block);
+        }
+
+        ~Membership()
+        {
+            getInstance().removeBlock(*m_pBlock);
+        }
+    };
+
+    Registry()
+    {
+        for (size_t c=0; c<k_CounterCount; ++c)
+        {
+            m_Retired.m_Values[c] = 0;
+        }
+    }
+
+    void addBlock(const ThreadBlock& block)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Blocks.push_back(&block);
+    }
+
+    void removeBlock(const ThreadBlock& block)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (size_t c=0; c<k_CounterCount; ++c)
+        {
+            m_Retired.m_Values[c] += block.get((Counter)c);
+        }
+        for (size_t i=0; i<m_Blocks.size(); ++i)
+        {
+            if (m_Blocks[i] == &block)
+            {
+                m_Blocks[i] = m_Blocks.back();
+                m_Blocks.pop_back();
+                break;
+            }
+        }
+    }
+
+    std::mutex m_Mutex;
+    std::vector<const ThreadBlock*> m_Blocks;
+    Snapshot m_Retired;
+};
+
+// Counts made while the thread is exiting, after its membership has ended,
+// are lost.
+NOINLINE inline void ThreadBlock::join()
+{
+    static thread_local Registry::Membership s_Membership(*this);
+    m_bJoined = true;
+}
+
+inline void add(Counter counter, int64_t amount)
+{
+    ThreadBlock::getInstance().add(counter, amount);
+}
+
+inline void collect(Snapshot& snapshot)
+{
+    Registry::getInstance().collect(snapshot);
+}
+
+// Prometheus text exposition format, for an exporter to serve as is.
+inline void write(std::ostream& out, const Snapshot& snapshot)
+{
+    for (size_t c=0; c<k_CounterCount; ++c)
+    {
+        const char* name = getName((Counter)c);
+        out << "# TYPE " << name << (isGauge((Counter)c) ? " gauge" : " counter") << "\n"
+            << name << " " << snapshot.m_Values[c] << "\n";
+    }
+}
+
+} // namespace metrics
+
+// Hooks placed by the tree variants.  With BTSK_NO_METRICS defined they
+// expand to nothing.
+#if !defined(BTSK_NO_METRICS)
+#define METRICS_ADD(COUNTER, AMOUNT)    metrics::add(metrics::COUNTER, AMOUNT)
+#else
+#define METRICS_ADD(COUNTER, AMOUNT)    ((void)0)
+#endif
+
+#endif // METRICS_H
@@ -0,0 +1,171 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <chrono>
+
+#include "Shared.h"
+
+namespace profile
+{
+    struct NodeProfile
+    {
+        const void* m_pNode;
+        uint32_t m_iUpdateCount;
+        uint32_t m_iInitializeCount;
+        uint32_t m_iTerminateCount;
+        uint64_t m_iTotalTime;          // Nanoseconds spent in update(), children included.
+        uint64_t m_iMaxTime;
+    };
+
+    inline uint64_t now()
+    {
+        typedef std::chrono::high_resolution_clock Clock;
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    const size_t k_MaxProfiledNodes = 4096;
+
+    class ThreadProfile
+    /**
+     * Per-node statistics gathered by one thread.  Only the owning thread
+     * writes to it, so recording needs neither locks nor atomics; read it
+     * from that thread, or once it has stopped ticking trees.
+     */
+    {
+    public:
+        ThreadProfile()
+        :   m_iCount(0)
+        ,   m_iDropped(0)
+        {
+        }
+
+        void recordInitialize(const void* node)
+        {
+            NodeProfile* p = find(node);
+            if (p != NULL) ++p->m_iInitializeCount;
+        }
+
+        void recordTerminate(const void* node)
+        {
+            NodeProfile* p = find(node);
+            if (p != NULL) ++p->m_iTerminateCount;
+        }
+
+        void recordUpdate(const void* node, uint64_t time)
+        {
+            NodeProfile* p = find(node);
+            if (p == NULL)
+            {
+                return;
+            }
+            ++p->m_iUpdateCount;
+            p->m_iTotalTime += time;
+            if (time > p->m_iMaxTime)
+            {
+                p->m_iMaxTime = time;
+            }
+        }
+
+        // Profile of a node, or NULL if it hasn't been recorded.
+        const NodeProfile* getProfile(const void* node) const
+        {
+            if (m_Table.empty())
+            {
+                return NULL;
+            }
+            for (size_t i=hash(node); ; i=(i + 1) & (k_MaxProfiledNodes - 1))
+            {
+                if (m_Table[i].m_pNode == node) return &m_Table[i];
+                if (m_Table[i].m_pNode == NULL) return NULL;
+            }
+        }
+
+        // Recorded nodes, in no particular order; unused entries have no node.
+        const std::vector<NodeProfile>& getProfiles() const
+        {
+            return m_Table;
+        }
+
+        size_t getNodeCount() const
+        {
+            return m_iCount;
+        }
+
+        // Events lost because the table was full.
+        size_t getDroppedCount() const
+        {
+            return m_iDropped;
+        }
+
+        void clear()
+        {
+            m_Table.clear();
+            m_iCount = 0;
+            m_iDropped = 0;
+        }
+
+        static ThreadProfile& getInstance()
+        {
+            static thread_local ThreadProfile instance;
+            return instance;
+        }
+
+    private:
+        static size_t hash(const void* node)
+        {
+            uintptr_t p = (uintptr_t)node;
+            return (size_t)((p >> 4) ^ (p >> 16)) & (k_MaxProfiledNodes - 1);
+        }
+
+        NodeProfile* find(const void* node)
+        {
+            if (m_Table.empty())
+            {
+                NodeProfile empty = { NULL, 0, 0, 0, 0, 0 };
+                m_Table.resize(k_MaxProfiledNodes, empty);
+            }
+            for (size_t i=hash(node); ; i=(i + 1) & (k_MaxProfiledNodes - 1))
+            {
+                if (m_Table[i].m_pNode == node)
+                {
+                    return &m_Table[i];
+                }
+                if (m_Table[i].m_pNode == NULL)
+                {
+                    // Keep one slot free so lookups always terminate.
+                    if (m_iCount + 1 >= k_MaxProfiledNodes)
+                    {
+                        ++m_iDropped;
+                        return NULL;
+                    }
+                    ++m_iCount;
+                    m_Table[i].m_pNode = node;
+                    return &m_Table[i];
+                }
+            }
+        }
+
+        std::vector<NodeProfile> m_Table;
+        size_t m_iCount;
+        size_t m_iDropped;
+    };
+}
+
+// Hooks placed around Behavior::tick() by each tree variant.  Unless
+// BTSK_PROFILE is defined they expand to nothing.
+#if defined(BTSK_PROFILE)
+#define PROFILE_INITIALIZE(NODE)    profile::ThreadProfile::getInstance().recordInitialize(NODE)
+#define PROFILE_TERMINATE(NODE)     profile::ThreadProfile::getInstance().recordTerminate(NODE)
+#define PROFILE_UPDATE_BEGIN(NODE)  uint64_t profileStart_ = profile::now()
+#define PROFILE_UPDATE_END(NODE)    profile::ThreadProfile::getInstance().recordUpdate(NODE, profile::now() - profileStart_)
+#else
+#define PROFILE_INITIALIZE(NODE)    ((void)0)
+#define PROFILE_TERMINATE(NODE)     ((void)0)
+#define PROFILE_UPDATE_BEGIN(NODE)  ((void)0)
+#define PROFILE_UPDATE_END(NODE)    ((void)0)
+#endif
+
+#endif // PROFILER_H
@@ -11,4 +11,16 @@
 #define ASSERT_MSG(X, M) ASSERT(X)
 #endif
 
+#if defined(_MSC_VER)
+#define ALIGNOF(T) __alignof(T)
+#else
+#define ALIGNOF(T) __alignof__(T)
+#endif
+
+#if defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
 #endif // SHARED_H
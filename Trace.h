@@ -0,0 +1,478 @@
+/******************************************************************************
+ * This file is part of the Behavior Tree Starter Kit.
+ * 
+ * Copyright (c) 2012, AiGameDev.com
+ * 
+ * Credits:         Alex J. Champandard
+ *****************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+#include <unordered_map>
+#include "Shared.h"
+
+namespace trace
+{
+
+// ============================================================================
+// Tick recorder for finding problems that only show up rarely, under load.
+// With BTSK_TRACE defined, the variants record every initialize, update and
+// terminate into a ring buffer per thread.  The thread that owns a buffer
+// only ever adds to it, and a Writer drains the buffers into a compact
+// binary log on another thread, without locking either side.  Recording is
+// off until Recorder::setEnabled() turns it on.
+//
+// A log is a Header followed by chunks of one thread's records each:
+//
+//      varint thread, varint record count, then per record:
+//          uint8   event | status << 2 | k_NewNode | k_NewAgent
+//          varint  nanoseconds since the thread's previous record
+//          varint  node index, or with k_NewNode the node's address; new
+//                  nodes get the next index in the order they appear
+//          varint  agent, only with k_NewAgent
+//
+// Varints are little-endian base 128.  TraceReplay turns a log back into
+// per-agent timelines and flame graphs.
+
+enum Event
+{
+    EVENT_INITIALIZE,
+    EVENT_UPDATE_BEGIN,
+    EVENT_UPDATE_END,
+    EVENT_TERMINATE,
+};
+
+const uint32_t k_TraceMagic = 0x52545442;   // "BTTR"
+const uint16_t k_TraceVersion = 1;
+const size_t k_TraceBufferSize = 16384;     // Records per thread.
+const uint8_t k_NewNode = 0x40;
+const uint8_t k_NewAgent = 0x80;
+
+struct Header
+{
+    uint32_t m_iMagic;
+    uint16_t m_iVersion;
+    uint16_t m_iReserved;
+};
+
+struct Record
+{
+    uint64_t m_iTime;           // Nanoseconds.
+    const void* m_pNode;
+    uint32_t m_iAgent;
+    uint8_t m_iEvent;
+    uint8_t m_iStatus;          // The variant's status, up to 15.
+};
+
+inline uint64_t now()
+{
+    typedef std::chrono::steady_clock Clock;
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// ----------------------------------------------------------------------------
+
+class ThreadBuffer
+/**
+ * Single-producer, single-consumer ring of one thread's records.  When the
+ * writer falls behind, new records are dropped and counted rather than
+ * making the ticking thread wait.
+ */
+{
+public:
+    explicit ThreadBuffer(uint32_t thread)
+    :	m_Records(k_TraceBufferSize)
+    ,	m_iThread(thread)
+    ,	m_iHead(0)
+    ,	m_iTail(0)
+    ,	m_iDropped(0)
+    {
+    }
+
+    // Owning thread only.
+    void push(const Record& record)
+    {
+        size_t head = m_iHead.load(std::memory_order_relaxed);
+        if (head - m_iTail.load(std::memory_order_acquire) == k_TraceBufferSize)
+        {
+            m_iDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_Records[head % k_TraceBufferSize] = record;
+        m_iHead.store(head + 1, std::memory_order_release);
+    }
+
+    // Writer only; takes up to 'count' of the oldest records.
+    size_t pop(Record* records, size_t count)
+    {
+        size_t tail = m_iTail.load(std::memory_order_relaxed);
+        size_t available = m_iHead.load(std::memory_order_acquire) - tail;
+        if (count > available)
+        {
+            count = available;
+        }
+        for (size_t i=0; i<count; ++i)
+        {
+            records[i] = m_Records[(tail + i) % k_TraceBufferSize];
+        }
+        m_iTail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    uint32_t getThread() const
+    {
+        return m_iThread;
+    }
+
+    uint64_t getDroppedCount() const
+    {
+        return m_iDropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<Record> m_Records;
+    uint32_t m_iThread;
+
+    // Kept on separate cache lines so the two sides don't slow each other.
+    char m_Padding0[64];
+    std::atomic<size_t> m_iHead;
+    char m_Padding1[64];
+    std::atomic<size_t> m_iTail;
+    char m_Padding2[64];
+    std::atomic<uint64_t> m_iDropped;
+};
+
+// ----------------------------------------------------------------------------
+
+class Writer;
+
+class Recorder
+/**
+ * Owns every thread's buffer.  Buffers outlive their threads, so records
+ * from a thread that has exited can still be written.
+ */
+{
+public:
+    static Recorder& getInstance()
+    {
+        static Recorder instance;
+        return instance;
+    }
+
+    ~Recorder()
+    {
+        for (size_t i=0; i<m_Buffers.size(); ++i)
+        {
+            delete m_Buffers[i];
+        }
+    }
+
+    void setEnabled(bool enabled)
+    {
+        m_bEnabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    bool isEnabled() const
+    {
+        return m_bEnabled.load(std::memory_order_relaxed);
+    }
+
+    // The calling thread's buffer, created the first time it records.
+    ThreadBuffer& getThreadBuffer()
+    {
+        static thread_local ThreadBuffer* s_pBuffer = NULL;
+        if (s_pBuffer == NULL)
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            s_pBuffer = new ThreadBuffer((uint32_t)m_Buffers.size());
+            m_Buffers.push_back(s_pBuffer);
+        }
+        return *s_pBuffer;
+    }
+
+    // Agent that the calling thread's records belong to from now on, e.g.
+    // set before ticking each agent's tree.  Zero until set.
+    static uint32_t& getAgent()
+    {
+        static thread_local uint32_t s_iAgent = 0;
+        return s_iAgent;
+    }
+
+    void record(const void* node, Event event, uint8_t status)
+    {
+        Record r = { now(), node, getAgent(), (uint8_t)event, status };
+        getThreadBuffer().push(r);
+    }
+
+    // Move every thread's pending records into the writer.
+    inline void drain(Writer& writer);
+
+    uint64_t getDroppedCount()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        uint64_t dropped = 0;
+        for (size_t i=0; i<m_Buffers.size(); ++i)
+        {
+            dropped += m_Buffers[i]->getDroppedCount();
+        }
+        return dropped;
+    }
+
+private:
+    Recorder()
+    :	m_bEnabled(false)
+    {
+    }
+
+    std::atomic<bool> m_bEnabled;
+    std::mutex m_Mutex;
+    std::vector<ThreadBuffer*> m_Buffers;
+};
+
+inline void setAgent(uint32_t agent)
+{
+    Recorder::getAgent() = agent;
+}
+
+// ----------------------------------------------------------------------------
+
+inline void writeVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+inline bool readVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+    for (unsigned shift=0; shift<64; shift+=7)
+    {
+        if (data == end)
+        {
+            return false;
+        }
+        uint8_t byte = *data++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+class Writer
+/**
+ * Encodes records into the binary log format and streams them out.  It
+ * remembers the nodes, times and agents written so far, so keep using the
+ * same writer for the whole of one log.
+ */
+{
+public:
+    explicit Writer(std::ostream& out)
+    :	m_pOut(&out)
+    {
+        Header header = { k_TraceMagic, k_TraceVersion, 0 };
+        m_pOut->write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    void write(uint32_t thread, const Record* records, size_t count)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        if (thread >= m_Threads.size())
+        {
+            ThreadState empty = { 0, 0 };
+            m_Threads.resize(thread + 1, empty);
+        }
+        ThreadState& state = m_Threads[thread];
+
+        m_Chunk.clear();
+        writeVarint(m_Chunk, thread);
+        writeVarint(m_Chunk, count);
+        for (size_t i=0; i<count; ++i)
+        {
+            const Record& r = records[i];
+            ASSERT(r.m_iEvent < 4  &&  r.m_iStatus < 16);
+            uint8_t code = (uint8_t)(r.m_iEvent | r.m_iStatus << 2);
+
+            std::unordered_map<const void*, uint32_t>::iterator node = m_Nodes.find(r.m_pNode);
+            bool newNode = node == m_Nodes.end();
+            if (newNode)
+            {
+                node = m_Nodes.insert(std::make_pair(r.m_pNode, (uint32_t)m_Nodes.size())).first;
+                code |= k_NewNode;
+            }
+            bool newAgent = r.m_iAgent != state.m_iAgent;
+            if (newAgent)
+            {
+                code |= k_NewAgent;
+            }
+
+            m_Chunk.push_back(code);
+            writeVarint(m_Chunk, r.m_iTime >= state.m_iTime ? r.m_iTime - state.m_iTime : 0);
+            writeVarint(m_Chunk, newNode ? (uint64_t)(uintptr_t)r.m_pNode : node->second);
+            if (newAgent)
+            {
+                writeVarint(m_Chunk, r.m_iAgent);
+            }
+            state.m_iTime = r.m_iTime > state.m_iTime ? r.m_iTime : state.m_iTime;
+            state.m_iAgent = r.m_iAgent;
+        }
+        m_pOut->write(reinterpret_cast<const char*>(&m_Chunk[0]), m_Chunk.size());
+    }
+
+    void flush()
+    {
+        m_pOut->flush();
+    }
+
+private:
+    struct ThreadState
+    {
+        uint64_t m_iTime;
+        uint32_t m_iAgent;
+    };
+
+    std::ostream* m_pOut;
+    std::vector<uint8_t> m_Chunk;
+    std::vector<ThreadState> m_Threads;
+    std::unordered_map<const void*, uint32_t> m_Nodes;
+};
+
+inline void Recorder::drain(Writer& writer)
+{
+    std::vector<ThreadBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        buffers = m_Buffers;
+    }
+
+    Record records[256];
+    for (size_t i=0; i<buffers.size(); ++i)
+    {
+        while (size_t count = buffers[i]->pop(records, 256))
+        {
+            writer.write(buffers[i]->getThread(), records, count);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+struct Entry
+{
+    uint64_t m_iTime;
+    uint32_t m_iNode;           // Index into the log's node addresses.
+    uint32_t m_iAgent;
+    uint32_t m_iThread;
+    uint8_t m_iEvent;
+    uint8_t m_iStatus;
+};
+
+// Decode a whole log; on failure 'error' says what was wrong with it.
+// Entries keep the order they were written in, which is time order within
+// each thread.
+inline bool read(const uint8_t* data, size_t size, std::vector<Entry>& entries, std::vector<uint64_t>& nodes, std::string& error)
+{
+    Header header;
+    if (size < sizeof(header))
+    {
+        error = "too short";
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.m_iMagic != k_TraceMagic  ||  header.m_iVersion != k_TraceVersion)
+    {
+        error = "not a trace log, or another version";
+        return false;
+    }
+
+    struct ThreadState { uint64_t m_iTime; uint32_t m_iAgent; };
+    std::vector<ThreadState> threads;
+
+    const uint8_t* p = data + sizeof(header);
+    const uint8_t* end = data + size;
+    while (p != end)
+    {
+        uint64_t thread, count;
+        if (!readVarint(p, end, thread)  ||  !readVarint(p, end, count)  ||  thread > 0xffff)
+        {
+            error = "bad chunk header";
+            return false;
+        }
+        if (thread >= threads.size())
+        {
+            ThreadState empty = { 0, 0 };
+            threads.resize((size_t)thread + 1, empty);
+        }
+        ThreadState& state = threads[(size_t)thread];
+
+        for (uint64_t i=0; i<count; ++i)
+        {
+            uint64_t delta, node, agent = state.m_iAgent;
+            if (p == end)
+            {
+                error = "truncated record";
+                return false;
+            }
+            uint8_t code = *p++;
+            if (!readVarint(p, end, delta)  ||  !readVarint(p, end, node)
+            ||  ((code & k_NewAgent)  &&  !readVarint(p, end, agent)))
+            {
+                error = "truncated record";
+                return false;
+            }
+            if (code & k_NewNode)
+            {
+                nodes.push_back(node);
+                node = nodes.size() - 1;
+            }
+            else if (node >= nodes.size())
+            {
+                error = "unknown node";
+                return false;
+            }
+
+            state.m_iTime += delta;
+            state.m_iAgent = (uint32_t)agent;
+            Entry e = { state.m_iTime, (uint32_t)node, state.m_iAgent, (uint32_t)thread, (uint8_t)(code & 3), (uint8_t)((code >> 2) & 15) };
+            entries.push_back(e);
+        }
+    }
+    return true;
+}
+
+} // namespace trace
+
+// Hooks placed next to the profiling ones around Behavior::tick().  Unless
+// BTSK_TRACE is defined they expand to nothing.
+#if defined(BTSK_TRACE)
+#define TRACE_EVENT(NODE, EVENT, STATUS) \
+    do { if (trace::Recorder::getInstance().isEnabled()) trace::Recorder::getInstance().record(NODE, EVENT, (uint8_t)(STATUS)); } while (0)
+#else
+#define TRACE_EVENT(NODE, EVENT, STATUS) ((void)0)
+#endif
+
+#define TRACE_INITIALIZE(NODE)          TRACE_EVENT(NODE, trace::EVENT_INITIALIZE, 0)
+#define TRACE_UPDATE_BEGIN(NODE)        TRACE_EVENT(NODE, trace::EVENT_UPDATE_BEGIN, 0)
+#define TRACE_UPDATE_END(NODE, STATUS)  TRACE_EVENT(NODE, trace::EVENT_UPDATE_END, STATUS)
+#define TRACE_TERMINATE(NODE, STATUS)   TRACE_EVENT(NODE, trace::EVENT_TERMINATE, STATUS)
+
+#endif // TRACE_H
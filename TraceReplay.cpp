@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include "Trace.h"
+
+// Turns a log written by trace::Writer back into something readable:
+//
+//      --timeline [AGENT]  every event, grouped by agent in time order
+//      --folded            update times as folded stacks, one line per call
+//                          path, for flamegraph.pl and similar tools
+//
+// Nodes are named by the index they were given in the log.
+
+namespace
+{
+
+const char* getEventName(uint8_t event)
+{
+    static const char* s_Names[] = { "initialize", "update", "updated", "terminate" };
+    return s_Names[event & 3];
+}
+
+// The first four statuses are the same in every variant; the rest differ.
+std::string getStatusName(uint8_t status)
+{
+    static const char* s_Names[] = { "invalid", "success", "failure", "running" };
+    if (status < 4)
+    {
+        return s_Names[status];
+    }
+    std::ostringstream name;
+    name << "status " << (int)status;
+    return name.str();
+}
+
+bool byAgent(const trace::Entry& a, const trace::Entry& b)
+{
+    return a.m_iAgent != b.m_iAgent ? a.m_iAgent < b.m_iAgent : a.m_iTime < b.m_iTime;
+}
+
+void printTimeline(std::vector<trace::Entry>& entries, const std::vector<uint64_t>& nodes, bool filter, uint32_t agent)
+{
+    std::stable_sort(entries.begin(), entries.end(), byAgent);
+    uint64_t start = entries.empty() ? 0 : entries[0].m_iTime;
+    for (size_t i=0; i<entries.size(); ++i)
+    {
+        start = std::min(start, entries[i].m_iTime);
+    }
+
+    for (size_t i=0; i<entries.size(); ++i)
+    {
+        const trace::Entry& e = entries[i];
+        if (filter  &&  e.m_iAgent != agent)
+        {
+            continue;
+        }
+        if (i == 0  ||  e.m_iAgent != entries[i - 1].m_iAgent)
+        {
+            std::cout << "agent " << e.m_iAgent << std::endl;
+        }
+        std::cout << "  " << (e.m_iTime - start) / 1000.0 << " us  thread " << e.m_iThread
+                  << "  node" << e.m_iNode << " (0x" << std::hex << nodes[e.m_iNode] << std::dec << ")  "
+                  << getEventName(e.m_iEvent);
+        if (e.m_iEvent == trace::EVENT_UPDATE_END  ||  e.m_iEvent == trace::EVENT_TERMINATE)
+        {
+            std::cout << " " << getStatusName(e.m_iStatus);
+        }
+        std::cout << std::endl;
+    }
+}
+
+// Self time of each call path, i.e. time spent in a node's update() minus
+// that of the children it updated.  Paths start with the agent.
+void printFolded(const std::vector<trace::Entry>& entries)
+{
+    struct Frame
+    {
+        uint32_t m_iNode;
+        uint64_t m_iStart;
+        uint64_t m_iChildren;
+    };
+    std::map<uint32_t, std::vector<Frame> > stacks;
+    std::map<std::string, uint64_t> paths;
+
+    for (size_t i=0; i<entries.size(); ++i)
+    {
+        const trace::Entry& e = entries[i];
+        std::vector<Frame>& stack = stacks[e.m_iThread];
+        if (e.m_iEvent == trace::EVENT_UPDATE_BEGIN)
+        {
+            Frame frame = { e.m_iNode, e.m_iTime, 0 };
+            stack.push_back(frame);
+            continue;
+        }
+        if (e.m_iEvent != trace::EVENT_UPDATE_END)
+        {
+            continue;
+        }
+
+        // Updates skipped by resuming deeper down, e.g. with an ActivePath,
+        // leave frames without an end; drop them.
+        size_t depth = stack.size();
+        while (depth > 0  &&  stack[depth - 1].m_iNode != e.m_iNode)
+        {
+            --depth;
+        }
+        if (depth == 0)
+        {
+            continue;
+        }
+        stack.resize(depth);
+
+        std::ostringstream path;
+        path << "agent " << e.m_iAgent;
+        for (size_t f=0; f<stack.size(); ++f)
+        {
+            path << ";node" << stack[f].m_iNode;
+        }
+
+        uint64_t total = e.m_iTime - stack.back().m_iStart;
+        uint64_t children = stack.back().m_iChildren;
+        paths[path.str()] += total > children ? total - children : 0;
+        stack.pop_back();
+        if (!stack.empty())
+        {
+            stack.back().m_iChildren += total;
+        }
+    }
+
+    for (std::map<std::string, uint64_t>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        std::cout << it->first << " " << it->second << std::endl;
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    if ((mode != "--timeline"  &&  mode != "--folded")  ||  argc < 3  ||  argc > 4  ||  (mode == "--folded"  &&  argc != 3))
+    {
+        std::cerr << "usage: " << argv[0] << " --timeline [AGENT] TRACE.bin" << std::endl
+                  << "       " << argv[0] << " --folded TRACE.bin" << std::endl;
+        return 1;
+    }
+    const char* file = argv[argc - 1];
+
+    std::ifstream input(file, std::ios::binary);
+    if (!input)
+    {
+        std::cerr << file << ": cannot open file" << std::endl;
+        return 1;
+    }
+    std::stringstream data;
+    data << input.rdbuf();
+    std::string log = data.str();
+
+    std::vector<trace::Entry> entries;
+    std::vector<uint64_t> nodes;
+    std::string error;
+    if (!trace::read((const uint8_t*)log.data(), log.size(), entries, nodes, error))
+    {
+        std::cerr << file << ": " << error << std::endl;
+        return 1;
+    }
+
+    if (mode == "--timeline")
+    {
+        printTimeline(entries, nodes, argc == 4, argc == 4 ? (uint32_t)strtoul(argv[2], NULL, 10) : 0);
+    }
+    else
+    {
+        printFolded(entries);
+    }
+    return 0;
+}